@@ -11,6 +11,25 @@ parser.add_argument('--type', dest='stype', type=str, default='SUB')
 parser.add_argument('--host', dest='host', type=str, default='tcp://127.0.0.1:1234')
 
 args = parser.parse_args()
+
+
+def decompress(info, chunks):
+    """join the chunks of a compressed data part, each holds chunkSize bytes but the last"""
+    dtype = numpy.dtype(str(info['type']))
+    remaining = info['uncompressedSize']
+    parts = []
+    for chunk in chunks:
+        size = min(info['chunkSize'], remaining)
+        remaining -= size
+        if info['codec'] == 'lz4':
+            import lz4.block
+            parts.append(lz4.block.decompress(chunk, uncompressed_size=size))
+        else:
+            import bitshuffle
+            parts.append(bitshuffle.decompress_lz4(numpy.frombuffer(chunk, numpy.uint8),
+                                                   (size // dtype.itemsize,), dtype).tobytes())
+    return numpy.frombuffer(b''.join(parts), dtype=dtype)
+
 if args.stype == 'SUB' or args.stype == 'PUB':
     stype = zmq.SUB
 elif args.stype == 'PULL' or args.stype == 'PUSH':
@@ -39,7 +58,30 @@ while True:
     print(header)
     info = json.loads(header)
 
-    # receive data
-    data = numpy.frombuffer(sock.recv(), dtype=str(info['type']))
+    # a batch: the headers of several arrays, whose data follows in one part
+    if isinstance(info, list):
+        batch = sock.recv()
+        offset = 0
+        for item in info:
+            dtype = numpy.dtype(str(item['type']))
+            count = int(numpy.prod(item['shape']))
+            data = numpy.frombuffer(batch, dtype=dtype, count=count, offset=offset)
+            offset += count * dtype.itemsize
+            print(item['frame'], data.sum(), data)
+        continue
+
+    # receive data, in compressed chunks if the header names a codec
+    if 'codec' in info:
+        chunks = []
+        while sock.getsockopt(zmq.RCVMORE):
+            chunks.append(sock.recv())
+        data = decompress(info, chunks)
+    elif 'ndcodec' in info:
+        # compressed upstream by NDPluginCodec, sent as it is
+        data = sock.recv()
+        print('%s: %d bytes compressed from %d'%(info['ndcodec'], len(data), info['uncompressedSize']))
+        continue
+    else:
+        data = numpy.frombuffer(sock.recv(), dtype=str(info['type']))
     data.reshape(info['shape'])
     print(data.sum(),data)
@@ -10,88 +10,132 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <string>
 #include <iocsh.h>
-#include <sstream>
 
 #include <zmq.h>
 #include "NDPluginZMQ.h"
+#include "ZMQHeader.h"
 #include <ADCoreVersion.h>
 
+#include <epicsThread.h>
+#include <epicsStdio.h>
 #include <epicsExport.h>
 
 
 static const char *driverName = "NDPluginZMQ";
 
-/** Helper function to convert NDAttributeList to JSON object
- * \param[in] pAttributeList The NDAttributeList.
+/* suffixes of the stage timing parameters, in the order of ZMQPluginStage_t */
+static const char *const stageNames[ZMQNumPluginStages] = {"SERIALIZE", "SEND"};
+
+/* nanoseconds between updates of the send counters while arrays are being sent */
+#define ZMQ_SEND_PUBLISH_PERIOD 500000000u
+
+/* seconds an idle send thread of a publisher waits before reading subscriptions again */
+#define ZMQ_SUBSCRIPTION_POLL_PERIOD 0.1
+
+/* libzmq is done with the data of a sent array, called from its I/O thread */
+static void releaseSentArray(void *data, void *hint) {
+    ((NDArray *) hint)->release();
+}
+
+/* libzmq is done with a sent chunk */
+static void freeSentChunk(void *data, void *hint) {
+    free(data);
+}
+
+/* only arrays sent uncompressed with JSON headers are sent together */
+static bool canBatch(const ZMQSendItem &item) {
+    if (item.batchSize < 2 || item.headerFormat != ZMQHeaderJSON || item.codec != ZMQCodecNone)
+        return false;
+#ifdef ZMQ_NDARRAY_CODEC
+    if (!item.pArray->codec.name.empty())
+        return false;
+#endif
+    return true;
+}
+
+/** Helper function to compose the chunk-1.0 JSON header of an NDArray
+ * \param[in] pArray The NDArray.
+ * \param[in] sendTime The time the header is sent.
+ * \return The header, empty if the data type is not supported.
  */
-std::string NDPluginZMQ::getAttributesAsJSON(NDAttributeList *pAttributeList) {
-    std::stringstream sjson, svalue;
-    std::string sdataType;
-    sjson << '{';
-
-    NDAttribute *pAttr = pAttributeList->next(NULL);
-    while (pAttr != NULL) {
-        NDAttrDataType_t attrDataType;
-        size_t attrDataSize;
-        void *value;
-        svalue.str("");
-
-        pAttr->getValueInfo(&attrDataType, &attrDataSize);
-        value = calloc(1, attrDataSize);
-        pAttr->getValue(attrDataType, value, attrDataSize);
-        switch (attrDataType) {
-            case NDAttrInt8:
-                svalue << *((epicsInt8 *) value);
-                sdataType = "\"int8\"";
-                break;
-            case NDAttrUInt8:
-                svalue << *((epicsUInt8 *) value);
-                sdataType = "\"uint8\"";
-                break;
-            case NDAttrInt16:
-                svalue << *((epicsInt16 *) value);
-                sdataType = "\"int16\"";
-                break;
-            case NDAttrUInt16:
-                svalue << *((epicsUInt16 *) value);
-                sdataType = "\"uint16\"";
-                break;
-            case NDAttrInt32:
-                svalue << *((epicsInt32 *) value);
-                sdataType = "\"int32\"";
-                break;
-            case NDAttrUInt32:
-                svalue << *((epicsUInt32 *) value);
-                sdataType = "\"uint32\"";
-                break;
-            case NDAttrFloat32:
-                svalue << *((epicsFloat32 *) value);
-                sdataType = "\"float32\"";
-                break;
-            case NDAttrFloat64:
-                svalue << *((epicsFloat64 *) value);
-                sdataType = "\"float64\"";
-                break;
-            case NDAttrString:
-                svalue << "\"" << (char *) value << "\"";
-                sdataType = "\"string\"";
-                break;
-            default:
-                break;
-        }
-        sjson << "\"" << pAttr->getName() << "\":{ \"value\":" << svalue.str();
-        sjson << ",\"dataType\":" << sdataType << "}";
+std::string NDPluginZMQ::getHeaderAsJSON(NDArray *pArray, const epicsTimeStamp &sendTime) {
+    ZMQHeaderWriter writer;
+    size_t size = writer.encode(pArray, sendTime);
+
+    return std::string(writer.data(), size);
+}
+
+/* queue an array for a send thread, which releases it once it has been sent.
+ * Called with the lock held, which is released while waiting for room. */
+void NDPluginZMQ::queueArray(NDArray *pArray) {
+    int policy, queueSize, inOrder, attributeDelta;
+    double batchLinger;
+    ZMQSendItem item;
+    bool queued = true;
+
+    getIntegerParam(zmqHeaderFormatParam, &item.headerFormat);
+    getIntegerParam(zmqSendPolicyParam, &policy);
+    getIntegerParam(zmqSendQueueSizeParam, &queueSize);
+    getIntegerParam(zmqSendInOrderParam, &inOrder);
+    getIntegerParam(zmqAttributeDeltaParam, &attributeDelta);
+    getIntegerParam(zmqAttributeKeyPeriodParam, &item.keyPeriod);
+    getIntegerParam(zmqCompressionParam, &item.codec);
+    getIntegerParam(zmqBatchSizeParam, &item.batchSize);
+    getDoubleParam(zmqBatchLingerParam, &batchLinger);
+    item.batchLinger = batchLinger > 0 ? (uint64_t) (batchLinger * 1e9) : 0;
+    if (!attributeDelta || item.keyPeriod < 1)
+        item.keyPeriod = 0;
+    if (!zmqCodecAvailable(item.codec))
+        item.codec = ZMQCodecNone;
+    if (queueSize < 1)
+        queueSize = 1;
+    /* without a send thread nothing would ever make room */
+    if (this->runningSenders == 0)
+        policy = ZMQSendDropNewest;
 
-        free(value);
-        pAttr = pAttributeList->next(pAttr);
-        if (pAttr != NULL)
-            sjson << ',';
+    this->unlock();
+
+    pArray->reserve();
+    item.pArray = pArray;
+    item.inOrder = inOrder != 0;
+    item.sequence = 0;
+    item.queuedNs = zmqMonotonicNs();
+    epicsMutexLock(this->sendLock);
+    while ((int) this->sendQueue.size() >= queueSize) {
+        /* once the send threads are told to exit nothing makes room any more */
+        if (policy == ZMQSendDropNewest || this->sendExit) {
+            queued = false;
+            break;
+        } else if (policy == ZMQSendDropOldest) {
+            this->sendQueue.front().pArray->release();
+            this->sendQueue.pop_front();
+            this->framesDropped++;
+        } else {
+            epicsMutexUnlock(this->sendLock);
+            epicsEventWait(this->spaceEvent);
+            epicsMutexLock(this->sendLock);
+        }
+    }
+    if (queued) {
+        std::deque<ZMQSendItem>::iterator pos = this->sendQueue.end();
+        /* keep the queue in frame order */
+        if (item.inOrder)
+            while (pos != this->sendQueue.begin() && (pos - 1)->pArray->uniqueId > pArray->uniqueId)
+                --pos;
+        this->sendQueue.insert(pos, item);
+    }
+    epicsMutexUnlock(this->sendLock);
+    if (queued) {
+        epicsEventSignal(this->sendEvent);
+    } else {
+        pArray->release();
+        this->framesDropped++;
     }
-    sjson << '}';
 
-    return sjson.str();
+    this->lock();
 }
 
 /** Callback function that is called by the NDArray driver with new NDArray data.
@@ -99,12 +143,6 @@ std::string NDPluginZMQ::getAttributesAsJSON(NDAttributeList *pAttributeList) {
   */
 void NDPluginZMQ::processCallbacks(NDArray *pArray) {
     int arrayCounter;
-    std::string type;
-    std::ostringstream shape;
-    std::ostringstream header;
-    NDArrayInfo_t arrayInfo;
-
-    const char *functionName = "processCallbacks";
 
     /* Most plugins want to increment the arrayCounter each time they are called, which NDPluginDriver
      * does.  However, for this plugin we only want to increment it when we actually got a callback we were
@@ -123,78 +161,441 @@ void NDPluginZMQ::processCallbacks(NDArray *pArray) {
     this->pArrays[0] = pArray;
 #endif
 
-    /* Get NDArray attributes */
+    /* a publisher without subscribers has nobody to compose a header for */
+    if (this->socketType != ZMQ_XPUB || this->subscribedTopics > 0)
+        this->queueArray(pArray);
+
+    /* Update the parameters.  */
+#if ADCORE_VERSION >= 3
+    NDPluginDriver::endProcessCallbacks(pArray, true, true);
+#else
+    arrayCounter++;
+    setIntegerParam(NDArrayCounter, arrayCounter);
+#endif
+    callParamCallbacks();
+}
+
+/* wait until the arrays taken off the queue before this one have been handed to ZeroMQ,
+ * false if the plugin is shutting down */
+bool NDPluginZMQ::waitForTurn(ZMQSender *pSender, const ZMQSendItem &item) {
+    if (!item.inOrder)
+        return true;
+    while ((int) (item.sequence - this->turnSequence) > 0) {
+        if (this->sendExit)
+            return false;
+        epicsEventWaitWithTimeout(pSender->turnEvent, 0.1);
+    }
+    return true;
+}
+
+/* arrays have been handed to ZeroMQ or dropped, let the next ones go */
+void NDPluginZMQ::endTurn(unsigned count) {
+    this->turnSequence += count;
+    for (size_t i = 0; i < this->senders.size(); i++)
+        epicsEventSignal(this->senders[i]->turnEvent);
+}
+
+/* compress an array into chunks of the sender, false if a chunk could not be compressed */
+bool NDPluginZMQ::compressArray(ZMQSender *pSender, NDArray *pArray, int codec) {
+    NDArrayInfo_t arrayInfo;
+    size_t chunkSize, compressed = 0;
+    uint64_t start = zmqMonotonicNs();
+
     pArray->getInfo(&arrayInfo);
+    chunkSize = zmqCodecChunkSize(arrayInfo.bytesPerElement);
+    for (size_t offset = 0; offset < arrayInfo.totalBytes; offset += chunkSize) {
+        size_t size = arrayInfo.totalBytes - offset < chunkSize ? arrayInfo.totalBytes - offset : chunkSize;
+        ZMQChunk chunk;
+        chunk.data = malloc(zmqCodecBound(codec, size, arrayInfo.bytesPerElement));
+        chunk.size = chunk.data ? zmqCompressChunk(codec, (char *) pArray->pData + offset, size,
+                                                   arrayInfo.bytesPerElement, chunk.data) : 0;
+        if (chunk.size == 0) {
+            free(chunk.data);
+            this->freeChunks(pSender);
+            return false;
+        }
+        pSender->chunks.push_back(chunk);
+        compressed += chunk.size;
+    }
+    this->compressNs += zmqMonotonicNs() - start;
+    this->uncompressedBytes += arrayInfo.totalBytes;
+    this->compressedBytes += compressed;
+    return true;
+}
 
-    this->unlock();
+/* free chunks that were not handed to libzmq */
+void NDPluginZMQ::freeChunks(ZMQSender *pSender) {
+    for (size_t i = 0; i < pSender->chunks.size(); i++)
+        free(pSender->chunks[i].data);
+    pSender->chunks.clear();
+}
 
-    /* compose JSON header */
-    switch (pArray->dataType) {
-        case NDInt8:
-            type = "int8";
-            break;
-        case NDUInt8:
-            type = "uint8";
-            break;
-        case NDInt16:
-            type = "int16";
-            break;
-        case NDUInt16:
-            type = "uint16";
-            break;
-        case NDInt32:
-            type = "int32";
-            break;
-        case NDUInt32:
-            type = "uint32";
-            break;
-        case NDFloat32:
-            type = "float32";
-            break;
-        case NDFloat64:
-            type = "float64";
-            break;
-        default:
-            fprintf(stderr, "%s:%s: Data type not supported (%s)\n", driverName, functionName, pArray->dataType);
-            return;
+/* compose the header of an array and send it with the data, the array is released when it has been sent */
+void NDPluginZMQ::sendArray(ZMQSender *pSender, const ZMQSendItem &item) {
+    NDArray *pArray = item.pArray;
+    const char *pHeader;
+    size_t headerSize, dataSize = 0, arraySize;
+    int codec = item.codec;
+    NDArrayInfo_t arrayInfo;
+    zmq_msg_t message;
+    epicsTimeStamp sendTime;
+    ZMQStageClock clock;
+    bool turn;
+    int headerFlags;
+    const char *functionName = "sendArray";
+
+    /* an array compressed upstream is sent as it is, the header names its codec */
+    pArray->getInfo(&arrayInfo);
+    arraySize = arrayInfo.totalBytes;
+#ifdef ZMQ_NDARRAY_CODEC
+    if (!pArray->codec.name.empty()) {
+        arraySize = pArray->compressedSize;
+        codec = ZMQCodecNone;
     }
+#endif
 
-    shape << '[';
-    for (int i = 0; i < pArray->ndims; i++) {
-        shape << pArray->dims[i].size;
-        if (i != pArray->ndims - 1)
-            shape << ',';
+    /* compose header, stamped with the time it is sent for the receiver to measure the latency */
+    epicsTimeGetCurrent(&sendTime);
+    if (item.headerFormat == ZMQHeaderBinary) {
+        headerSize = zmqEncodeBinaryHeader(pArray, sendTime, pSender->headerBuffer, codec);
+        pHeader = headerSize ? &pSender->headerBuffer[0] : NULL;
+    } else {
+        pSender->jsonHeader.setKeyPeriod(item.keyPeriod);
+        headerSize = pSender->jsonHeader.encode(pArray, sendTime, codec);
+        pHeader = pSender->jsonHeader.data();
+    }
+    if (headerSize == 0)
+        fprintf(stderr, "%s:%s: Data type not supported (%d)\n", driverName, functionName, pArray->dataType);
+
+    /* compress before waiting for the turn so that the send threads compress in parallel,
+     * the chunks are all that is sent from then on */
+    if (codec != ZMQCodecNone && headerSize != 0) {
+        if (!this->compressArray(pSender, pArray, codec)) {
+            fprintf(stderr, "%s:%s: Unable to compress array %d\n", driverName, functionName, pArray->uniqueId);
+            headerSize = 0;
+        }
+        pArray->release();
+        pArray = NULL;
     }
-    shape << ']';
+    if (headerSize != 0)
+        clock.stop(this->stageTimes[ZMQStageSerialize]);
+
+    /* headers are composed in parallel, only the hand over to ZeroMQ waits for the earlier arrays */
+    turn = this->waitForTurn(pSender, item);
+    if (headerSize == 0 || !turn) {
+        if (pArray)
+            pArray->release();
+        this->freeChunks(pSender);
+        this->framesDropped++;
+        this->endTurn();
+        return;
+    }
+    clock.restart();
+
+    /* send header, an empty compressed array has no data part */
+    headerFlags = pArray || !pSender->chunks.empty() ? ZMQ_SNDMORE : 0;
+    if (!this->sendHeader(pSender, pHeader, headerSize, headerFlags)) {
+        if (pArray)
+            pArray->release();
+        this->freeChunks(pSender);
+        this->framesDropped++;
+        this->endTurn();
+        return;
+    }
+    if (pArray) {
+        /* send data without copying it, the array is held until libzmq has written it out */
+        zmq_msg_init_data(&message, pArray->pData, arraySize, releaseSentArray, pArray);
+        if (zmq_msg_send(&message, pSender->socket, 0) == -1)
+            zmq_msg_close(&message);
+        dataSize = arraySize;
+    } else {
+        /* a part per chunk, which libzmq frees once it has written it out */
+        for (size_t i = 0; i < pSender->chunks.size(); i++) {
+            const ZMQChunk &chunk = pSender->chunks[i];
+            zmq_msg_init_data(&message, chunk.data, chunk.size, freeSentChunk, NULL);
+            if (zmq_msg_send(&message, pSender->socket, i + 1 < pSender->chunks.size() ? ZMQ_SNDMORE : 0) == -1)
+                zmq_msg_close(&message);
+            dataSize += chunk.size;
+        }
+        pSender->chunks.clear();
+    }
+    this->endTurn();
+    clock.stop(this->stageTimes[ZMQStageSend]);
 
-    header << "{\"htype\":[\"chunk-1.0\"], "
-           << "\"type\":" << "\"" << type << "\", "
-           << "\"shape\":" << shape.str() << ", "
-           << "\"frame\":" << pArray->uniqueId << ", "
-           << "\"ndattr\":" << getAttributesAsJSON(pArray->pAttributeList)
-           << "}";
+    this->framesSent++;
+    this->messagesSent++;
+    this->bytesSent += headerSize + dataSize;
+}
 
-    /* send header*/
-    std::string msg = header.str();
-    zmq_send(this->socket, msg.c_str(), msg.length(), ZMQ_SNDMORE);
-    /* send data */
-    zmq_send(this->socket, pArray->pData, arrayInfo.totalBytes, 0);
+/* send the arrays of a batch in one message: a batch header with their chunk-1.0 headers, and a single
+ * data part with their data one after the other. The data is copied so that the arrays go back to the
+ * pool straight away, and the copy is freed by libzmq once it has been written out. */
+void NDPluginZMQ::sendBatch(ZMQSender *pSender) {
+    const std::vector<ZMQSendItem> &batch = pSender->batch;
+    size_t headerSize, dataSize = 0, offset = 0;
+    char *data = NULL;
+    NDArrayInfo_t arrayInfo;
+    zmq_msg_t message;
+    epicsTimeStamp sendTime;
+    ZMQStageClock clock;
+    bool turn;
+    const char *functionName = "sendBatch";
+
+    pSender->batchArrays.clear();
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].pArray->getInfo(&arrayInfo);
+        dataSize += arrayInfo.totalBytes;
+        pSender->batchArrays.push_back(batch[i].pArray);
+    }
 
-    this->lock();
+    /* compose header, stamped with the time it is sent for the receiver to measure the latency */
+    epicsTimeGetCurrent(&sendTime);
+    pSender->jsonHeader.setKeyPeriod(batch[0].keyPeriod);
+    headerSize = zmqEncodeBatchHeader(&pSender->batchArrays[0], batch.size(), sendTime, pSender->jsonHeader,
+                                      pSender->headerBuffer);
+    if (headerSize == 0)
+        fprintf(stderr, "%s:%s: Data type not supported\n", driverName, functionName);
+    else if ((data = (char *) malloc(dataSize > 0 ? dataSize : 1)) == NULL)
+        fprintf(stderr, "%s:%s: Unable to allocate %lu bytes\n", driverName, functionName, (unsigned long) dataSize);
+    for (size_t i = 0; i < batch.size(); i++) {
+        NDArray *pArray = batch[i].pArray;
+        if (data) {
+            pArray->getInfo(&arrayInfo);
+            memcpy(data + offset, pArray->pData, arrayInfo.totalBytes);
+            offset += arrayInfo.totalBytes;
+        }
+        pArray->release();
+    }
+    if (data)
+        clock.stop(this->stageTimes[ZMQStageSerialize]);
+
+    turn = this->waitForTurn(pSender, batch[0]);
+    if (!data || !turn || !this->sendHeader(pSender, &pSender->headerBuffer[0], headerSize, ZMQ_SNDMORE)) {
+        free(data);
+        this->framesDropped += (int) batch.size();
+        this->endTurn((unsigned) batch.size());
+        return;
+    }
+    zmq_msg_init_data(&message, data, dataSize, freeSentChunk, NULL);
+    if (zmq_msg_send(&message, pSender->socket, 0) == -1)
+        zmq_msg_close(&message);
+    this->endTurn((unsigned) batch.size());
+    clock.stop(this->stageTimes[ZMQStageSend]);
+
+    this->framesSent += (int) batch.size();
+    this->messagesSent++;
+    this->bytesSent += headerSize + dataSize;
+}
 
-    /* Update the parameters.  */
-#if ADCORE_VERSION >= 3
-    NDPluginDriver::endProcessCallbacks(pArray, true, true);
-#else
-    arrayCounter++;
-    setIntegerParam(NDArrayCounter, arrayCounter);
-#endif
+/* send a header, waiting for room at the high water mark without blocking inside libzmq so that
+ * the plugin can still shut down. The data parts are then always accepted.
+ * False if the header could not be sent. */
+bool NDPluginZMQ::sendHeader(ZMQSender *pSender, const char *pHeader, size_t headerSize, int flags) {
+    zmq_pollitem_t pollItem;
+
+    pollItem.socket = pSender->socket;
+    pollItem.fd = 0;
+    pollItem.events = ZMQ_POLLOUT;
+    while (zmq_send(pSender->socket, pHeader, headerSize, flags | ZMQ_DONTWAIT) == -1) {
+        if (zmq_errno() != EAGAIN || this->sendExit)
+            return false;
+        zmq_poll(&pollItem, 1, 100);
+    }
+    return true;
+}
+
+/* update the send counters, called without the lock */
+void NDPluginZMQ::publishSendStatistics(int queued) {
+    uint64_t now = zmqMonotonicNs();
+    uint64_t bytes = this->bytesSent;
+    uint64_t uncompressed = this->uncompressedBytes, compressed = this->compressedBytes;
+    uint64_t compressNs = this->compressNs;
+
+    this->lock();
+    setIntegerParam(zmqFramesSentParam, this->framesSent);
+    setIntegerParam(zmqFramesDroppedParam, this->framesDropped);
+    setIntegerParam(zmqMessagesSentParam, this->messagesSent);
+    setIntegerParam(zmqSendQueuedParam, queued);
+    if (now > this->lastRateTime)
+        setDoubleParam(zmqSendRateParam, (bytes - this->lastRateBytes) * 1e9 / (now - this->lastRateTime));
+    this->lastRateTime = now;
+    this->lastRateBytes = bytes;
+    /* the compression figures keep their last value while nothing is compressed */
+    if (compressed > this->lastCompressedBytes)
+        setDoubleParam(zmqCompressionRatioParam,
+                       (double) (uncompressed - this->lastUncompressedBytes) / (compressed - this->lastCompressedBytes));
+    if (compressNs > this->lastCompressNs)
+        setDoubleParam(zmqCompressRateParam,
+                       (uncompressed - this->lastUncompressedBytes) * 1e9 / (compressNs - this->lastCompressNs));
+    this->lastUncompressedBytes = uncompressed;
+    this->lastCompressedBytes = compressed;
+    this->lastCompressNs = compressNs;
+    this->stageTimes.publishIfDue(this);
     callParamCallbacks();
+    this->unlock();
+}
+
+/* keep track of the subscriptions an XPUB socket has passed on, only called by its send thread.
+ * Without ZMQ_XPUB_VERBOSE each topic is passed on when its first subscriber arrives
+ * and its last one leaves, so this counts topics, not subscribers: it only tells whether anyone is
+ * subscribed. */
+void NDPluginZMQ::readSubscriptions(ZMQSender *pSender) {
+    zmq_msg_t message;
+    bool changed = false;
+
+    if (this->socketType != ZMQ_XPUB)
+        return;
+    zmq_msg_init(&message);
+    while (zmq_msg_recv(&message, pSender->socket, ZMQ_DONTWAIT) >= 0) {
+        const char *data = (const char *) zmq_msg_data(&message);
+        size_t size = zmq_msg_size(&message);
+        if (size == 0 || (data[0] != 0 && data[0] != 1))
+            continue;
+        std::string topic(data + 1, size - 1);
+        if (data[0] == 1 && pSender->subscriptions.insert(topic).second) {
+            this->subscribedTopics++;
+            changed = true;
+        } else if (data[0] == 0 && pSender->subscriptions.erase(topic)) {
+            this->subscribedTopics--;
+            changed = true;
+        }
+    }
+    zmq_msg_close(&message);
+
+    if (changed) {
+        this->lock();
+        setIntegerParam(zmqSubscribedTopicsParam, this->subscribedTopics);
+        callParamCallbacks();
+        this->unlock();
+    }
+}
+
+/* take the next array off the queue, with the arrays queued right after it that may be sent in the same
+ * message. A batch that is not full waits for more until its first array has been queued for the linger
+ * time. Called with sendLock held, false if the batch is still waiting, for wait seconds at most. */
+bool NDPluginZMQ::takeBatch(ZMQSender *pSender, double &wait) {
+    const ZMQSendItem &first = this->sendQueue.front();
+    size_t ready = 1;
+
+    if (canBatch(first)) {
+        uint64_t waited = zmqMonotonicNs() - first.queuedNs;
+        while (ready < this->sendQueue.size() && ready < (size_t) first.batchSize && canBatch(this->sendQueue[ready]))
+            ready++;
+        if (ready < (size_t) first.batchSize && waited < first.batchLinger) {
+            wait = (first.batchLinger - waited) / 1e9;
+            return false;
+        }
+    }
+
+    pSender->batch.clear();
+    for (size_t i = 0; i < ready; i++) {
+        pSender->batch.push_back(this->sendQueue.front());
+        pSender->batch.back().sequence = this->takeSequence++;
+        this->sendQueue.pop_front();
+    }
+    return true;
+}
+
+/* send thread: takes arrays off the queue in order and sends them on its own socket */
+void NDPluginZMQ::sendTask(ZMQSender *pSender) {
+    size_t queued;
+    double wait;
+    uint64_t lastPublished = 0;
+    bool idle = false;
+
+    epicsMutexLock(this->sendLock);
+    while (!this->sendExit) {
+        if (this->sendQueue.empty()) {
+            epicsMutexUnlock(this->sendLock);
+            /* the rate drops to 0 once everything has been sent */
+            if (!idle) {
+                this->publishSendStatistics(0);
+                lastPublished = zmqMonotonicNs();
+                idle = true;
+            }
+            /* subscriptions are only seen when the socket is read, so keep reading it while idle */
+            this->readSubscriptions(pSender);
+            if (this->socketType == ZMQ_XPUB)
+                epicsEventWaitWithTimeout(this->sendEvent, ZMQ_SUBSCRIPTION_POLL_PERIOD);
+            else
+                epicsEventWait(this->sendEvent);
+            epicsMutexLock(this->sendLock);
+            continue;
+        }
+        idle = false;
+        if (!this->takeBatch(pSender, wait)) {
+            epicsMutexUnlock(this->sendLock);
+            epicsEventWaitWithTimeout(this->sendEvent, wait);
+            epicsMutexLock(this->sendLock);
+            continue;
+        }
+        queued = this->sendQueue.size();
+        epicsMutexUnlock(this->sendLock);
+        epicsEventSignal(this->spaceEvent);
+        /* wake another send thread for the next array */
+        if (queued)
+            epicsEventSignal(this->sendEvent);
+
+        if (pSender->batch.size() == 1)
+            this->sendArray(pSender, pSender->batch[0]);
+        else
+            this->sendBatch(pSender);
+        this->readSubscriptions(pSender);
+        if (zmqMonotonicNs() - lastPublished >= ZMQ_SEND_PUBLISH_PERIOD) {
+            this->publishSendStatistics((int) queued);
+            lastPublished = zmqMonotonicNs();
+        }
+        epicsMutexLock(this->sendLock);
+    }
+    epicsMutexUnlock(this->sendLock);
+    /* pass the exit on to the other send threads */
+    epicsEventSignal(this->sendEvent);
+    epicsEventSignal(pSender->doneEvent);
+}
+
+static void sendTaskC(void *drvPvt) {
+    ZMQSender *pSender = (ZMQSender *) drvPvt;
+    pSender->pPlugin->sendTask(pSender);
+}
+
+asynStatus NDPluginZMQ::writeInt32(asynUser *pasynUser, epicsInt32 value) {
+    int function = pasynUser->reason;
+
+    if (function == this->stageTimes.resetParam) {
+        this->stageTimes.reset();
+        this->stageTimes.publish(this);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if (function == zmqCompressionParam && !zmqCodecAvailable(value)) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR, "%s:writeInt32: compression %d is not built in\n", driverName, value);
+        return asynError;
+    }
+    return NDPluginDriver::writeInt32(pasynUser, value);
+}
+
+void NDPluginZMQ::report(FILE *fp, int details) {
+    fprintf(fp, "NDPluginZMQ %s: %s\n", this->portName, this->serverHost.c_str());
+    if (details > 0) {
+        for (size_t i = 0; i < this->senders.size(); i++) {
+            ZMQSender *pSender = this->senders[i];
+            fprintf(fp, "  Sender %lu:%s\n", (unsigned long) i, pSender->threadId ? "" : " not running");
+            if (this->socketType == ZMQ_XPUB)
+                fprintf(fp, "    Subscriptions: %lu\n", (unsigned long) pSender->subscriptions.size());
+            for (size_t j = 0; j < pSender->endpoints.size(); j++)
+                fprintf(fp, "    %s %s\n", pSender->endpoints[j].bind ? "Bind:   " : "Connect:",
+                        pSender->endpoints[j].address.c_str());
+        }
+    }
+    if (details > 1)
+        this->stageTimes.report(fp);
+    NDPluginDriver::report(fp, details);
 }
 
 /** Constructor for NDPluginZMQ; most parameters are simply passed to NDPluginDriver::NDPluginDriver.
   * \param[in] portName The name of the asyn port driver to be created.
   * \param[in] address The address & port of the ZMQ server, and pattern to be used.address:port.
+  *            Several comma separated addresses may be given; prefix one with '@' to bind or '>' to connect.
   * \param[in] transport The protocol to be used for the connection.[tcp/udp]
   * \param[in] zmqType The type of the ZeroMQ connection.[PUSH/PUB]
   * \param[in] queueSize The number of NDArrays that the input queue for this plugin can hold when 
@@ -217,10 +618,11 @@ void NDPluginZMQ::processCallbacks(NDArray *pArray) {
   * \param[in] autoConnect The autoConnect flag for the asyn port driver.
   * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
   * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+  * \param[in] numThreads The number of send threads, each with its own socket. A publisher has one.
   */
 NDPluginZMQ::NDPluginZMQ(const char *portName, const char *address, const char *transport, const char *zmqType,
                          int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr,
-                         int maxBuffers, size_t maxMemory, int priority, int stackSize)
+                         int maxBuffers, size_t maxMemory, int priority, int stackSize, int numThreads)
 /* Invoke the base class constructor.
  * We allocate 1 NDArray of unlimited size in the NDArray pool.
  * This driver can block (because writing a file can be slow), and it is not multi-device.
@@ -229,27 +631,70 @@ NDPluginZMQ::NDPluginZMQ(const char *portName, const char *address, const char *
         : NDPluginDriver(portName, queueSize, blockingCallbacks,
                          NDArrayPort, NDArrayAddr, 1, 0,
                          maxBuffers, maxMemory,
-                         asynGenericPointerMask, asynGenericPointerMask,
-                         0, 1, priority, stackSize)
+                         asynGenericPointerMask | asynInt32ArrayMask, asynGenericPointerMask | asynInt32ArrayMask,
+                         0, 1, priority, stackSize),
+          stageTimes(ZMQNumPluginStages, stageNames)
 #else
 : NDPluginDriver(portName, queueSize, blockingCallbacks,
                  NDArrayPort, NDArrayAddr, 1,
                  maxBuffers, maxMemory,
-                 asynGenericPointerMask, asynGenericPointerMask,
-                 0, 1, priority, stackSize, 0)
+                 asynGenericPointerMask | asynInt32ArrayMask, asynGenericPointerMask | asynInt32ArrayMask,
+                 0, 1, priority, stackSize, 0),
+  stageTimes(ZMQNumPluginStages, stageNames)
 #endif
 {
     const char *functionName = "NDPluginZMQ";
     int rc = 0;
 
+    this->sendLock = epicsMutexMustCreate();
+    this->sendEvent = epicsEventMustCreate(epicsEventEmpty);
+    this->spaceEvent = epicsEventMustCreate(epicsEventEmpty);
+    this->context = NULL;
+    this->runningSenders = 0;
+    this->takeSequence = 0;
+    this->turnSequence = 0;
+    this->sendExit = false;
+    this->subscribedTopics = 0;
+    this->framesSent = 0;
+    this->framesDropped = 0;
+    this->messagesSent = 0;
+    this->bytesSent = 0;
+    this->lastRateTime = zmqMonotonicNs();
+    this->lastRateBytes = 0;
+    this->uncompressedBytes = 0;
+    this->compressedBytes = 0;
+    this->compressNs = 0;
+    this->lastUncompressedBytes = 0;
+    this->lastCompressedBytes = 0;
+    this->lastCompressNs = 0;
+
     createParam(zmqFirstParamString, asynParamInt32, &zmqFirstParam);
     createParam(zmqIsConnectedParamString, asynParamInt32, &zmqIsConnectedParam);
     createParam(zmqConnectedAddressParamString, asynParamOctet, &zmqConnectedAddressParam);
+    createParam(zmqHeaderFormatParamString, asynParamInt32, &zmqHeaderFormatParam);
+    createParam(zmqSendPolicyParamString, asynParamInt32, &zmqSendPolicyParam);
+    createParam(zmqSendQueueSizeParamString, asynParamInt32, &zmqSendQueueSizeParam);
+    createParam(zmqSendQueuedParamString, asynParamInt32, &zmqSendQueuedParam);
+    createParam(zmqFramesSentParamString, asynParamInt32, &zmqFramesSentParam);
+    createParam(zmqFramesDroppedParamString, asynParamInt32, &zmqFramesDroppedParam);
+    createParam(zmqSendRateParamString, asynParamFloat64, &zmqSendRateParam);
+    createParam(zmqNumSendThreadsParamString, asynParamInt32, &zmqNumSendThreadsParam);
+    createParam(zmqSendInOrderParamString, asynParamInt32, &zmqSendInOrderParam);
+    createParam(zmqSubscribedTopicsParamString, asynParamInt32, &zmqSubscribedTopicsParam);
+    createParam(zmqAttributeDeltaParamString, asynParamInt32, &zmqAttributeDeltaParam);
+    createParam(zmqAttributeKeyPeriodParamString, asynParamInt32, &zmqAttributeKeyPeriodParam);
+    createParam(zmqCompressionParamString, asynParamInt32, &zmqCompressionParam);
+    createParam(zmqCompressionRatioParamString, asynParamFloat64, &zmqCompressionRatioParam);
+    createParam(zmqCompressRateParamString, asynParamFloat64, &zmqCompressRateParam);
+    createParam(zmqBatchSizeParamString, asynParamInt32, &zmqBatchSizeParam);
+    createParam(zmqBatchLingerParamString, asynParamFloat64, &zmqBatchLingerParam);
+    createParam(zmqMessagesSentParamString, asynParamInt32, &zmqMessagesSentParam);
+    this->stageTimes.createParams(this);
     createParam(zmqLastParamString, asynParamInt32, &zmqLastParam);
 
-    this->serverHost = std::string(transport) + std::string("://") + std::string(address);
+    /* publishers use XPUB to see the subscriptions */
     if (strcmp(zmqType, "SUB") == 0 || strcmp(zmqType, "PUB") == 0)
-        this->socketType = ZMQ_PUB;
+        this->socketType = ZMQ_XPUB;
     else if (strcmp(zmqType, "PULL") == 0 || strcmp(zmqType, "PUSH") == 0)
         this->socketType = ZMQ_PUSH;
     else if (strlen(zmqType) == 0) {
@@ -257,7 +702,7 @@ NDPluginZMQ::NDPluginZMQ(const char *portName, const char *address, const char *
          * If "*" is found in host address, then it is assumed to be a PUB server type
          * */
         if (strchr(address, '*') != NULL) {
-            this->socketType = ZMQ_PUB;
+            this->socketType = ZMQ_XPUB;
         } else {
             this->socketType = ZMQ_PUSH;
         }
@@ -266,51 +711,147 @@ NDPluginZMQ::NDPluginZMQ(const char *portName, const char *address, const char *
         return;
     }
 
+    zmqParseEndpoints(address, transport, this->socketType == ZMQ_PUSH, this->endpoints);
+    if (this->endpoints.empty()) {
+        fprintf(stderr, "%s: No address given\n", functionName);
+        return;
+    }
+    this->serverHost = zmqEndpointList(this->endpoints);
+
+    /* as for the driver, only sockets that connect can share an endpoint */
+    if (numThreads < 1)
+        numThreads = 1;
+    /* every subscriber gets every array, so a publisher sends each one on a single socket attached to all
+     * its endpoints; several sockets would each send only part of the stream */
+    if (this->socketType == ZMQ_XPUB && numThreads > 1) {
+        fprintf(stderr, "%s: a publisher has a single send thread, using 1 thread instead of %d\n",
+                functionName, numThreads);
+        numThreads = 1;
+    }
+    if (numThreads > (int) this->endpoints.size()) {
+        bool canShare = true;
+        for (size_t i = 0; i < this->endpoints.size(); i++)
+            canShare = canShare && !this->endpoints[i].bind;
+        if (!canShare) {
+            fprintf(stderr, "%s: %d send threads need %d endpoints, using %d threads\n",
+                    functionName, numThreads, numThreads, (int) this->endpoints.size());
+            numThreads = (int) this->endpoints.size();
+        }
+    }
+
     /* Set the plugin type string */
     setStringParam(NDPluginDriverPluginType, driverName);
-
-    /* Create ZMQ pub socket */
+    setIntegerParam(zmqHeaderFormatParam, ZMQHeaderJSON);
+    setIntegerParam(zmqSendPolicyParam, ZMQSendBlock);
+    setIntegerParam(zmqSendQueueSizeParam, 4);
+    setIntegerParam(zmqSendQueuedParam, 0);
+    setIntegerParam(zmqFramesSentParam, 0);
+    setIntegerParam(zmqFramesDroppedParam, 0);
+    setDoubleParam(zmqSendRateParam, 0);
+    setIntegerParam(zmqNumSendThreadsParam, numThreads);
+    /* one thread sends in order anyway */
+    setIntegerParam(zmqSendInOrderParam, 0);
+    setIntegerParam(zmqSubscribedTopicsParam, 0);
+    setIntegerParam(zmqAttributeDeltaParam, 0);
+    setIntegerParam(zmqAttributeKeyPeriodParam, 100);
+    setIntegerParam(zmqCompressionParam, ZMQCodecNone);
+    setDoubleParam(zmqCompressionRatioParam, 0);
+    setDoubleParam(zmqCompressRateParam, 0);
+    setIntegerParam(zmqBatchSizeParam, 1);
+    setDoubleParam(zmqBatchLingerParam, 0.001);
+    setIntegerParam(zmqMessagesSentParam, 0);
+
+    /* Create a ZMQ socket per send thread, with an I/O thread each to write them out */
     this->context = zmq_ctx_new();
-    this->socket = zmq_socket(context, this->socketType);
-
-    if (this->socketType == ZMQ_PUSH) {
-        rc = zmq_bind(this->socket, this->serverHost.c_str());
-    } else if (this->socketType == ZMQ_PUB) {
-        rc = zmq_connect(this->socket, this->serverHost.c_str());
-    }
-    if (rc != 0) {
-        fprintf(stderr, "%s: unable to bind/connect, %s\n",
-                functionName,
-                zmq_strerror(zmq_errno()));
-        setIntegerParam(zmqIsConnectedParam, 0);
-        return;
+    zmq_ctx_set(this->context, ZMQ_IO_THREADS, numThreads);
+    setIntegerParam(zmqIsConnectedParam, 0);
+    for (int i = 0; i < numThreads; i++) {
+        ZMQSender *pSender = new ZMQSender;
+
+        pSender->pPlugin = this;
+        pSender->index = i;
+        pSender->threadId = NULL;
+        pSender->turnEvent = epicsEventMustCreate(epicsEventEmpty);
+        pSender->doneEvent = epicsEventMustCreate(epicsEventEmpty);
+        if (numThreads <= (int) this->endpoints.size()) {
+            for (size_t j = i; j < this->endpoints.size(); j += numThreads)
+                pSender->endpoints.push_back(this->endpoints[j]);
+        } else
+            pSender->endpoints.push_back(this->endpoints[i % this->endpoints.size()]);
+        pSender->socket = zmq_socket(this->context, this->socketType);
+        this->senders.push_back(pSender);
+
+        for (size_t j = 0; j < pSender->endpoints.size(); j++) {
+            const ZMQEndpoint &endpoint = pSender->endpoints[j];
+            rc = endpoint.bind ? zmq_bind(pSender->socket, endpoint.address.c_str()) :
+                 zmq_connect(pSender->socket, endpoint.address.c_str());
+            if (rc != 0) {
+                fprintf(stderr, "%s: unable to %s %s, %s\n",
+                        functionName, endpoint.bind ? "bind" : "connect",
+                        endpoint.address.c_str(), zmq_strerror(zmq_errno()));
+                return;
+            }
+        }
     }
 
     setIntegerParam(zmqIsConnectedParam, 1);
     setStringParam(zmqConnectedAddressParam, this->serverHost.c_str());
 
+    /* from here on each socket is only used by its send thread */
+    for (size_t i = 0; i < this->senders.size(); i++) {
+        char threadName[32];
+        epicsSnprintf(threadName, sizeof(threadName), "NDPluginZMQSend%d", (int) i);
+        this->senders[i]->threadId = epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                                                       epicsThreadGetStackSize(epicsThreadStackMedium),
+                                                       (EPICSTHREADFUNC) sendTaskC, this->senders[i]);
+        if (this->senders[i]->threadId == NULL) {
+            fprintf(stderr, "%s: epicsThreadCreate failure for send task %d\n", functionName, (int) i);
+            continue;
+        }
+        this->runningSenders++;
+    }
+    if (this->runningSenders == 0)
+        return;
+
     /* Try to connect to the NDArray port */
     connectToArrayPort();
 }
 
 NDPluginZMQ::~NDPluginZMQ() {
-    if (this->socketType == ZMQ_PUB)
-        zmq_unbind(this->socket, this->serverHost.c_str());
-    else if (this->socketType == ZMQ_PUSH)
-        zmq_disconnect(this->socket, this->serverHost.c_str());
+    epicsMutexLock(this->sendLock);
+    this->sendExit = true;
+    epicsMutexUnlock(this->sendLock);
+    epicsEventSignal(this->sendEvent);
+    /* wake a plugin thread waiting for room in the queue, which then drops its array */
+    epicsEventSignal(this->spaceEvent);
+    for (size_t i = 0; i < this->senders.size(); i++)
+        if (this->senders[i]->threadId)
+            epicsEventWait(this->senders[i]->doneEvent);
+    while (!this->sendQueue.empty()) {
+        this->sendQueue.front().pArray->release();
+        this->sendQueue.pop_front();
+    }
 
-    zmq_close(this->socket);
-    zmq_ctx_destroy(this->context);
+    for (size_t i = 0; i < this->senders.size(); i++) {
+        ZMQSender *pSender = this->senders[i];
+        zmqDetachEndpoints(pSender->socket, pSender->endpoints);
+        zmq_close(pSender->socket);
+        epicsEventDestroy(pSender->turnEvent);
+        epicsEventDestroy(pSender->doneEvent);
+        delete pSender;
+    }
+    if (this->context)
+        zmq_ctx_destroy(this->context);
 }
 
 /** Configuration command */
 extern "C" int
 NDZMQConfigure(const char *portName, const char *address, const char *transport, const char *zmqType, int queueSize,
                int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr,
-               int maxBuffers, size_t maxMemory, int priority, int stackSize) {
+               int maxBuffers, size_t maxMemory, int priority, int stackSize, int numThreads) {
     NDPluginZMQ *pPlugin = new NDPluginZMQ(portName, address, transport, zmqType, queueSize, blockingCallbacks,
                                            NDArrayPort, NDArrayAddr,
-                                           maxBuffers, maxMemory, priority, stackSize);
+                                           maxBuffers, maxMemory, priority, stackSize, numThreads);
 #if (ADCORE_VERSION > 2) || (ADCORE_VERSION == 2 && ADCORE_REVISION >= 5)
     return pPlugin->start();
 #else
@@ -331,6 +872,7 @@ static const iocshArg initArg8 = {"maxBuffers", iocshArgInt};
 static const iocshArg initArg9 = {"maxMemory", iocshArgInt};
 static const iocshArg initArg10 = {"priority", iocshArgInt};
 static const iocshArg initArg11 = {"stackSize", iocshArgInt};
+static const iocshArg initArg12 = {"numThreads", iocshArgInt};
 static const iocshArg *const initArgs[] = {&initArg0,
                                            &initArg1,
                                            &initArg2,
@@ -342,13 +884,14 @@ static const iocshArg *const initArgs[] = {&initArg0,
                                            &initArg8,
                                            &initArg9,
                                            &initArg10,
-                                           &initArg11};
-static const iocshFuncDef initFuncDef = {"NDZMQConfigure", 12, initArgs};
+                                           &initArg11,
+                                           &initArg12};
+static const iocshFuncDef initFuncDef = {"NDZMQConfigure", 13, initArgs};
 
 static void initCallFunc(const iocshArgBuf *args) {
     NDZMQConfigure(args[0].sval, args[1].sval, args[2].sval, args[3].sval,
                    args[4].ival, args[5].ival, args[6].sval, args[7].ival,
-                   args[8].ival, args[9].ival, args[10].ival, args[11].ival);
+                   args[8].ival, args[9].ival, args[10].ival, args[11].ival, args[12].ival);
 }
 
 extern "C" void NDZMQRegister(void) {
@@ -2,7 +2,19 @@
 #define NDPluginZMQ_H
 
 #include "NDPluginDriver.h"
+#include <atomic>
+#include <deque>
+#include <set>
 #include <string>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "ZMQEndpoint.h"
+#include "ZMQHeader.h"
+#include "ZMQStageTimer.h"
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 255
@@ -11,33 +23,167 @@
 #define zmqFirstParamString "ZMQ_FIRST"
 #define zmqIsConnectedParamString "ZMQ_IS_CONNECTED"
 #define zmqConnectedAddressParamString "ZMQ_CONNECTED_ADDRESS"
+#define zmqHeaderFormatParamString "ZMQ_HEADER_FORMAT"
+#define zmqSendPolicyParamString "ZMQ_SEND_POLICY"
+#define zmqSendQueueSizeParamString "ZMQ_SEND_QUEUE_SIZE"
+#define zmqSendQueuedParamString "ZMQ_SEND_QUEUED"
+#define zmqFramesSentParamString "ZMQ_FRAMES_SENT"
+#define zmqFramesDroppedParamString "ZMQ_FRAMES_DROPPED"
+#define zmqSendRateParamString "ZMQ_SEND_RATE"
+#define zmqNumSendThreadsParamString "ZMQ_NUM_SEND_THREADS"
+#define zmqSendInOrderParamString "ZMQ_SEND_IN_ORDER"
+#define zmqSubscribedTopicsParamString "ZMQ_SUBSCRIBED_TOPICS"
+#define zmqAttributeDeltaParamString "ZMQ_ATTRIBUTE_DELTA"
+#define zmqAttributeKeyPeriodParamString "ZMQ_ATTRIBUTE_KEY_PERIOD"
+#define zmqCompressionParamString "ZMQ_COMPRESSION"
+#define zmqCompressionRatioParamString "ZMQ_COMPRESSION_RATIO"
+#define zmqCompressRateParamString "ZMQ_COMPRESS_RATE"
+#define zmqBatchSizeParamString "ZMQ_BATCH_SIZE"
+#define zmqBatchLingerParamString "ZMQ_BATCH_LINGER"
+#define zmqMessagesSentParamString "ZMQ_MESSAGES_SENT"
 #define zmqLastParamString "ZMQ_LAST"
 
+/* header sent in front of each array */
+typedef enum {
+    ZMQHeaderJSON,  /* chunk-1.0 */
+    ZMQHeaderBinary /* chunk-bin-1.0 */
+} ZMQHeaderFormat_t;
+
+/* what to do with an array when the send queue is full */
+typedef enum {
+    ZMQSendBlock,      /* wait for the send thread, holding up the plugin queue */
+    ZMQSendDropNewest, /* drop the array */
+    ZMQSendDropOldest  /* drop the oldest queued array */
+} ZMQSendPolicy_t;
+
+/* an array waiting for a send thread, holding a reference to it */
+struct ZMQSendItem {
+    NDArray *pArray;
+    int headerFormat;
+    int keyPeriod;     /* JSON headers between full attribute sets, 0 to always send them all */
+    int codec;         /* ZMQCodec_t to compress the data with */
+    bool inOrder;      /* hand it to ZeroMQ only after the arrays taken off the queue before it */
+    unsigned sequence; /* order in which it was taken off the queue */
+    int batchSize;     /* arrays that may be sent together in one message, 1 to send it on its own */
+    uint64_t batchLinger; /* ns a batch waits for more arrays after this one was queued */
+    uint64_t queuedNs; /* when it was queued, zmqMonotonicNs() */
+};
+
+/* a compressed chunk of an array, handed to libzmq which frees it once it has been sent */
+struct ZMQChunk {
+    void *data;
+    size_t size;
+};
+
+class NDPluginZMQ;
+
+/* a send thread with its own socket */
+struct ZMQSender {
+    NDPluginZMQ *pPlugin;
+    int index;
+    void *socket;                       /* only used by the send thread */
+    std::vector<ZMQEndpoint> endpoints; /* endpoints attached to socket */
+    std::vector<char> headerBuffer;     /* reused for binary and batch headers */
+    ZMQHeaderWriter jsonHeader;         /* composes JSON headers into a reused buffer */
+    std::set<std::string> subscriptions; /* topics subscribed to on an XPUB socket */
+    std::vector<ZMQChunk> chunks;       /* the array being sent, when it is compressed */
+    std::vector<ZMQSendItem> batch;     /* the arrays being sent, taken off the queue together */
+    std::vector<NDArray *> batchArrays;
+    epicsEventId turnEvent;             /* another thread has handed an array to ZeroMQ */
+    epicsEventId doneEvent;             /* the send thread has exited */
+    epicsThreadId threadId;
+};
+
+/* stages of an array timed by the plugin */
+typedef enum {
+    ZMQStageSerialize, /* composing the header and compressing the data */
+    ZMQStageSend,      /* sending the header and the data */
+    ZMQNumPluginStages
+} ZMQPluginStage_t;
+
 /** Base class for NDArray ZMQ streaming plugins. */
 class NDPluginZMQ : public NDPluginDriver {
 public:
     NDPluginZMQ(const char *portName, const char *address, const char *transport, const char *zmqType,
                 int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr,
-                 int maxBuffers, size_t maxMemory, int priority, int stackSize);
+                int maxBuffers, size_t maxMemory, int priority, int stackSize, int numThreads = 1);
 
     ~NDPluginZMQ();
 
     /* These methods override those in the base class */
     virtual void processCallbacks(NDArray *pArray);
+    virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+    virtual void report(FILE *fp, int details);
+
+    /* This is called from C and so must be public */
+    void sendTask(ZMQSender *pSender);
 
 protected:
-    std::string getAttributesAsJSON(NDAttributeList *pAttributeList);
+    std::string getHeaderAsJSON(NDArray *pArray, const epicsTimeStamp &sendTime);
 
 private:
+    void queueArray(NDArray *pArray);
+    void sendArray(ZMQSender *pSender, const ZMQSendItem &item);
+    void sendBatch(ZMQSender *pSender);
+    bool sendHeader(ZMQSender *pSender, const char *pHeader, size_t headerSize, int flags);
+    bool takeBatch(ZMQSender *pSender, double &wait);
+    bool compressArray(ZMQSender *pSender, NDArray *pArray, int codec);
+    void freeChunks(ZMQSender *pSender);
+    bool waitForTurn(ZMQSender *pSender, const ZMQSendItem &item);
+    void endTurn(unsigned count = 1);
+    void publishSendStatistics(int queued);
+    void readSubscriptions(ZMQSender *pSender);
+
     void *context;
-    void *socket;
+    std::vector<ZMQEndpoint> endpoints;
     std::string serverHost;
     int socketType;
+    std::vector<ZMQSender *> senders;
+    int runningSenders;             /* send threads that were started */
+    std::deque<ZMQSendItem> sendQueue;
+    epicsMutexId sendLock;          /* protects sendQueue and takeSequence */
+    epicsEventId sendEvent;         /* an array has been queued, or the plugin is shutting down */
+    epicsEventId spaceEvent;        /* an array has been taken off the queue */
+    unsigned takeSequence;          /* sequence of the next array taken off the queue */
+    std::atomic<unsigned> turnSequence; /* sequence of the next array to be handed to ZeroMQ */
+    std::atomic<bool> sendExit;
+    std::atomic<int> subscribedTopics; /* topics subscribed to on the XPUB socket, 0 when nobody is subscribed */
+    std::atomic<int> framesSent;
+    std::atomic<int> framesDropped;
+    std::atomic<int> messagesSent;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> uncompressedBytes; /* arrays compressed so far */
+    std::atomic<uint64_t> compressedBytes;   /* the same arrays once compressed */
+    std::atomic<uint64_t> compressNs;        /* time spent compressing them, summed over the threads */
+    uint64_t lastRateTime;          /* when the send rate was last published, zmqMonotonicNs() */
+    uint64_t lastRateBytes;
+    uint64_t lastUncompressedBytes; /* compression counters when the rates were last published */
+    uint64_t lastCompressedBytes;
+    uint64_t lastCompressNs;
+    ZMQStageTimes stageTimes;
 
     int zmqFirstParam;
 #define NDZMQ_FIRST_DRIVER_COMMAND zmqFirstParam
     int zmqIsConnectedParam;
     int zmqConnectedAddressParam;
+    int zmqHeaderFormatParam;
+    int zmqSendPolicyParam;
+    int zmqSendQueueSizeParam;
+    int zmqSendQueuedParam;
+    int zmqFramesSentParam;
+    int zmqFramesDroppedParam;
+    int zmqSendRateParam;
+    int zmqNumSendThreadsParam;
+    int zmqSendInOrderParam;
+    int zmqSubscribedTopicsParam;
+    int zmqAttributeDeltaParam;
+    int zmqAttributeKeyPeriodParam;
+    int zmqCompressionParam;
+    int zmqCompressionRatioParam;
+    int zmqCompressRateParam;
+    int zmqBatchSizeParam;
+    int zmqBatchLingerParam;
+    int zmqMessagesSentParam;
     int zmqLastParam;
 #define NDZMQ_LAST_DRIVER_COMMAND zmqLastParam
 
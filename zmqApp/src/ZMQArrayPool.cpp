@@ -0,0 +1,161 @@
+/* ZMQArrayPool.cpp
+ *
+ * NDArrayPool that lets ZMQDriver publish received messages as NDArrays without copying.
+ *
+ */
+
+#include <ADCoreVersion.h>
+
+#include "ZMQArrayPool.h"
+
+ZMQNDArray::ZMQNDArray()
+        : NDArray(), ownsMessage(false)
+{
+    zmq_msg_init(&this->message);
+}
+
+ZMQNDArray::~ZMQNDArray()
+{
+    /* never let the base class free memory that belongs to libzmq */
+    if (this->ownsMessage)
+        this->pData = NULL;
+    zmq_msg_close(&this->message);
+}
+
+ZMQMessagePool::ZMQMessagePool(class asynNDArrayDriver *pDriver, int maxBuffers)
+#if ADCORE_VERSION >= 3
+        : NDArrayPool(pDriver, 0)
+#else
+        : NDArrayPool(maxBuffers, 0)
+#endif
+{
+}
+
+NDArray *ZMQMessagePool::createArray()
+{
+    return new ZMQNDArray;
+}
+
+/** Allocate an NDArray which uses the payload of a zmq message as its data.
+  * On success the message content is moved into the array and message is left empty,
+  * on failure message is untouched and remains owned by the caller.
+  * \param[in] ndims The number of dimensions in the NDArray.
+  * \param[in] dims Array of dimensions, whose size must be at least ndims.
+  * \param[in] dataType Data type of the NDArray data.
+  * \param[in] message Received message holding the array data. */
+NDArray *ZMQMessagePool::wrap(int ndims, size_t *dims, NDDataType_t dataType, zmq_msg_t *message)
+{
+    ZMQNDArray *pArray;
+
+    /* the free arrays have no buffers, so they are cheap to make again whether or not alloc() reuses them */
+    if (this->getNumFree() > ZMQ_MESSAGE_POOL_FREE)
+        this->emptyFreeList();
+
+    pArray = (ZMQNDArray *) this->alloc(ndims, dims, dataType, zmq_msg_size(message), zmq_msg_data(message));
+    if (!pArray)
+        return NULL;
+
+    zmq_msg_move(&pArray->message, message);
+    /* small messages are stored inside zmq_msg_t itself, so the data address changes with the move */
+    pArray->pData = zmq_msg_data(&pArray->message);
+    pArray->ownsMessage = true;
+    return pArray;
+}
+
+void ZMQMessagePool::onReleaseArray(NDArray *pArray)
+{
+    ZMQNDArray *pZMQArray = (ZMQNDArray *) pArray;
+
+    /* only close the message once the last downstream user is done with it */
+    if (pArray->referenceCount > 0 || !pZMQArray->ownsMessage)
+        return;
+
+    zmq_msg_close(&pZMQArray->message);
+    zmq_msg_init(&pZMQArray->message);
+    pZMQArray->ownsMessage = false;
+    /* the array goes back onto the free list without a buffer */
+    pArray->pData = NULL;
+    pArray->dataSize = 0;
+}
+
+/* true while any array of this pool has not been released */
+bool ZMQMessagePool::inUse()
+{
+    return this->getNumBuffers() > this->getNumFree();
+}
+
+ZMQArrayPool::ZMQArrayPool(class asynNDArrayDriver *pDriver, int maxBuffers, size_t maxMemory)
+#if ADCORE_VERSION >= 3
+        : NDArrayPool(pDriver, maxMemory)
+#else
+        : NDArrayPool(maxBuffers, maxMemory)
+#endif
+        , maxBuffers(maxBuffers), pMessagePool(new ZMQMessagePool(pDriver, maxBuffers))
+{
+}
+
+ZMQArrayPool::~ZMQArrayPool()
+{
+    delete this->pMessagePool;
+}
+
+/** Allocate an NDArray which uses the payload of a zmq message as its data, see ZMQMessagePool::wrap. */
+NDArray *ZMQArrayPool::wrap(int ndims, size_t *dims, NDDataType_t dataType, zmq_msg_t *message)
+{
+    return this->pMessagePool->wrap(ndims, dims, dataType, message);
+}
+
+/** Make sure the free list holds at least numBuffers arrays big enough for the given shape,
+  * so that the following alloc() calls for that shape do not have to allocate memory.
+  * \param[in] ndims The number of dimensions in the NDArray.
+  * \param[in] dims Array of dimensions, whose size must be at least ndims.
+  * \param[in] dataType Data type of the NDArray data.
+  * \param[in] numBuffers Number of buffers to have ready.
+  * \return The number of buffers that could actually be allocated. */
+int ZMQArrayPool::preallocate(int ndims, size_t *dims, NDDataType_t dataType, int numBuffers)
+{
+    NDArray **pArrays = new NDArray *[numBuffers];
+    int i, numAllocated = 0;
+
+    /* hold them all at once so that the pool cannot hand out the same buffer twice */
+    for (i = 0; i < numBuffers; i++)
+    {
+        pArrays[i] = this->alloc(ndims, dims, dataType, 0, NULL);
+        if (!pArrays[i])
+            break;
+        numAllocated++;
+    }
+    for (i = 0; i < numAllocated; i++)
+        pArrays[i]->release();
+
+    delete[] pArrays;
+    return numAllocated;
+}
+
+/** How close the pool is to refusing to allocate, as the larger of the percentage of its memory limit
+  * allocated and, where the pool has a buffer limit, of its buffers in use. 0 for an unlimited pool. */
+double ZMQArrayPool::pressure()
+{
+    double percent = 0;
+    size_t maxMemory = this->getMaxMemory();
+
+    if (maxMemory > 0)
+        percent = 100. * this->getMemorySize() / maxMemory;
+#if ADCORE_VERSION < 3
+    /* newer pools only limit memory */
+    if (this->maxBuffers > 0)
+    {
+        double buffers = 100. * (this->getNumBuffers() - this->getNumFree()) / this->maxBuffers;
+        if (buffers > percent)
+            percent = buffers;
+    }
+#endif
+    return percent > 100 ? 100 : percent;
+}
+
+/* true while any array of this pool or of its message pool has not been released,
+ * when deleting the pool would leave the holders of those arrays releasing them into freed memory */
+bool ZMQArrayPool::inUse()
+{
+    return this->getNumBuffers() > this->getNumFree() || this->pMessagePool->inUse();
+}
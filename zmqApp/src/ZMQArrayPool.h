@@ -0,0 +1,66 @@
+/* ZMQArrayPool.h
+ *
+ * NDArrayPool that can hand out NDArrays whose data buffer is the payload
+ * of a received ZeroMQ message, so that the data is never copied.
+ *
+ */
+
+#ifndef ADZMQ_ZMQARRAYPOOL_H
+#define ADZMQ_ZMQARRAYPOOL_H
+
+#include <zmq.h>
+
+#include "NDArray.h"
+
+/* free arrays the message pool keeps, beyond which they are deleted */
+#define ZMQ_MESSAGE_POOL_FREE 64
+
+/* NDArray that may keep a zmq message alive for as long as it is in use */
+class ZMQNDArray : public NDArray
+{
+public:
+    ZMQNDArray();
+    virtual ~ZMQNDArray();
+
+    zmq_msg_t message;  /* message whose payload is pData */
+    bool ownsMessage;   /* true while pData points into message */
+};
+
+/** Pool of the arrays wrapped around received messages, kept apart from the pool the driver allocates
+  * its buffers from. Every array on its free list has had its message closed and has no buffer, so
+  * whichever one alloc() picks for a caller's buffer, no pool buffer is overwritten or leaked, and the
+  * pool has no memory limit to charge since the buffers belong to libzmq. */
+class ZMQMessagePool : public NDArrayPool
+{
+public:
+    ZMQMessagePool(class asynNDArrayDriver *pDriver, int maxBuffers);
+
+    NDArray *wrap(int ndims, size_t *dims, NDDataType_t dataType, zmq_msg_t *message);
+    bool inUse();
+
+protected:
+    virtual NDArray *createArray();
+    virtual void onReleaseArray(NDArray *pArray);
+};
+
+/** NDArrayPool for ZMQDriver.
+  * Arrays allocated with alloc() behave exactly as with the base class.
+  * Arrays created with wrap() come from a ZMQMessagePool of its own: they take over a received zmq_msg_t
+  * and use its payload as pData, and the message is closed when the last user releases the array. */
+class ZMQArrayPool : public NDArrayPool
+{
+public:
+    ZMQArrayPool(class asynNDArrayDriver *pDriver, int maxBuffers, size_t maxMemory);
+    virtual ~ZMQArrayPool();
+
+    NDArray *wrap(int ndims, size_t *dims, NDDataType_t dataType, zmq_msg_t *message);
+    int preallocate(int ndims, size_t *dims, NDDataType_t dataType, int numBuffers);
+    double pressure();
+    bool inUse();
+
+private:
+    int maxBuffers;
+    ZMQMessagePool *pMessagePool;
+};
+
+#endif //ADZMQ_ZMQARRAYPOOL_H
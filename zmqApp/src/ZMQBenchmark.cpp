@@ -0,0 +1,466 @@
+/* ZMQBenchmark.cpp
+ *
+ * A host program to measure the cost of the driver hot paths, built apart from the library so that
+ * IOCs do not carry it or the JSON library it compares against.
+ *
+ * Usage: zmqBenchmark header [numAttributes [iterations]]
+ *        zmqBenchmark write [iterations]
+ *        zmqBenchmark batch [maxBatchSize [arraySize [numArrays]]]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+#include <epicsTime.h>
+#include <epicsStdio.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+
+#include <zmq.h>
+#include <JSON.h>
+
+#include "ZMQHeader.h"
+
+/* a header as NDPluginZMQ sends it, with numAttributes numeric and string attributes */
+static std::string makeHeader(int numAttributes, int frame = 12345)
+{
+    std::ostringstream header;
+
+    header << "{\"htype\":[\"chunk-1.0\"], \"type\":\"uint16\", \"shape\":[2048,2048], \"frame\":" << frame << ", \"ndattr\":{";
+    for (int i = 0; i < numAttributes; i++)
+    {
+        if (i > 0)
+            header << ',';
+        if (i % 4 == 3)
+            header << "\"Attr" << i << "\":{ \"value\":\"some text\",\"dataType\":\"string\"}";
+        else
+            header << "\"Attr" << i << "\":{ \"value\":" << i * 1.25 << ",\"dataType\":\"float64\"}";
+    }
+    header << "}}";
+    return header.str();
+}
+
+/* an array with the same shape and attributes as makeHeader describes */
+static void makeArray(NDArray &array, int numAttributes)
+{
+    array.ndims = 2;
+    array.dims[0].size = 2048;
+    array.dims[1].size = 2048;
+    array.dataType = NDUInt16;
+    array.uniqueId = 12345;
+    for (int i = 0; i < numAttributes; i++)
+    {
+        char name[32];
+        double value = i * 1.25;
+        epicsSnprintf(name, sizeof(name), "Attr%d", i);
+        if (i % 4 == 3)
+            array.pAttributeList->add(name, name, NDAttrString, (void *) "some text");
+        else
+            array.pAttributeList->add(name, name, NDAttrFloat64, &value);
+    }
+}
+
+/* the header handling the driver used before zmqParseJSONHeader, kept for comparison */
+static bool parseWithJSONLibrary(const char *msg, NDAttributeList &attributeList)
+{
+    JSONValue *value = JSON::Parse(msg);
+    if (value == NULL)
+        return false;
+
+    JSONObject root = value->AsObject();
+    bool valid = root.find(L"htype") != root.end() && root.find(L"shape") != root.end() &&
+                 root.find(L"frame") != root.end() && root.find(L"type") != root.end();
+    JSONArray shape = root[L"shape"]->AsArray();
+    std::wstring type = root[L"type"]->AsString();
+    JSONObject ndattr = root[L"ndattr"]->AsObject();
+    for (JSONObject::iterator attr = ndattr.begin(); attr != ndattr.end(); ++attr)
+    {
+        std::wstring namew = attr->first;
+        std::string name(namew.begin(), namew.end());
+        JSONObject attrStruct = attr->second->AsObject();
+        JSONValue *val = attrStruct[L"value"];
+        if (val->IsNumber())
+        {
+            double v = val->AsNumber();
+            attributeList.add(name.c_str(), name.c_str(), NDAttrFloat64, &v);
+        }
+        else if (val->IsString())
+        {
+            std::wstring vw = val->AsString();
+            std::string v(vw.begin(), vw.end());
+            attributeList.add(name.c_str(), name.c_str(), NDAttrString, (void *) v.c_str());
+        }
+    }
+    delete value;
+    return valid;
+}
+
+/** Parse the same header repeatedly with the JSON library and with the single pass parser,
+  * then a stream of headers differing in their frame number through the header cache,
+  * and encode and decode the chunk-bin-1.0 header of the same array.
+  * \param[in] numAttributes Number of attributes in the header.
+  * \param[in] iterations Number of times each parser runs. */
+static void zmqHeaderBenchmark(int numAttributes, int iterations)
+{
+    epicsTimeStamp start, end;
+    NDAttributeList attributeList;
+    ChunkInfo info;
+    ZMQHeaderCache cache;
+    std::string stream[16];
+    NDArray array;
+    std::vector<char> binary;
+    size_t binarySize = 0;
+    double legacy, single, cached, encode, decode;
+
+    if (numAttributes < 0)
+        numAttributes = 0;
+    if (iterations <= 0)
+        iterations = 10000;
+    std::string header = makeHeader(numAttributes);
+    for (int i = 0; i < 16; i++)
+        stream[i] = makeHeader(numAttributes, i);
+
+    epicsTimeGetCurrent(&start);
+    for (int i = 0; i < iterations; i++)
+    {
+        attributeList.clear();
+        parseWithJSONLibrary(header.c_str(), attributeList);
+    }
+    epicsTimeGetCurrent(&end);
+    legacy = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e6;
+
+    epicsTimeGetCurrent(&start);
+    for (int i = 0; i < iterations; i++)
+    {
+        attributeList.clear();
+        zmqParseJSONHeader(header.c_str(), header.size(), info, attributeList);
+    }
+    epicsTimeGetCurrent(&end);
+    single = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e6;
+
+    epicsTimeGetCurrent(&start);
+    for (int i = 0; i < iterations; i++)
+    {
+        attributeList.clear();
+        cache.parse(stream[i % 16].c_str(), stream[i % 16].size(), info, attributeList);
+    }
+    epicsTimeGetCurrent(&end);
+    cached = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e6;
+
+    makeArray(array, numAttributes);
+    epicsTimeGetCurrent(&start);
+    for (int i = 0; i < iterations; i++)
+        binarySize = zmqEncodeBinaryHeader(&array, start, binary);
+    epicsTimeGetCurrent(&end);
+    encode = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e6;
+
+    epicsTimeGetCurrent(&start);
+    for (int i = 0; i < iterations; i++)
+    {
+        attributeList.clear();
+        zmqParseBinaryHeader(&binary[0], binarySize, info, attributeList);
+    }
+    epicsTimeGetCurrent(&end);
+    decode = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e6;
+
+    printf("header of %d bytes with %d attributes, %d iterations\n", (int) header.size(), numAttributes, iterations);
+    printf("  JSON library:      %10.2f us/header\n", legacy);
+    printf("  single pass:       %10.2f us/header\n", single);
+    printf("  header cache:      %10.2f us/header, %d hits, %d misses\n", cached,
+           (int) cache.hits, (int) cache.misses);
+    if (single > 0)
+        printf("  speedup:           %10.1f x\n", legacy / single);
+    printf("binary header of %d bytes\n", (int) binarySize);
+    printf("  encode:            %10.2f us/header\n", encode);
+    printf("  decode:            %10.2f us/header\n", decode);
+}
+
+/* the header composition NDPluginZMQ used before ZMQHeaderWriter, kept for comparison */
+static std::string composeWithStreams(NDArray *pArray, const epicsTimeStamp &sendTime)
+{
+    std::ostringstream shape, header;
+    std::stringstream sjson, svalue;
+
+    shape << '[';
+    for (int i = 0; i < pArray->ndims; i++)
+    {
+        shape << pArray->dims[i].size;
+        if (i != pArray->ndims - 1)
+            shape << ',';
+    }
+    shape << ']';
+
+    sjson << '{';
+    NDAttribute *pAttr = pArray->pAttributeList->next(NULL);
+    while (pAttr != NULL)
+    {
+        NDAttrDataType_t attrDataType;
+        size_t attrDataSize;
+        void *value;
+        svalue.str("");
+
+        pAttr->getValueInfo(&attrDataType, &attrDataSize);
+        value = calloc(1, attrDataSize);
+        pAttr->getValue(attrDataType, value, attrDataSize);
+        if (attrDataType == NDAttrString)
+            svalue << "\"" << (char *) value << "\"";
+        else
+            svalue << *((epicsFloat64 *) value);
+        sjson << "\"" << pAttr->getName() << "\":{ \"value\":" << svalue.str();
+        sjson << ",\"dataType\":" << (attrDataType == NDAttrString ? "\"string\"" : "\"float64\"") << "}";
+        free(value);
+        pAttr = pArray->pAttributeList->next(pAttr);
+        if (pAttr != NULL)
+            sjson << ',';
+    }
+    sjson << '}';
+
+    header << "{\"htype\":[\"chunk-1.0\"], "
+           << "\"type\":" << "\"uint16\", "
+           << "\"shape\":" << shape.str() << ", "
+           << "\"frame\":" << pArray->uniqueId << ", "
+           << "\"timeStamp\":" << std::setprecision(17) << pArray->timeStamp << ", "
+           << "\"epicsTS\":[" << pArray->epicsTS.secPastEpoch << ',' << pArray->epicsTS.nsec << "], "
+           << "\"sendTime\":[" << sendTime.secPastEpoch << ',' << sendTime.nsec << "], "
+           << "\"ndattr\":" << sjson.str()
+           << "}";
+    return header.str();
+}
+
+/** Compose the chunk-1.0 header of arrays with 0, 10 and 100 attributes with the streams
+  * NDPluginZMQ used to use and with ZMQHeaderWriter.
+  * \param[in] iterations Number of headers composed each way for each array. */
+static void zmqHeaderWriteBenchmark(int iterations)
+{
+    static const int attributeCounts[] = {0, 10, 100};
+    epicsTimeStamp start, end;
+
+    if (iterations <= 0)
+        iterations = 10000;
+    printf("chunk-1.0 header composition, %d iterations\n", iterations);
+    for (size_t n = 0; n < sizeof(attributeCounts) / sizeof(attributeCounts[0]); n++)
+    {
+        NDArray array;
+        ZMQHeaderWriter writer;
+        size_t size = 0, streamSize = 0;
+        double streams, written;
+
+        makeArray(array, attributeCounts[n]);
+        array.timeStamp = 1234.5678;
+        epicsTimeGetCurrent(&start);
+        for (int i = 0; i < iterations; i++)
+        {
+            array.uniqueId = i;
+            streamSize = composeWithStreams(&array, start).size();
+        }
+        epicsTimeGetCurrent(&end);
+        streams = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e9;
+
+        epicsTimeGetCurrent(&start);
+        for (int i = 0; i < iterations; i++)
+        {
+            array.uniqueId = i;
+            size = writer.encode(&array, start);
+        }
+        epicsTimeGetCurrent(&end);
+        written = epicsTimeDiffInSeconds(&end, &start) / iterations * 1e9;
+
+        printf("  %3d attributes: streams %10.0f ns/header (%d bytes), writer %10.0f ns/header (%d bytes)\n",
+               attributeCounts[n], streams, (int) streamSize, written, (int) size);
+    }
+}
+
+/* the receiving end of zmqBatchBenchmark */
+struct BatchReceiver
+{
+    void *socket;
+    int numArrays;
+    int received;
+    epicsEventId doneEvent;
+};
+
+/* receive messages until numArrays arrays have arrived, parsing every header as ZMQDriver does */
+static void batchReceiveTask(void *arg)
+{
+    BatchReceiver *pReceiver = (BatchReceiver *) arg;
+    std::vector<ZMQBatchEntry> entries(1);
+    NDAttributeList attributeList;
+    ChunkInfo info;
+    zmq_msg_t header, data;
+
+    zmq_msg_init(&header);
+    zmq_msg_init(&data);
+    pReceiver->received = 0;
+    while (pReceiver->received < pReceiver->numArrays)
+    {
+        if (zmq_msg_recv(&header, pReceiver->socket, 0) == -1 || zmq_msg_recv(&data, pReceiver->socket, 0) == -1)
+            break;
+        const char *msg = (const char *) zmq_msg_data(&header);
+        size_t len = zmq_msg_size(&header);
+        if (zmqIsBatchHeader(msg, len))
+            zmqSplitBatchHeader(msg, len, entries);
+        else
+        {
+            entries.resize(1);
+            entries[0].offset = 0;
+            entries[0].len = len;
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            attributeList.clear();
+            zmqParseJSONHeader(msg + entries[i].offset, entries[i].len, info, attributeList);
+        }
+        pReceiver->received += (int) entries.size();
+    }
+    zmq_msg_close(&header);
+    zmq_msg_close(&data);
+    epicsEventSignal(pReceiver->doneEvent);
+}
+
+/** Send small arrays over a TCP loopback connection in batches of 1, 2, 4 and so on up to
+  * maxBatchSize arrays per message, composing and parsing the headers as NDPluginZMQ and
+  * ZMQDriver do, and print the messages and arrays per second for each batch size.
+  * \param[in] maxBatchSize Largest number of arrays in a message.
+  * \param[in] arraySize Number of uint16 elements in each array.
+  * \param[in] numArrays Arrays sent for each batch size. */
+static void zmqBatchBenchmark(int maxBatchSize, int arraySize, int numArrays)
+{
+    void *context, *sender;
+    char endpoint[256];
+    size_t endpointSize = sizeof(endpoint);
+    BatchReceiver receiver;
+    ZMQHeaderWriter writer;
+    std::vector<char> header;
+    std::vector<char> data;
+    std::vector<NDArray *> arrays;
+    epicsTimeStamp start, end;
+
+    if (maxBatchSize < 1)
+        maxBatchSize = 64;
+    if (arraySize < 1)
+        arraySize = 256;
+    if (numArrays < 1)
+        numArrays = 100000;
+
+    context = zmq_ctx_new();
+    sender = zmq_socket(context, ZMQ_PUSH);
+    receiver.socket = zmq_socket(context, ZMQ_PULL);
+    receiver.doneEvent = epicsEventMustCreate(epicsEventEmpty);
+    if (zmq_bind(receiver.socket, "tcp://127.0.0.1:*") != 0 ||
+        zmq_getsockopt(receiver.socket, ZMQ_LAST_ENDPOINT, endpoint, &endpointSize) != 0 ||
+        zmq_connect(sender, endpoint) != 0)
+    {
+        printf("unable to open a loopback connection, %s\n", zmq_strerror(zmq_errno()));
+        zmq_close(sender);
+        zmq_close(receiver.socket);
+        zmq_ctx_destroy(context);
+        epicsEventDestroy(receiver.doneEvent);
+        return;
+    }
+
+    /* arrays with a few attributes, as a small ROI or waveform would have */
+    for (int i = 0; i < maxBatchSize; i++)
+    {
+        NDArray *pArray = new NDArray;
+        double value = i * 1.25;
+        pArray->ndims = 1;
+        pArray->dims[0].size = arraySize;
+        pArray->dataType = NDUInt16;
+        pArray->pData = calloc(arraySize, sizeof(epicsUInt16));
+        pArray->pAttributeList->add("MinValue", "MinValue", NDAttrFloat64, &value);
+        pArray->pAttributeList->add("MaxValue", "MaxValue", NDAttrFloat64, &value);
+        arrays.push_back(pArray);
+    }
+    data.resize(maxBatchSize * arraySize * sizeof(epicsUInt16) + 1);
+
+    printf("%d arrays of %d uint16 elements over %s\n", numArrays, arraySize, endpoint);
+    for (int batchSize = 1; batchSize <= maxBatchSize; batchSize *= 2)
+    {
+        int sent = 0, messages = 0;
+        double seconds;
+
+        receiver.numArrays = numArrays;
+        if (!epicsThreadCreate("zmqBatchBenchmark", epicsThreadPriorityMedium,
+                               epicsThreadGetStackSize(epicsThreadStackMedium), batchReceiveTask, &receiver))
+        {
+            printf("epicsThreadCreate failure for the receive task\n");
+            break;
+        }
+        epicsTimeGetCurrent(&start);
+        while (sent < numArrays)
+        {
+            int count = numArrays - sent < batchSize ? numArrays - sent : batchSize;
+            size_t headerSize, dataSize = count * arraySize * sizeof(epicsUInt16);
+            for (int i = 0; i < count; i++)
+                arrays[i]->uniqueId = sent + i;
+            epicsTimeGetCurrent(&end);
+            if (batchSize == 1)
+            {
+                headerSize = writer.encode(arrays[0], end);
+                zmq_send(sender, writer.data(), headerSize, ZMQ_SNDMORE);
+                zmq_send(sender, arrays[0]->pData, dataSize, 0);
+            }
+            else
+            {
+                headerSize = zmqEncodeBatchHeader(&arrays[0], count, end, writer, header);
+                for (int i = 0; i < count; i++)
+                    memcpy(&data[i * arraySize * sizeof(epicsUInt16)], arrays[i]->pData,
+                           arraySize * sizeof(epicsUInt16));
+                zmq_send(sender, &header[0], headerSize, ZMQ_SNDMORE);
+                zmq_send(sender, &data[0], dataSize, 0);
+            }
+            sent += count;
+            messages++;
+        }
+        epicsEventWait(receiver.doneEvent);
+        epicsTimeGetCurrent(&end);
+        seconds = epicsTimeDiffInSeconds(&end, &start);
+
+        printf("  batch %4d: %10.0f messages/s %10.0f arrays/s %8.3f us/array\n", batchSize,
+               messages / seconds, receiver.received / seconds, seconds / receiver.received * 1e6);
+    }
+
+    for (size_t i = 0; i < arrays.size(); i++)
+    {
+        free(arrays[i]->pData);
+        arrays[i]->pData = NULL;
+        delete arrays[i];
+    }
+    zmq_close(sender);
+    zmq_close(receiver.socket);
+    zmq_ctx_destroy(context);
+    epicsEventDestroy(receiver.doneEvent);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *benchmark = argc > 1 ? argv[1] : "";
+    int args[3];
+
+    /* arguments left out take the defaults of each benchmark */
+    for (int i = 0; i < 3; i++)
+        args[i] = argc > i + 2 ? atoi(argv[i + 2]) : 0;
+
+    if (strcmp(benchmark, "header") == 0)
+        zmqHeaderBenchmark(args[0], args[1]);
+    else if (strcmp(benchmark, "write") == 0)
+        zmqHeaderWriteBenchmark(args[0]);
+    else if (strcmp(benchmark, "batch") == 0)
+        zmqBatchBenchmark(args[0], args[1], args[2]);
+    else
+    {
+        fprintf(stderr, "Usage: %s header [numAttributes [iterations]]\n"
+                        "       %s write [iterations]\n"
+                        "       %s batch [maxBatchSize [arraySize [numArrays]]]\n",
+                argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* ZMQCodec.cpp
+ *
+ * Lossless compression of the data part, shared by the driver and the plugin.
+ * The codecs come from the bitshuffle library of ADSupport, which carries LZ4,
+ * and are only built in when WITH_BITSHUFFLE=YES.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#ifdef HAVE_BITSHUFFLE
+#include "bitshuffle.h"
+#include "lz4.h"
+#endif
+
+#include "ZMQCodec.h"
+
+#ifdef HAVE_BITSHUFFLE
+/* check that the blocks of a bslz4 chunk add up to its size before bitshuffle, which is not given
+ * the compressed size, reads them: each block of elements is a big endian 4 byte compressed size
+ * followed by that many bytes, and elements beyond the last multiple of 8 follow as they are */
+static bool bslz4Fits(const unsigned char *src, size_t srcSize, size_t elements, size_t elementSize,
+                      size_t blockSize)
+{
+    size_t offset = 0;
+
+    if (blockSize == 0)
+        blockSize = bshuf_default_block_size(elementSize);
+    if (blockSize % 8 != 0)
+        return false;
+
+    while (elements >= 8)
+    {
+        size_t n = elements < blockSize ? elements - elements % 8 : blockSize;
+        size_t compressed;
+        if (srcSize - offset < 4)
+            return false;
+        compressed = ((size_t) src[offset] << 24) | ((size_t) src[offset + 1] << 16) |
+                     ((size_t) src[offset + 2] << 8) | src[offset + 3];
+        offset += 4;
+        if (srcSize - offset < compressed)
+            return false;
+        offset += compressed;
+        elements -= n;
+    }
+    return srcSize - offset == elements * elementSize;
+}
+#endif
+
+const char *zmqCodecName(int codec)
+{
+    switch (codec)
+    {
+        case ZMQCodecLZ4:
+            return "lz4";
+        case ZMQCodecBSLZ4:
+            return "bslz4";
+        default:
+            return NULL;
+    }
+}
+
+int zmqCodecFromName(const char *name, size_t len)
+{
+    for (int codec = ZMQCodecLZ4; codec < ZMQNumCodecs; codec++)
+        if (strlen(zmqCodecName(codec)) == len && strncmp(zmqCodecName(codec), name, len) == 0)
+            return codec;
+    return ZMQNumCodecs;
+}
+
+bool zmqCodecAvailable(int codec)
+{
+#ifdef HAVE_BITSHUFFLE
+    return codec >= ZMQCodecNone && codec < ZMQNumCodecs;
+#else
+    return codec == ZMQCodecNone;
+#endif
+}
+
+size_t zmqCodecChunkSize(size_t elementSize)
+{
+    size_t block = 8 * elementSize;
+
+    return block < ZMQ_CODEC_CHUNK_SIZE ? ZMQ_CODEC_CHUNK_SIZE / block * block : block;
+}
+
+size_t zmqCodecBound(int codec, size_t size, size_t elementSize)
+{
+#ifdef HAVE_BITSHUFFLE
+    if (codec == ZMQCodecLZ4)
+        return (size_t) LZ4_compressBound((int) size);
+    if (codec == ZMQCodecBSLZ4)
+        return (size_t) bshuf_compress_lz4_bound(size / elementSize, elementSize, 0);
+#endif
+    return 0;
+}
+
+size_t zmqCompressChunk(int codec, const void *src, size_t size, size_t elementSize, void *dst)
+{
+#ifdef HAVE_BITSHUFFLE
+    if (codec == ZMQCodecLZ4)
+    {
+        int n = LZ4_compress_default((const char *) src, (char *) dst, (int) size,
+                                     LZ4_compressBound((int) size));
+        return n > 0 ? (size_t) n : 0;
+    }
+    if (codec == ZMQCodecBSLZ4)
+    {
+        int64_t n = bshuf_compress_lz4(src, dst, size / elementSize, elementSize, 0);
+        return n > 0 ? (size_t) n : 0;
+    }
+#endif
+    return 0;
+}
+
+bool zmqDecompressChunk(int codec, const void *src, size_t srcSize, void *dst, size_t size, size_t elementSize,
+                        size_t blockSize)
+{
+#ifdef HAVE_BITSHUFFLE
+    if (codec == ZMQCodecLZ4)
+        return LZ4_decompress_safe((const char *) src, (char *) dst, (int) srcSize, (int) size) == (int) size;
+    /* bitshuffle is told the size and reports the compressed bytes it read */
+    if (codec == ZMQCodecBSLZ4)
+        return size % elementSize == 0 &&
+               bslz4Fits((const unsigned char *) src, srcSize, size / elementSize, elementSize, blockSize) &&
+               bshuf_decompress_lz4(src, dst, size / elementSize, elementSize, blockSize) == (int64_t) srcSize;
+#endif
+    return false;
+}
+
+bool zmqNDCodecAvailable(const char *name)
+{
+    int codec = zmqCodecFromName(name, strlen(name));
+
+    return codec != ZMQNumCodecs && zmqCodecAvailable(codec);
+}
+
+bool zmqDecompressNDCodec(const char *name, const void *src, size_t srcSize, void *dst, size_t size,
+                          size_t elementSize)
+{
+    const unsigned char *p = (const unsigned char *) src;
+    int codec = zmqCodecFromName(name, strlen(name));
+    uint64_t totalSize = 0;
+    size_t blockBytes;
+
+    if (codec == ZMQCodecLZ4)
+        return zmqDecompressChunk(codec, src, srcSize, dst, size, elementSize);
+    if (codec != ZMQCodecBSLZ4 || srcSize < 12)
+        return false;
+    for (int i = 0; i < 8; i++)
+        totalSize = (totalSize << 8) | p[i];
+    blockBytes = ((size_t) p[8] << 24) | ((size_t) p[9] << 16) | ((size_t) p[10] << 8) | p[11];
+    if (totalSize != size || blockBytes % elementSize != 0)
+        return false;
+    return zmqDecompressChunk(codec, p + 12, srcSize - 12, dst, size, elementSize, blockBytes / elementSize);
+}
@@ -0,0 +1,82 @@
+/* ZMQCodec.h
+ *
+ * Lossless compression of the data part, shared by the driver and the plugin.
+ *
+ * A compressed array is sent in chunks of chunkSize uncompressed bytes, each compressed on its own
+ * and sent as a message part of its own after the header, the last chunk holding what is left.
+ * "lz4" chunks are LZ4 blocks, "bslz4" chunks are the output of bshuf_compress_lz4 with the
+ * default block size, as read by bitshuffle.decompress_lz4.
+ *
+ */
+
+#ifndef ADZMQ_ZMQCODEC_H
+#define ADZMQ_ZMQCODEC_H
+
+#include <stddef.h>
+
+/* compression of the data part, the values are sent in chunk-bin-1.0 headers */
+typedef enum
+{
+    ZMQCodecNone,
+    ZMQCodecLZ4,   /* "lz4" */
+    ZMQCodecBSLZ4, /* "bslz4", bitshuffle followed by LZ4 */
+    ZMQNumCodecs
+} ZMQCodec_t;
+
+/* uncompressed bytes in a chunk, rounded down to whole blocks of 8 elements */
+#define ZMQ_CODEC_CHUNK_SIZE (1 << 20)
+
+/** Name of a codec in a chunk-1.0 header, NULL for ZMQCodecNone and unknown codecs. */
+const char *zmqCodecName(int codec);
+
+/** Codec named in a header, ZMQNumCodecs if the name is not known. */
+int zmqCodecFromName(const char *name, size_t len);
+
+/** Whether the codec was built in. */
+bool zmqCodecAvailable(int codec);
+
+/** Uncompressed bytes in each chunk of an array with elements of elementSize bytes. */
+size_t zmqCodecChunkSize(size_t elementSize);
+
+/** Largest compressed size of a chunk. */
+size_t zmqCodecBound(int codec, size_t size, size_t elementSize);
+
+/** Compress a chunk.
+  * \param[in] codec The codec.
+  * \param[in] src The chunk, a whole number of elements.
+  * \param[in] size Size of the chunk in bytes.
+  * \param[in] elementSize Size of an element in bytes.
+  * \param[out] dst Receives the compressed chunk, zmqCodecBound bytes.
+  * \return The compressed size, 0 on failure. */
+size_t zmqCompressChunk(int codec, const void *src, size_t size, size_t elementSize, void *dst);
+
+/** Decompress a chunk.
+  * \param[in] codec The codec.
+  * \param[in] src The compressed chunk.
+  * \param[in] srcSize Size of the compressed chunk in bytes.
+  * \param[out] dst Receives the chunk.
+  * \param[in] size Size of the chunk in bytes.
+  * \param[in] elementSize Size of an element in bytes.
+  * \param[in] blockSize Elements in a bitshuffle block, 0 for the default of bshuf_compress_lz4.
+  * \return true if the chunk decompressed to exactly size bytes. */
+bool zmqDecompressChunk(int codec, const void *src, size_t srcSize, void *dst, size_t size, size_t elementSize,
+                        size_t blockSize = 0);
+
+/** Whether an array compressed upstream, by NDPluginCodec, can be decompressed.
+  * \param[in] name The NDArray codec name. */
+bool zmqNDCodecAvailable(const char *name);
+
+/** Decompress an array compressed upstream by NDPluginCodec: "lz4" is a single LZ4 block,
+  * "bslz4" a big endian 8 byte uncompressed size and 4 byte block size in bytes followed by the
+  * output of bshuf_compress_lz4, as for the HDF5 bitshuffle filter.
+  * \param[in] name The NDArray codec name.
+  * \param[in] src The compressed data.
+  * \param[in] srcSize Size of the compressed data in bytes.
+  * \param[out] dst Receives the array data.
+  * \param[in] size Size of the array data in bytes.
+  * \param[in] elementSize Size of an element in bytes.
+  * \return true if the data decompressed to exactly size bytes. */
+bool zmqDecompressNDCodec(const char *name, const void *src, size_t srcSize, void *dst, size_t size,
+                          size_t elementSize);
+
+#endif //ADZMQ_ZMQCODEC_H
@@ -16,9 +16,6 @@
 #include <sstream>
 #include <zmq.h>
 
-// TODO: replace JSON library with rapidJSON
-#include <JSON.h>
-
 #include "ZMQControlledDriver.h"
 
 static const char *driverName = "ZMQControlledDriver";
@@ -57,6 +54,7 @@ ZMQControlledDriver::ZMQControlledDriver(const char *portName, const char *addre
     this->controlAddr = addrStream.str();
     asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW, "binding to control socket %s\n", this->controlAddr.c_str());
     zmq_bind(this->controlSocket, this->controlAddr.c_str());
+    this->headerLock = epicsMutexMustCreate();
     this->sendStop = controlMode & SEND_STOP;
     this->busyAcquire = controlMode & BUSY_ACQUIRE;
 }
@@ -67,42 +65,35 @@ ZMQControlledDriver::~ZMQControlledDriver()
     zmq_close(this->controlSocket);
 }
 
-ChunkInfo ZMQControlledDriver::parseHeader(const char *msg, NDAttributeList &attributeList)
+/* the port lock is only taken when the dataSource or statusMessage of the sender has changed */
+void ZMQControlledDriver::readHeaderStrings(const char *msg, size_t len)
 {
-    ChunkInfo info;
-    info.valid = false; /* indicate an invalid value */
-
-    JSONValue *value = JSON::Parse(msg);
-    if (value == NULL)
-        return info;
-
-    this->getNDAttrFromJSON(value, info, attributeList);
-
-    JSONObject root = value->AsObject();
-
-    if (root.find(L"dataSource") != root.end())
-    {
-        std::wstring vw = root[L"dataSource"]->AsString();
-        std::string v(vw.begin(), vw.end());
-        setStringParam(ADModel, v.c_str());
-    }
-
-    if (root.find(L"dataSource") != root.end())
-    {
-        std::wstring vw = root[L"dataSource"]->AsString();
-        std::string v(vw.begin(), vw.end());
-        setStringParam(ADModel, v.c_str());
-    }
-
-    if (root.find(L"statusMessage") != root.end())
-    {
-        std::wstring vw = root[L"statusMessage"]->AsString();
-        std::string v(vw.begin(), vw.end());
-        setStringParam(ADStatusMessage, v.c_str());
-    }
-
-    delete value;
-    return info;
+    char dataSource[256], statusMessage[256];
+    bool hasDataSource, hasStatusMessage, changed;
+
+    hasDataSource = zmqHeaderGetString(msg, len, "dataSource", dataSource, sizeof(dataSource));
+    hasStatusMessage = zmqHeaderGetString(msg, len, "statusMessage", statusMessage, sizeof(statusMessage));
+    if (!hasDataSource && !hasStatusMessage)
+        return;
+
+    epicsMutexLock(this->headerLock);
+    changed = (hasDataSource && this->dataSource != dataSource) ||
+              (hasStatusMessage && this->statusMessage != statusMessage);
+    if (hasDataSource)
+        this->dataSource = dataSource;
+    if (hasStatusMessage)
+        this->statusMessage = statusMessage;
+    epicsMutexUnlock(this->headerLock);
+    if (!changed)
+        return;
+
+    this->lock();
+    if (hasDataSource)
+        setStringParam(ADModel, dataSource);
+    if (hasStatusMessage)
+        setStringParam(ADStatusMessage, statusMessage);
+    callParamCallbacks();
+    this->unlock();
 }
 
 
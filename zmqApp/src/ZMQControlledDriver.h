@@ -28,12 +28,15 @@ private:
     void startReceive(const char *receiveFunction);
     void stopAcquisition();
 
-    virtual ChunkInfo parseHeader(const char *msg, NDAttributeList &attributeList);
+    virtual void readHeaderStrings(const char *msg, size_t len);
 
     void *controlSocket;  /* main socket to ZMQ server */
     std::string controlAddr;
     bool busyAcquire;
     bool sendStop;
+    epicsMutexId headerLock;    /* protects the last header strings, shared by the receive threads */
+    std::string dataSource;     /* last dataSource and statusMessage of a header */
+    std::string statusMessage;
 
 };
 
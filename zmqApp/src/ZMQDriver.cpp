@@ -8,7 +8,9 @@
  * Created:  June 5, 2014
  *
  */
+#include <algorithm>
 #include <cstring>
+#include <cerrno>
 
 #include <epicsTime.h>
 #include <epicsThread.h>
@@ -22,271 +24,1285 @@
 
 #include <zmq.h>
 
-// TODO: replace JSON library with rapidJSON
-#include <JSON.h>
-
 #include "ZMQDriver.h"
+#include "ZMQArrayPool.h"
 
 static const char *driverName = "ZMQDriver";
 
-void ZMQDriver::getNDAttrFromJSON(JSONValue *value, ChunkInfo &info, NDAttributeList &attributeList)
+/* suffixes of the stage timing parameters, in the order of ZMQStage_t */
+static const char *const stageNames[ZMQNumStages] = {"RECV_WAIT", "PARSE", "ALLOC", "COPY", "PARAMS", "CALLBACKS"};
+/* suffixes of the latency parameters, in the order of ZMQLatency_t */
+static const char *const latencyNames[ZMQNumLatencies] = {"RECEIVE", "CALLBACKS"};
+
+/* seconds between attempts to allocate while blocking on an exhausted pool */
+#define ZMQ_OVERLOAD_POLL 0.001
+
+/* milliseconds a receive thread waits for a message before checking whether the driver is exiting */
+#define ZMQ_RECEIVE_POLL_MS 100
+
+/* seconds the destructor waits for each receive thread to exit */
+#define ZMQ_EXIT_TIMEOUT 5.0
+
+/* commands on the control socket of a receive thread */
+#define ZMQ_CONTROL_STOP 'S'    /* leave the receive loop */
+#define ZMQ_CONTROL_START 'G'   /* start receiving for an acquisition */
+#define ZMQ_CONTROL_IDLE 'I'    /* idle settings changed: attach or detach the socket, trim the pre-trigger frames */
+
+/* receive and drop the parts of a message that are left, so that the next message is a header again */
+static void skipParts(void *socket)
 {
-    if (!value->IsObject())
+    int more = 0;
+    size_t moreSize = sizeof(more);
+    zmq_msg_t message;
+
+    while (zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &moreSize) == 0 && more)
     {
-        fprintf(stderr, "Invalid JSON Object\n");
-        return;
+        zmq_msg_init(&message);
+        int rc = zmq_msg_recv(&message, socket, 0);
+        zmq_msg_close(&message);
+        if (rc == -1)
+            break;
     }
-    JSONObject root = value->AsObject();
+}
+
+/* receive and drop a whole message */
+static void dropMessage(void *socket)
+{
+    zmq_msg_t message;
+
+    zmq_msg_init(&message);
+    int rc = zmq_msg_recv(&message, socket, 0);
+    zmq_msg_close(&message);
+    if (rc != -1)
+        skipParts(socket);
+}
 
-    /* check htype, only "chunk-1.0" supported */
-    if (root.find(L"htype") == root.end() ||
-        !root[L"htype"]->IsArray())
+/* parse data header, binary or JSON through the cache if one is given */
+ChunkInfo ZMQDriver::parseHeader(const char *msg, size_t len, NDAttributeList &attributeList,
+                                 ZMQHeaderCache *pCache)
+{
+    ChunkInfo info;
+    if (zmqIsBinaryHeader(msg, len))
+        zmqParseBinaryHeader(msg, len, info, attributeList);
+    /* a header the cache reuses only differs from the last one in its numbers, so has the same strings */
+    else if (!pCache || !pCache->parse(msg, len, info, attributeList))
     {
+        if (!pCache)
+            zmqParseJSONHeader(msg, len, info, attributeList);
+        this->readHeaderStrings(msg, len);
+    }
+    return info;
+}
 
-        fprintf(stderr, "Invalid \"htype\" field\n");
-        return;
+/* read members of a JSON header the driver has a use for, called from the receive threads for headers
+ * whose strings may have changed */
+void ZMQDriver::readHeaderStrings(const char *msg, size_t len)
+{
+}
+
+/* take an array for a frame from the pool, applying the overload policy if the pool is exhausted.
+ * In zero-copy mode message is the data part the array is wrapped around, otherwise NULL.
+ * dataSize is the buffer size of an array kept compressed, 0 for the size of the uncompressed data.
+ * Returns NULL if the frame is dropped. */
+NDArray *ZMQDriver::allocArray(const ChunkInfo &info, zmq_msg_t *message, size_t dataSize)
+{
+    NDArray *pImage;
+    int acquire, policy;
+    double timeout, waited = 0;
+
+    while (1)
+    {
+        this->lock();
+        if (message)
+            /* the array takes over the message, which is closed when the array is finally released */
+            pImage = this->pZMQArrayPool->wrap(info.ndims, (size_t *) info.dims, info.dataType, message);
+        else
+            pImage = this->pNDArrayPool->alloc(info.ndims, (size_t *) info.dims, info.dataType, dataSize, NULL);
+        getIntegerParam(ADAcquire, &acquire);
+        getIntegerParam(zmqOverloadPolicyParam, &policy);
+        getDoubleParam(zmqOverloadTimeoutParam, &timeout);
+        this->unlock();
+        if (pImage)
+        {
+#ifdef ZMQ_NDARRAY_CODEC
+            /* a buffer that last held an array kept compressed may come back with its codec */
+            pImage->codec.name.clear();
+            pImage->compressedSize = 0;
+#endif
+            return pImage;
+        }
+
+        if (policy == ZMQOverloadDropOldest)
+        {
+            /* make room by dropping the oldest frame any receiver has queued, the one with the lowest
+             * frame number at the front of its ring */
+            NDArray *pOldest = NULL;
+            ZMQReceiver *pOldestReceiver = NULL;
+            int order, oldestOrder = 0;
+            for (size_t i = 0; i < this->receivers.size(); i++)
+            {
+                if (this->receivers[i]->ring.front(order) && (!pOldestReceiver || order < oldestOrder))
+                {
+                    pOldestReceiver = this->receivers[i];
+                    oldestOrder = order;
+                }
+            }
+            if (pOldestReceiver)
+                pOldest = pOldestReceiver->ring.pop();
+            /* the dispatch thread may have emptied that ring in the meantime */
+            for (size_t i = 0; i < this->receivers.size() && !pOldest; i++)
+                pOldest = this->receivers[i]->ring.pop();
+            if (pOldest)
+            {
+                pOldest->release();
+                this->overloadDroppedQueued++;
+                /* it no longer counts towards the images asked for */
+                this->framesReceived--;
+                continue;
+            }
+        }
+        else if (policy == ZMQOverloadBlock && acquire && waited < timeout)
+        {
+            epicsThreadSleep(ZMQ_OVERLOAD_POLL);
+            waited += ZMQ_OVERLOAD_POLL;
+            continue;
+        }
+        this->overloadDropped++;
+        return NULL;
     }
-    JSONArray htype = root[L"htype"]->AsArray();
-    if (htype[0]->AsString() != L"chunk-1.0")
+}
+
+/* receive the data part of a message into its own zmq message,
+ * the NDArray is then either wrapped around it or copied from it */
+asynStatus ZMQDriver::receiveMessage(void *socket, const ChunkInfo &info, int receiveMode, NDArray **ppImage)
+{
+    zmq_msg_t message;
+    int msg_len;
+    NDArrayInfo_t arrayInfo;
+    NDArray *pImage;
+    uint64_t start, allocStart, allocEnd;
+    const char *functionName = "receiveMessage";
+
+    start = zmqMonotonicNs();
+    zmq_msg_init(&message);
+    msg_len = zmq_msg_recv(&message, socket, 0);
+    if (msg_len == -1)
     {
-        fprintf(stderr, "\"htype\" != \"chunk-1.0\" \n");
-        return;
+        zmq_msg_close(&message);
+        fprintf(stderr, "%s:%s: %s \n",
+                driverName, functionName, zmq_strerror(zmq_errno()));
+        return asynError;
     }
 
-    /* get shape info */
-    if (root.find(L"shape") == root.end() ||
-        !root[L"shape"]->IsArray())
+    /* if header is not parsed correctly then discard data 
+     * NOTE: this check isn't done immeditely after parseHeader.
+     * If we abort from receiving multipart messages, the next run will crash.
+     * As of ZMQ 4.0.4.
+     * */
+    if (!info.valid)
     {
-        fprintf(stderr, "Invalid \"shape\" field\n");
-        return;
+        zmq_msg_close(&message);
+        skipParts(socket);
+        return asynError;
     }
-    JSONArray shape = root[L"shape"]->AsArray();
-    if (shape.size() > ND_ARRAY_MAX_DIMS)
-        return;
-    info.ndims = shape.size();
-    for (int i = 0; i < (int) shape.size(); i++)
+
+    allocStart = zmqMonotonicNs();
+    pImage = this->allocArray(info, receiveMode == ZMQReceiveZeroCopy ? &message : NULL);
+    allocEnd = zmqMonotonicNs();
+    if (!pImage)
     {
-        info.dims[i] = shape[i]->AsNumber();
+        /* the whole message has been received, so the stream stays aligned */
+        zmq_msg_close(&message);
+        *ppImage = NULL;
+        return asynSuccess;
     }
 
-    /* get frame number */
-    if (root.find(L"frame") == root.end() ||
-        !root[L"frame"]->IsNumber())
+    /* does the received array size actually match the header info ?*/
+    pImage->getInfo(&arrayInfo);
+    if ((int) arrayInfo.totalBytes != msg_len)
     {
-        fprintf(stderr, "Invalid \"frame\" field\n");
-        return;
+        zmq_msg_close(&message);
+        pImage->release();
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: received data size %d does not match header info %lu\n",
+                  driverName, functionName, msg_len, (unsigned long) arrayInfo.totalBytes);
+        return asynError;
     }
-    info.frame = root[L"frame"]->AsNumber();
 
-    /* get data type */
-    if (root.find(L"type") == root.end() ||
-        !root[L"type"]->IsString())
+    if (receiveMode != ZMQReceiveZeroCopy)
+        memcpy(pImage->pData, zmq_msg_data(&message), msg_len);
+    zmq_msg_close(&message);
+    this->stageTimes[ZMQStageAlloc].record(allocEnd - allocStart);
+    this->stageTimes[ZMQStageCopy].record(zmqMonotonicNs() - start - (allocEnd - allocStart));
+
+    *ppImage = pImage;
+    return asynSuccess;
+}
+
+/* take a buffer of the size given by the header from the pool before receiving the data part into it.
+ * zmq_recv still receives into a message of its own and copies it out, so this makes the same copy as
+ * Copy mode; only the allocation is moved ahead of the receive, and a frame the pool can not take is
+ * dropped before its data is copied. ZeroCopy is the only mode that does not copy the data part. */
+asynStatus ZMQDriver::receivePreallocated(void *socket, const ChunkInfo &info, NDArray **ppImage)
+{
+    int msg_len;
+    NDArrayInfo_t arrayInfo;
+    NDArray *pImage;
+    ZMQStageClock clock;
+    const char *functionName = "receivePreallocated";
+
+    pImage = this->allocArray(info, NULL);
+    clock.stop(this->stageTimes[ZMQStageAlloc]);
+    if (!pImage)
     {
-        fprintf(stderr, "Invalid \"type\" field\n");
-        return;
+        /* drain the data part so the next message is a header again */
+        zmq_msg_t message;
+        zmq_msg_init(&message);
+        msg_len = zmq_msg_recv(&message, socket, 0);
+        zmq_msg_close(&message);
+        if (msg_len == -1)
+            return asynError;
+        *ppImage = NULL;
+        return asynSuccess;
     }
-    info.valid = true;
-    std::wstring type = root[L"type"]->AsString();
-    if (type == L"uint8")
-        info.dataType = NDUInt8;
-    else if (type == L"int8")
-        info.dataType = NDInt8;
-    else if (type == L"int16")
-        info.dataType = NDInt16;
-    else if (type == L"uint16")
-        info.dataType = NDUInt16;
-    else if (type == L"int32")
-        info.dataType = NDInt32;
-    else if (type == L"uint32")
-        info.dataType = NDUInt32;
-    else
+    pImage->getInfo(&arrayInfo);
+
+    msg_len = zmq_recv(socket, pImage->pData, arrayInfo.totalBytes, 0);
+    if (msg_len == -1)
     {
-        info.valid = false;
-        fprintf(stderr, "Unsupported data type\n");
+        pImage->release();
+        fprintf(stderr, "%s:%s: %s \n",
+                driverName, functionName, zmq_strerror(zmq_errno()));
+        return asynError;
     }
-    /* parse ndattr */
-    if (root.find(L"ndattr") == root.end() ||
-        !root[L"ndattr"]->IsObject())
+
+    /* zmq_recv reports the real message size, even when it had to truncate it */
+    if ((size_t) msg_len != arrayInfo.totalBytes)
     {
-        return;
+        pImage->release();
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: received data size %d does not match header info %lu\n",
+                  driverName, functionName, msg_len, (unsigned long) arrayInfo.totalBytes);
+        return asynError;
     }
-    JSONObject ndattr = root[L"ndattr"]->AsObject();
-    for (JSONObject::iterator attr = ndattr.begin(); attr != ndattr.end(); ++attr)
+    clock.stop(this->stageTimes[ZMQStageCopy]);
+
+    *ppImage = pImage;
+    return asynSuccess;
+}
+
+/* receive a data part sent in compressed chunks, each decompressed straight into a pool buffer
+ * sized from the header */
+asynStatus ZMQDriver::receiveCompressed(void *socket, const ChunkInfo &info, NDArray **ppImage)
+{
+    zmq_msg_t message;
+    NDArrayInfo_t arrayInfo;
+    NDArray *pImage;
+    int more = 0;
+    size_t moreSize = sizeof(more);
+    size_t offset = 0, compressed = 0;
+    uint64_t decompressNs = 0;
+    ZMQStageClock clock;
+    const char *functionName = "receiveCompressed";
+
+    if (!zmqCodecAvailable(info.codec))
+    {
+        skipParts(socket);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: codec %s is not built in\n",
+                  driverName, functionName, zmqCodecName(info.codec));
+        return asynError;
+    }
+
+    pImage = this->allocArray(info, NULL);
+    clock.stop(this->stageTimes[ZMQStageAlloc]);
+    if (!pImage)
     {
-        std::wstring namew = attr->first;
-        std::string name(namew.begin(), namew.end());
+        skipParts(socket);
+        *ppImage = NULL;
+        return asynSuccess;
+    }
+
+    /* the size check of the other modes is made against the size once decompressed */
+    pImage->getInfo(&arrayInfo);
+    if (arrayInfo.totalBytes != info.uncompressedSize)
+    {
+        pImage->release();
+        skipParts(socket);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: uncompressed data size %lu does not match header info %lu\n",
+                  driverName, functionName, (unsigned long) info.uncompressedSize,
+                  (unsigned long) arrayInfo.totalBytes);
+        return asynError;
+    }
 
-        JSONObject attrStruct = attr->second->AsObject();
-        JSONValue *val = attrStruct[L"value"];
-        JSONValue *type = attrStruct[L"dataType"];
-        std::wstring vw = type->AsString();
-        std::string attrType(vw.begin(), vw.end());
-        // could check dataType here, but current JSON library converts all numbers to double
-        if (val->IsNumber())
+    zmq_msg_init(&message);
+    while (zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &moreSize) == 0 && more)
+    {
+        size_t size = arrayInfo.totalBytes - offset < info.chunkSize ? arrayInfo.totalBytes - offset : info.chunkSize;
+        uint64_t start;
+        bool decompressed;
+
+        if (zmq_msg_recv(&message, socket, 0) == -1)
         {
-            double v = val->AsNumber();
-            attributeList.add(name.c_str(), name.c_str(), NDAttrFloat64, &v);
+            zmq_msg_close(&message);
+            pImage->release();
+            fprintf(stderr, "%s:%s: %s \n",
+                    driverName, functionName, zmq_strerror(zmq_errno()));
+            return asynError;
         }
-        else if (val->IsString() && attrType == "string")
+        start = zmqMonotonicNs();
+        decompressed = size > 0 &&
+                       zmqDecompressChunk(info.codec, zmq_msg_data(&message), zmq_msg_size(&message),
+                                          (char *) pImage->pData + offset, size, arrayInfo.bytesPerElement);
+        decompressNs += zmqMonotonicNs() - start;
+        if (!decompressed)
         {
-            std::wstring vw = val->AsString();
-            std::string v(vw.begin(), vw.end());
-            attributeList.add(name.c_str(), name.c_str(), NDAttrString, (void *) v.c_str());
+            zmq_msg_close(&message);
+            pImage->release();
+            skipParts(socket);
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: chunk at %lu of %lu bytes does not decompress\n",
+                      driverName, functionName, (unsigned long) offset, (unsigned long) arrayInfo.totalBytes);
+            return asynError;
         }
-        else
+        offset += size;
+        compressed += zmq_msg_size(&message);
+    }
+    zmq_msg_close(&message);
+
+    if (offset != arrayInfo.totalBytes)
+    {
+        pImage->release();
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: received data size %lu does not match header info %lu\n",
+                  driverName, functionName, (unsigned long) offset, (unsigned long) arrayInfo.totalBytes);
+        return asynError;
+    }
+    clock.stop(this->stageTimes[ZMQStageCopy]);
+    this->compressedBytes += compressed;
+    this->uncompressedBytes += arrayInfo.totalBytes;
+    this->decompressNs += decompressNs;
+
+    *ppImage = pImage;
+    return asynSuccess;
+}
+
+/* receive an array that was compressed upstream, e.g. by NDPluginCodec. It is passed on compressed
+ * as it arrived, or decompressed into a pool buffer if asked to and the codec is built in */
+asynStatus ZMQDriver::receiveEncoded(void *socket, const ChunkInfo &info, bool decompress, NDArray **ppImage)
+{
+    zmq_msg_t message;
+    int msg_len;
+    NDArrayInfo_t arrayInfo;
+    NDArray *pImage;
+    bool decompressed;
+    uint64_t start;
+    ZMQStageClock clock;
+    const char *functionName = "receiveEncoded";
+
+    decompress = decompress && zmqNDCodecAvailable(info.ndCodec);
+#ifndef ZMQ_NDARRAY_CODEC
+    if (!decompress)
+    {
+        skipParts(socket);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: arrays compressed with %s need ADCore R3-4 to be passed on\n",
+                  driverName, functionName, info.ndCodec);
+        return asynError;
+    }
+#endif
+
+    pImage = this->allocArray(info, NULL, decompress ? 0 : info.compressedSize);
+    clock.stop(this->stageTimes[ZMQStageAlloc]);
+    if (!pImage)
+    {
+        skipParts(socket);
+        *ppImage = NULL;
+        return asynSuccess;
+    }
+    pImage->getInfo(&arrayInfo);
+
+    if (!decompress)
+    {
+        msg_len = zmq_recv(socket, pImage->pData, info.compressedSize, 0);
+        if (msg_len == -1)
+        {
+            pImage->release();
+            fprintf(stderr, "%s:%s: %s \n",
+                    driverName, functionName, zmq_strerror(zmq_errno()));
+            return asynError;
+        }
+        if ((size_t) msg_len != info.compressedSize)
         {
-            fprintf(stderr, "Invalid \"ndattr\" type\n");
+            pImage->release();
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: received data size %d does not match compressed size %lu\n",
+                      driverName, functionName, msg_len, (unsigned long) info.compressedSize);
+            return asynError;
         }
+#ifdef ZMQ_NDARRAY_CODEC
+        pImage->codec.name = info.ndCodec;
+        pImage->compressedSize = info.compressedSize;
+#endif
     }
+    else
+    {
+        zmq_msg_init(&message);
+        msg_len = zmq_msg_recv(&message, socket, 0);
+        if (msg_len == -1)
+        {
+            zmq_msg_close(&message);
+            pImage->release();
+            fprintf(stderr, "%s:%s: %s \n",
+                    driverName, functionName, zmq_strerror(zmq_errno()));
+            return asynError;
+        }
+        start = zmqMonotonicNs();
+        decompressed = (size_t) msg_len == info.compressedSize &&
+                       zmqDecompressNDCodec(info.ndCodec, zmq_msg_data(&message), msg_len, pImage->pData,
+                                            arrayInfo.totalBytes, arrayInfo.bytesPerElement);
+        this->decompressNs += zmqMonotonicNs() - start;
+        zmq_msg_close(&message);
+        if (!decompressed)
+        {
+            pImage->release();
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: %d bytes compressed with %s do not decompress to %lu\n",
+                      driverName, functionName, msg_len, info.ndCodec, (unsigned long) arrayInfo.totalBytes);
+            return asynError;
+        }
+        this->compressedBytes += msg_len;
+        this->uncompressedBytes += arrayInfo.totalBytes;
+    }
+    clock.stop(this->stageTimes[ZMQStageCopy]);
 
+    *ppImage = pImage;
+    return asynSuccess;
 }
 
-/* parse data header */
-ChunkInfo ZMQDriver::parseHeader(const char *msg, NDAttributeList &attributeList)
+/* attach the sockets of a receive thread to their endpoints */
+void ZMQDriver::attachReceiver(ZMQReceiver *pReceiver)
 {
-    ChunkInfo info;
-    info.valid = false; /* indicate an invalid value */
+    const char *functionName = "attachReceiver";
+
+    for (size_t i = 0; i < pReceiver->sources.size(); i++)
+    {
+        const ZMQSource &source = pReceiver->sources[i];
+        const ZMQEndpoint &endpoint = source.endpoint;
+        if ((endpoint.bind ? zmq_bind(source.socket, endpoint.address.c_str()) :
+             zmq_connect(source.socket, endpoint.address.c_str())) != 0)
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: unable to %s %s, %s\n",
+                      driverName, functionName, endpoint.bind ? "bind" : "connect",
+                      endpoint.address.c_str(), zmq_strerror(zmq_errno()));
+    }
+    pReceiver->attached = true;
+}
 
-    JSONValue *value = JSON::Parse(msg);
-    if (value == NULL)
-        return info;
+void ZMQDriver::detachReceiver(ZMQReceiver *pReceiver)
+{
+    for (size_t i = 0; i < pReceiver->sources.size(); i++)
+        zmqDetachEndpoints(pReceiver->sources[i].socket, std::vector<ZMQEndpoint>(1, pReceiver->sources[i].endpoint));
+    pReceiver->attached = false;
+}
 
-    this->getNDAttrFromJSON(value, info, attributeList);
+/* the first source with a message after the one served last, so that each endpoint gets its turn however
+ * busy the others are. Called once the data sockets have been polled. */
+static ZMQSource *nextReadable(ZMQReceiver *pReceiver)
+{
+    size_t numSources = pReceiver->sources.size();
 
-    delete value;
-    return info;
+    for (size_t n = 0; n < numSources; n++)
+    {
+        size_t i = (pReceiver->nextSource + n) % numSources;
+        if (pReceiver->pollItems[i + 1].revents & ZMQ_POLLIN)
+        {
+            pReceiver->nextSource = (i + 1) % numSources;
+            return &pReceiver->sources[i];
+        }
+    }
+    return NULL;
 }
 
-asynStatus ZMQDriver::readData()
+/* whether sockets stay attached between acquisitions */
+bool ZMQDriver::keepAttached()
 {
+    return this->persistent || this->preTriggerFrames > 0;
+}
 
-    int rc;
+/* drop the oldest pre-trigger frames beyond the depth and memory asked for */
+void ZMQDriver::trimPreTrigger(ZMQReceiver *pReceiver)
+{
+    size_t maxFrames = this->preTriggerFrames > 0 ? (size_t) this->preTriggerFrames : 0;
+    size_t maxBytes = this->preTriggerMemory > 0 ? (size_t) this->preTriggerMemory << 20 : 0;
+    NDArray *pImage;
+
+    while (!pReceiver->preTrigger.empty() &&
+           (pReceiver->preTrigger.size() > maxFrames || (maxBytes && pReceiver->preTriggerBytes > maxBytes)))
+    {
+        pImage = pReceiver->preTrigger.front();
+        pReceiver->preTrigger.pop_front();
+        pReceiver->preTriggerBytes -= pImage->dataSize;
+        pImage->release();
+        this->preTriggerHeld--;
+    }
+}
+
+/* called by the receive threads without the lock */
+void ZMQDriver::publishPreTrigger()
+{
+    this->lock();
+    setIntegerParam(zmqPreTriggerHeldParam, this->preTriggerHeld);
+    callParamCallbacks();
+    this->unlock();
+}
+
+/* wait until an acquisition starts, false if the driver is exiting. A persistent socket stays attached
+ * meanwhile. Whatever arrives on it is kept as pre-trigger frames if asked for, and otherwise thrown
+ * away unparsed, so a SUB socket keeps its subscriptions and a PUSH sender is never held up. */
+bool ZMQDriver::waitForStart(ZMQReceiver *pReceiver)
+{
+    std::vector<zmq_pollitem_t> &items = pReceiver->pollItems;
     zmq_msg_t message;
-    int msg_len;
-    char header[1024];
-    ChunkInfo info;
-    int nrows, ncols;
-    NDColorMode_t colorMode;
-    NDArrayInfo_t arrayInfo;
-    NDArray *pImage = this->pArrays[0];
-    NDAttributeList attributeList;
-    const char *functionName = "readData";
+    std::vector<NDArray *> images;
+    ZMQSource *pSource;
+    char command;
+    asynStatus status;
+    const char *functionName = "waitForStart";
 
-    /* receive header */
-    rc = zmq_msg_init(&message);
-    msg_len = zmq_msg_recv(&message, this->socket, 0);
-    if (msg_len == -1)
+    while (!this->exiting)
     {
-        zmq_msg_close(&message);
-        fprintf(stderr, "%s:%s: %s \n",
-                driverName, functionName, zmq_strerror(zmq_errno()));
-        return asynError;
+        if (this->keepAttached() && !pReceiver->attached)
+            this->attachReceiver(pReceiver);
+        else if (!this->keepAttached() && pReceiver->attached)
+            this->detachReceiver(pReceiver);
+
+        for (size_t i = 1; i < items.size(); i++)
+            items[i].revents = 0;
+        if (zmq_poll(&items[0], pReceiver->attached ? (int) items.size() : 1, ZMQ_RECEIVE_POLL_MS) == -1)
+        {
+            if (zmq_errno() != EINTR)
+            {
+                fprintf(stderr, "%s:%s: %s \n",
+                        driverName, functionName, zmq_strerror(zmq_errno()));
+                epicsThreadSleep(ZMQ_RECEIVE_POLL_MS / 1000.);
+            }
+            continue;
+        }
+        if (items[0].revents & ZMQ_POLLIN)
+        {
+            /* anything else is a stop that came too late, or a change of the idle settings */
+            if (!pReceiver->preTrigger.empty())
+            {
+                this->trimPreTrigger(pReceiver);
+                this->publishPreTrigger();
+            }
+            if (zmq_recv(pReceiver->controlSocket, &command, 1, ZMQ_DONTWAIT) == 1 && command == ZMQ_CONTROL_START)
+                return true;
+            continue;
+        }
+        pSource = nextReadable(pReceiver);
+        if (pSource && this->preTriggerFrames > 0)
+        {
+            /* received into pool buffers that are passed on as they are when the acquisition starts */
+            pReceiver->idle = true;
+            status = this->readData(pReceiver, images, pSource);
+            pReceiver->idle = false;
+            if (status != asynSuccess)
+                continue;
+            for (size_t i = 0; i < images.size(); i++)
+            {
+                pReceiver->preTrigger.push_back(images[i]);
+                pReceiver->preTriggerBytes += images[i]->dataSize;
+                this->preTriggerHeld++;
+            }
+            this->trimPreTrigger(pReceiver);
+            this->publishPreTrigger();
+        }
+        else if (pSource)
+        {
+            zmq_msg_init(&message);
+            if (zmq_msg_recv(&message, pSource->socket, ZMQ_DONTWAIT) >= 0)
+            {
+                skipParts(pSource->socket);
+                this->idleDiscarded++;
+            }
+            zmq_msg_close(&message);
+        }
     }
+    return false;
+}
 
-    /* is this the message to stop? */
-    if (msg_len == 4 &&
-        strncmp((const char *) zmq_msg_data(&message), "STOP", 4) == 0)
+/* wait until a message can be received from one of the data sockets and return its source, NULL if the
+ * receive thread has been told to stop on its control socket or the driver is exiting. Commands come first,
+ * so a stop is seen at once however many messages are waiting. */
+ZMQSource *ZMQDriver::waitForData(ZMQReceiver *pReceiver)
+{
+    std::vector<zmq_pollitem_t> &items = pReceiver->pollItems;
+    ZMQSource *pSource;
+    char command;
+    const char *functionName = "waitForData";
+
+    while (!this->exiting)
     {
-        zmq_msg_close(&message);
-        return asynError;
+        if (zmq_poll(&items[0], (int) items.size(), ZMQ_RECEIVE_POLL_MS) == -1)
+        {
+            if (zmq_errno() == EINTR)
+                continue;
+            fprintf(stderr, "%s:%s: %s \n",
+                    driverName, functionName, zmq_strerror(zmq_errno()));
+            return NULL;
+        }
+        if (items[0].revents & ZMQ_POLLIN)
+        {
+            /* anything but a stop was meant for an idle thread and is dropped */
+            if (zmq_recv(pReceiver->controlSocket, &command, 1, ZMQ_DONTWAIT) == 1 && command == ZMQ_CONTROL_STOP)
+                return NULL;
+            continue;
+        }
+        pSource = nextReadable(pReceiver);
+        if (pSource)
+            return pSource;
     }
+    return NULL;
+}
 
-    /* parse the header */
-    strncpy(header, (const char *) zmq_msg_data(&message), msg_len);
-    header[msg_len] = '\0';
-    info = parseHeader(header, attributeList);
+/* drop a superseded message from the relay, counting its frames. Only a JSON header that carries a full
+ * attribute set is parsed, to keep that set for the frames that only send changes */
+void ZMQDriver::supersedeMessage(ZMQReceiver *pReceiver)
+{
+    static const char attributeKey[] = "\"ndattrKey\"";
+    zmq_msg_t message;
+    const char *msg, *end;
+    size_t len;
+    int frames = 1;
 
-    /* we are done with the header message */
+    zmq_msg_init(&message);
+    if (zmq_msg_recv(&message, pReceiver->relaySocket, 0) == -1)
+    {
+        zmq_msg_close(&message);
+        this->conflated++;
+        return;
+    }
+    msg = (const char *) zmq_msg_data(&message);
+    len = zmq_msg_size(&message);
+    end = msg + len;
+    if (!zmqIsBinaryHeader(msg, len))
+    {
+        if (zmqIsBatchHeader(msg, len) && zmqSplitBatchHeader(msg, len, pReceiver->batchEntries))
+            frames = (int) pReceiver->batchEntries.size();
+        else
+        {
+            pReceiver->batchEntries.resize(1);
+            pReceiver->batchEntries[0].offset = 0;
+            pReceiver->batchEntries[0].len = len;
+        }
+        if (std::search(msg, end, attributeKey, attributeKey + sizeof(attributeKey) - 1) != end)
+        {
+            for (size_t i = 0; i < pReceiver->batchEntries.size(); i++)
+            {
+                const ZMQBatchEntry &entry = pReceiver->batchEntries[i];
+                const char *header = msg + entry.offset;
+                NDAttributeList attributeList;
+                ChunkInfo info;
+
+                if (std::search(header, header + entry.len, attributeKey,
+                                attributeKey + sizeof(attributeKey) - 1) == header + entry.len)
+                    continue;
+                info = parseHeader(header, entry.len, attributeList, NULL);
+                if (info.valid && info.attributeSet == ZMQAttributesKey)
+                    this->storeAttributeBase(info.attributeKey, attributeList);
+            }
+        }
+    }
     zmq_msg_close(&message);
+    skipParts(pReceiver->relaySocket);
+    this->conflated += frames;
+}
 
-    /* receive data */
-    rc = zmq_msg_init(&message);
-    msg_len = zmq_msg_recv(&message, this->socket, 0);
-    if (msg_len == -1)
+/* receive every message waiting on the socket of a source but keep only the newest, which is passed through
+ * the relay so that it is received from relaySocket as it would have been from the socket. The parts are
+ * handed over without being copied, and superseded messages are dropped without receiving their arrays. */
+asynStatus ZMQDriver::conflateLatest(ZMQReceiver *pReceiver, ZMQSource *pSource)
+{
+    void *socket = pSource->socket;
+    zmq_msg_t message;
+    int more, events;
+    size_t optionSize;
+    bool held = false, partial, ok;
+    const char *functionName = "conflateLatest";
+
+    while (1)
+    {
+        /* a newer message is waiting */
+        if (held)
+        {
+            this->supersedeMessage(pReceiver);
+            this->endpointStats[pSource->endpointIndex].messages++;
+        }
+
+        partial = false;
+        do
+        {
+            more = 0;
+            optionSize = sizeof(more);
+            zmq_msg_init(&message);
+            ok = zmq_msg_recv(&message, socket, 0) != -1 &&
+                 zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &optionSize) == 0 &&
+                 zmq_msg_send(&message, pReceiver->relayPeer, more ? ZMQ_SNDMORE : 0) != -1;
+            if (!ok)
+            {
+                zmq_msg_close(&message);
+                fprintf(stderr, "%s:%s: %s \n",
+                        driverName, functionName, zmq_strerror(zmq_errno()));
+                /* end the parts already on the relay and throw them away */
+                if (partial)
+                {
+                    zmq_send(pReceiver->relayPeer, NULL, 0, 0);
+                    dropMessage(pReceiver->relaySocket);
+                }
+                return asynError;
+            }
+            partial = more != 0;
+        } while (more);
+        held = true;
+
+        events = 0;
+        optionSize = sizeof(events);
+        zmq_getsockopt(socket, ZMQ_EVENTS, &events, &optionSize);
+        if (!(events & ZMQ_POLLIN))
+            return asynSuccess;
+    }
+}
+
+/* whether a frame is passed on, or skipped for Decimation or MaxRate before anything is allocated for it.
+ * A skipped frame still leaves a full attribute set for the frames that only send changes.
+ * The caller counts the frame once it knows the message is valid. */
+bool ZMQDriver::acceptFrame(ZMQReceiver *pReceiver, const ChunkInfo &info, NDAttributeList &attributeList)
+{
+    uint64_t now, next;
+    bool accept = true;
+
+    /* every pre-trigger frame is kept, the settings and state of the last acquisition do not apply */
+    if (pReceiver->idle)
+        return true;
+
+    if (this->decimation > 1 && this->decimationCount++ % this->decimation != 0)
+        accept = false;
+    else if (this->minIntervalNs > 0)
+    {
+        /* the threads race for the next slot, only one of them gets it */
+        now = zmqMonotonicNs();
+        next = this->nextAcceptNs;
+        do
+        {
+            if (now < next)
+            {
+                accept = false;
+                break;
+            }
+        } while (!this->nextAcceptNs.compare_exchange_weak(next, now + this->minIntervalNs));
+    }
+
+    if (!accept && info.attributeSet == ZMQAttributesKey)
+        this->storeAttributeBase(info.attributeKey, attributeList);
+    return accept;
+}
+
+/* bytes of data of a frame described by a header */
+static size_t frameBytes(const ChunkInfo &info)
+{
+    size_t bytes;
+
+    switch (info.dataType)
+    {
+        case NDInt8:
+        case NDUInt8:
+            bytes = 1;
+            break;
+        case NDInt16:
+        case NDUInt16:
+            bytes = 2;
+            break;
+        case NDInt32:
+        case NDUInt32:
+        case NDFloat32:
+            bytes = 4;
+            break;
+        default:
+            bytes = 8;
+            break;
+    }
+    for (int i = 0; i < info.ndims; i++)
+        bytes *= info.dims[i];
+    return bytes;
+}
+
+/* receive the frames of a batch, whose data part holds their data one after the other.
+ * Each frame is copied out of the data part into a pool buffer, whatever the receive mode. */
+asynStatus ZMQDriver::receiveBatch(ZMQReceiver *pReceiver, void *socket, const char *msg, size_t len,
+                                   const epicsTimeStamp &receiveTime, std::vector<NDArray *> &images)
+{
+    zmq_msg_t message;
+    int more = 0;
+    size_t moreSize = sizeof(more);
+    const char *data;
+    size_t dataSize, offset = 0;
+    ChunkInfo info;
+    bool valid = true;
+    int accepted = 0, skipped = 0, dropped = 0;
+    ZMQStageClock clock;
+    const char *functionName = "receiveBatch";
+
+    if (!zmqSplitBatchHeader(msg, len, pReceiver->batchEntries))
+    {
+        skipParts(socket);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: invalid batch header\n", driverName, functionName);
+        return asynError;
+    }
+    if (zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &moreSize) != 0 || !more)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: batch without a data part\n", driverName, functionName);
+        return asynError;
+    }
+    zmq_msg_init(&message);
+    if (zmq_msg_recv(&message, socket, 0) == -1)
     {
         zmq_msg_close(&message);
         fprintf(stderr, "%s:%s: %s \n",
                 driverName, functionName, zmq_strerror(zmq_errno()));
         return asynError;
     }
+    data = (const char *) zmq_msg_data(&message);
+    dataSize = zmq_msg_size(&message);
+    clock.stop(this->stageTimes[ZMQStageCopy]);
 
-    /* is this the message to stop? */
-    if (msg_len == 4 &&
-        strncmp((const char *) zmq_msg_data(&message), "STOP", 4) == 0)
+    for (size_t i = 0; i < pReceiver->batchEntries.size() && valid; i++)
     {
-        printf("got STOP\n");
-        zmq_msg_close(&message);
-        return asynError;
+        const ZMQBatchEntry &entry = pReceiver->batchEntries[i];
+        NDAttributeList attributeList;
+        NDArray *pImage;
+        size_t bytes;
+
+        info = parseHeader(msg + entry.offset, entry.len, attributeList,
+                           this->headerCache ? &pReceiver->headerCache : NULL);
+        clock.stop(this->stageTimes[ZMQStageParse]);
+        /* only uncompressed arrays are batched */
+        bytes = frameBytes(info);
+        valid = info.valid && info.codec == ZMQCodecNone && !info.ndCodec[0] && bytes <= dataSize - offset;
+        if (!valid)
+            break;
+        if (!this->acceptFrame(pReceiver, info, attributeList))
+        {
+            skipped++;
+            offset += bytes;
+            continue;
+        }
+        accepted++;
+
+        pImage = this->allocArray(info, NULL);
+        clock.stop(this->stageTimes[ZMQStageAlloc]);
+        if (pImage)
+        {
+            memcpy(pImage->pData, data + offset, bytes);
+            this->completeFrame(pReceiver, info, attributeList, receiveTime, pImage);
+            images.push_back(pImage);
+        }
+        else
+            dropped++;
+        offset += bytes;
+        clock.stop(this->stageTimes[ZMQStageCopy]);
     }
+    zmq_msg_close(&message);
 
-    /* if header is not parsed correctly then discard data 
-     * NOTE: this check isn't done immeditely after parseHeader.
-     * If we abort from receiving multipart messages, the next run will crash.
-     * As of ZMQ 4.0.4.
-     * */
-    if (!info.valid)
+    /* skipped frames were not wanted whether or not the batch is valid, the others only count once it is */
+    this->framesSkipped += skipped;
+    if (!valid || offset != dataSize)
     {
-        zmq_msg_close(&message);
+        for (size_t i = 0; i < images.size(); i++)
+            images[i]->release();
+        this->countDropped(pReceiver, (int) pReceiver->batchEntries.size() - skipped);
+        images.clear();
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: received data size %lu does not match the %lu frames of the batch header\n",
+                  driverName, functionName, (unsigned long) dataSize,
+                  (unsigned long) pReceiver->batchEntries.size());
         return asynError;
     }
+    if (!pReceiver->idle)
+        this->framesAccepted += accepted;
+    if (dropped > 0)
+        this->countDropped(pReceiver, dropped);
+
+    this->lock();
+    this->lastChunkInfo = info;
+    this->unlock();
+    return asynSuccess;
+}
+
+/* keep a full attribute set for the frames that only send changes, whichever receive thread gets them */
+void ZMQDriver::storeAttributeBase(epicsUInt32 key, NDAttributeList &attributeList)
+{
+    epicsMutexLock(this->attributeLock);
+    this->attributeBases.store(key, attributeList);
+    epicsMutexUnlock(this->attributeLock);
+}
+
+/* set what a received frame takes from its header */
+void ZMQDriver::completeFrame(ZMQReceiver *pReceiver, const ChunkInfo &info, NDAttributeList &attributeList,
+                              const epicsTimeStamp &receiveTime, NDArray *pImage)
+{
+    NDColorMode_t colorMode;
+    const char *functionName = "completeFrame";
 
-    ncols = info.dims[0];
-    nrows = info.dims[1] == 0 ? 1 : info.dims[1];
     if (info.ndims == 3)
         colorMode = NDColorModeRGB1;
     else
         colorMode = NDColorModeMono;
 
-    this->lock();
-    if (pImage) pImage->release();
-    this->pArrays[0] = this->pNDArrayPool->alloc(info.ndims, info.dims, info.dataType, 0, NULL);
-    pImage = this->pArrays[0];
     asynPrint(this->pasynUserSelf, ASYN_TRACEIO_DRIVER,
               "%s:%s: dimensions=[%lu,%lu,%lu]\n",
               driverName, functionName,
               (unsigned long) info.dims[0], (unsigned long) info.dims[1], (unsigned long) info.dims[2]);
 
-    /* does the received array size actually match the header info ?*/
-    pImage->getInfo(&arrayInfo);
-    if ((int) arrayInfo.totalBytes != msg_len)
+    /* image unique id comes from the server, and the time stamps too if the header has them,
+     * otherwise the frame is stamped with the time its header arrived */
+    pImage->uniqueId = info.frame;
+    if (info.valid && info.hasTimeStamp)
+    {
+        pImage->timeStamp = info.timeStamp;
+        pImage->epicsTS = info.epicsTS;
+    }
+    else
+    {
+        pImage->timeStamp = receiveTime.secPastEpoch + receiveTime.nsec / 1.e9;
+        pImage->epicsTS = receiveTime;
+    }
+    pImage->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
+    if (info.valid && info.attributeSet == ZMQAttributesKey)
+        this->storeAttributeBase(info.attributeKey, attributeList);
+    else if (info.valid && info.attributeSet == ZMQAttributesDelta)
+    {
+        /* the header only has the attributes that changed since the full set it refers to,
+         * which may have reached another receive thread */
+        epicsMutexLock(this->attributeLock);
+        NDAttributeList *pBase = this->attributeBases.find(info.attributeKey);
+        if (pBase)
+            pBase->copy(pImage->pAttributeList);
+        epicsMutexUnlock(this->attributeLock);
+        if (!pBase)
+            this->attributeBaseMissing++;
+    }
+    attributeList.copy(pImage->pAttributeList);
+
+    /* publishArray measures the latency to the callbacks from this attribute,
+     * it replaces any send time forwarded from further upstream */
+    if (info.valid && info.hasSendTime)
+    {
+        double sendTime = info.sendTime.secPastEpoch + info.sendTime.nsec / 1.e9;
+        this->stageTimes.latency(ZMQLatencyReceive).record(epicsTimeDiffInSeconds(&receiveTime, &info.sendTime));
+        pImage->pAttributeList->add(ZMQ_SEND_TIME_ATTRIBUTE, "Time the sender sent the array", NDAttrFloat64,
+                                    &sendTime);
+    }
+}
+
+/* count frames of the message being received as dropped against its endpoint */
+void ZMQDriver::countDropped(ZMQReceiver *pReceiver, int frames)
+{
+    if (pReceiver->pSource)
+        this->endpointStats[pReceiver->pSource->endpointIndex].dropped += frames;
+}
+
+/* receive one message, on success images holds its frames, new arrays owned by the caller.
+ * That is one frame, or several for a batch, and none if the overload policy dropped them.
+ * pSource is a source the caller has already seen to have a message, NULL to wait for one. */
+asynStatus ZMQDriver::readData(ZMQReceiver *pReceiver, std::vector<NDArray *> &images, ZMQSource *pSource)
+{
+    void *socket;
+
+    int rc;
+    zmq_msg_t message;
+    int msg_len;
+    ChunkInfo info;
+    int receiveMode, decompress;
+    asynStatus status;
+    NDArray *pImage = NULL;
+    NDAttributeList attributeList;
+    epicsTimeStamp receiveTime;
+    ZMQStageClock clock;
+    const char *functionName = "readData";
+
+    images.clear();
+
+    /* wait for a header, or to be stopped */
+    if (!pSource)
+        pSource = this->waitForData(pReceiver);
+    if (!pSource)
+        return asynError;
+    pReceiver->pSource = pSource;
+    socket = pSource->socket;
+
+    /* with Conflate only the newest of the messages waiting is received, from the relay */
+    if (this->conflate)
+    {
+        if (this->conflateLatest(pReceiver, pSource) != asynSuccess)
+            return asynError;
+        socket = pReceiver->relaySocket;
+    }
+
+    /* receive header, the parts of a message arrive together so the data parts are there too */
+    rc = zmq_msg_init(&message);
+    msg_len = zmq_msg_recv(&message, socket, 0);
+    if (msg_len == -1)
     {
         zmq_msg_close(&message);
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                  "%s:%s: received data size %d does not match header info %ul\n",
-                  driverName, functionName, msg_len, arrayInfo.totalBytes);
+        fprintf(stderr, "%s:%s: %s \n",
+                driverName, functionName, zmq_strerror(zmq_errno()));
         return asynError;
     }
+    clock.stop(this->stageTimes[ZMQStageReceiveWait]);
+    epicsTimeGetCurrent(&receiveTime);
+    this->endpointStats[pSource->endpointIndex].messages++;
+
+    /* several frames sent together, the batch header is kept until their headers have been parsed */
+    if (zmqIsBatchHeader((const char *) zmq_msg_data(&message), msg_len))
+    {
+        status = this->receiveBatch(pReceiver, socket, (const char *) zmq_msg_data(&message), msg_len,
+                                    receiveTime, images);
+        zmq_msg_close(&message);
+        this->endpointStats[pSource->endpointIndex].frames += (int) images.size();
+        return status;
+    }
+
+    /* parse the header in place */
+    info = parseHeader((const char *) zmq_msg_data(&message), msg_len, attributeList,
+                       this->headerCache ? &pReceiver->headerCache : NULL);
+    clock.stop(this->stageTimes[ZMQStageParse]);
+
+    /* we are done with the header message */
+    zmq_msg_close(&message);
+
+    this->lock();
+    getIntegerParam(zmqReceiveModeParam, &receiveMode);
+    getIntegerParam(zmqDecompressParam, &decompress);
+    if (info.valid)
+        this->lastChunkInfo = info;
+    this->unlock();
+
+    /* frames to skip are known from their header, their data part is dropped as it is */
+    if (info.valid && !this->acceptFrame(pReceiver, info, attributeList))
+    {
+        this->framesSkipped++;
+        skipParts(socket);
+        return asynSuccess;
+    }
+    if (info.valid && !pReceiver->idle)
+        this->framesAccepted++;
+
+    /* receive data */
+    if (info.valid && info.codec != ZMQCodecNone)
+        status = this->receiveCompressed(socket, info, &pImage);
+    else if (info.valid && info.ndCodec[0])
+        status = this->receiveEncoded(socket, info, decompress != 0, &pImage);
+    else if (receiveMode == ZMQReceivePreallocate && info.valid)
+        status = this->receivePreallocated(socket, info, &pImage);
+    else
+        status = this->receiveMessage(socket, info, receiveMode, &pImage);
+    if (status != asynSuccess || pImage == NULL)
+    {
+        this->countDropped(pReceiver);
+        return status;
+    }
+
+    this->completeFrame(pReceiver, info, attributeList, receiveTime, pImage);
+    images.push_back(pImage);
+    this->endpointStats[pSource->endpointIndex].frames++;
+    return asynSuccess;
+}
+
+static void ZMQTaskC(void *drvPvt)
+{
+    ZMQDriver *pPvt = (ZMQDriver *) drvPvt;
+
+    pPvt->ZMQTask();
+}
+
+static void ZMQReceiveTaskC(void *drvPvt)
+{
+    ZMQReceiver *pReceiver = (ZMQReceiver *) drvPvt;
+
+    pReceiver->pDriver->ZMQReceiveTask(pReceiver);
+}
+
+static void ZMQDispatchTaskC(void *drvPvt)
+{
+    ZMQDriver *pPvt = (ZMQDriver *) drvPvt;
+
+    pPvt->ZMQDispatchTask();
+}
+
+void ZMQDriver::stopAcquisition()
+{
+    this->interruptReceivers();
+}
+
+/* send a command to every receive thread, whatever it is doing */
+void ZMQDriver::commandReceivers(char command)
+{
+    epicsMutexLock(this->stopLock);
+    for (size_t i = 0; i < this->receivers.size(); i++)
+    {
+        if (this->receivers[i]->controlPeer)
+            zmq_send(this->receivers[i]->controlPeer, &command, 1, ZMQ_DONTWAIT);
+    }
+    epicsMutexUnlock(this->stopLock);
+}
 
-    memcpy(pImage->pData, zmq_msg_data(&message), msg_len);
-    zmq_msg_close(&message);
+/* tell the receive threads waiting for an acquisition that the idle settings have changed. Those in their
+ * receive loop read the settings again when they leave it, and a command would only end their acquisition */
+void ZMQDriver::updateIdleReceivers()
+{
+    char command = ZMQ_CONTROL_IDLE;
 
-    /* image unique id comes from the server */
-    pImage->uniqueId = info.frame;
-    pImage->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
-    attributeList.copy(pImage->pAttributeList);
+    epicsMutexLock(this->stopLock);
+    for (size_t i = 0; i < this->receivers.size(); i++)
+    {
+        if (!this->receivers[i]->running && this->receivers[i]->controlPeer)
+            zmq_send(this->receivers[i]->controlPeer, &command, 1, ZMQ_DONTWAIT);
+    }
+    epicsMutexUnlock(this->stopLock);
+}
 
-    setIntegerParam(ADSizeX, ncols);
-    setIntegerParam(NDArraySizeX, ncols);
-    setIntegerParam(ADSizeY, nrows);
-    setIntegerParam(NDArraySizeY, nrows);
-    setIntegerParam(NDArraySize, (int) arrayInfo.totalBytes);
-    setIntegerParam(NDDataType, info.dataType);
-    setIntegerParam(NDColorMode, colorMode);
-    this->unlock();
+/* tell every receive thread that is still in its receive loop to leave it. A command that is still
+ * waiting is as good as a new one, so this never blocks */
+void ZMQDriver::interruptReceivers()
+{
+    char command = ZMQ_CONTROL_STOP;
 
-    return asynSuccess;
+    epicsMutexLock(this->stopLock);
+    for (size_t i = 0; i < this->receivers.size(); i++)
+    {
+        if (this->receivers[i]->running && this->receivers[i]->controlPeer)
+            zmq_send(this->receivers[i]->controlPeer, &command, 1, ZMQ_DONTWAIT);
+    }
+    epicsMutexUnlock(this->stopLock);
 }
 
-static void ZMQTaskC(void *drvPvt)
+/* fill the pool with buffers of the last seen shape so that the first frames do not wait for malloc */
+void ZMQDriver::warmPool()
 {
-    ZMQDriver *pPvt = (ZMQDriver *) drvPvt;
+    int warmBuffers, numAllocated;
+    const char *functionName = "warmPool";
 
-    pPvt->ZMQTask();
+    getIntegerParam(zmqPoolWarmBuffersParam, &warmBuffers);
+    if (warmBuffers <= 0 || !this->lastChunkInfo.valid)
+        return;
+
+    numAllocated = this->pZMQArrayPool->preallocate(this->lastChunkInfo.ndims, this->lastChunkInfo.dims,
+                                                    this->lastChunkInfo.dataType, warmBuffers);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+              "%s:%s: %d of %d buffers ready\n",
+              driverName, functionName, numAllocated, warmBuffers);
 }
 
-void ZMQDriver::stopAcquisition()
+/* start all receive threads for a new acquisition and wait until their sockets are attached,
+ * called with the lock held */
+void ZMQDriver::startReceivers()
 {
-    zmq_send(this->stopSocket, "STOP", 4, 0);
+    int imageMode, numImages;
+    double timeout, maxRate;
+    const char *functionName = "startReceivers";
+
+    getIntegerParam(ADImageMode, &imageMode);
+    getIntegerParam(ADNumImages, &numImages);
+    getIntegerParam(zmqRingSizeParam, &this->ringSize);
+    getIntegerParam(zmqHeaderCacheParam, &this->headerCache);
+    getIntegerParam(zmqConflateParam, &this->conflate);
+    getIntegerParam(zmqDecimationParam, &this->decimation);
+    getDoubleParam(zmqMaxRateParam, &maxRate);
+    this->minIntervalNs = maxRate > 0 ? (uint64_t) (1e9 / maxRate) : 0;
+    getIntegerParam(zmqReorderWindowParam, &this->reorderWindow);
+    getDoubleParam(zmqReorderTimeoutParam, &timeout);
+    /* the reorder stage follows a single sequence of frame numbers, but senders on several endpoints
+     * each number their own frames, so every number arrives once per endpoint */
+    if (this->reorderWindow > 0 && this->endpoints.size() > 1)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+                  "%s:%s: frames from %d endpoints are passed on in arrival order\n",
+                  driverName, functionName, (int) this->endpoints.size());
+        this->reorderWindow = 0;
+    }
+    /* frames skipped from their header or superseded never arrive, and would be waited for */
+    if (this->reorderWindow > 0 && (this->decimation > 1 || this->minIntervalNs > 0 || this->conflate))
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: frames are passed on in arrival order with Decimation, MaxRate or Conflate\n",
+                  driverName, functionName);
+        this->reorderWindow = 0;
+    }
+    if (imageMode == ADImageSingle)
+        this->frameLimit = 1;
+    else if (imageMode == ADImageMultiple)
+        this->frameLimit = numImages;
+    else
+        this->frameLimit = 0;
+    this->reorderTimeout = timeout;
+    this->nextFrameValid = false;
+    this->consecutiveRejects = 0;
+    this->lateFrames = 0;
+    this->outOfWindowFrames = 0;
+    this->framesReceived = 0;
+    this->overloadDropped = 0;
+    this->overloadDroppedQueued = 0;
+    this->attributeBaseMissing = 0;
+    this->conflated = 0;
+    this->decimationCount = 0;
+    this->nextAcceptNs = 0;
+    this->framesAccepted = 0;
+    this->framesSkipped = 0;
+    this->compressedBytes = 0;
+    this->uncompressedBytes = 0;
+    this->decompressNs = 0;
+    this->activeReceivers = (int) this->receivers.size();
+    for (size_t i = 0; i < this->endpointStats.size(); i++)
+    {
+        this->endpointStats[i].messages = 0;
+        this->endpointStats[i].frames = 0;
+        this->endpointStats[i].dropped = 0;
+        this->endpointStats[i].lastFrames = 0;
+    }
+    this->publishEndpoints(true);
+    setIntegerParam(zmqLateFramesParam, 0);
+    setIntegerParam(zmqOutOfWindowFramesParam, 0);
+    setIntegerParam(zmqHeaderCacheHitsParam, 0);
+    setIntegerParam(zmqHeaderCacheMissesParam, 0);
+    setIntegerParam(zmqOverloadDroppedParam, 0);
+    setIntegerParam(zmqOverloadDroppedQueuedParam, 0);
+    setIntegerParam(zmqAttributeBaseMissingParam, 0);
+    setIntegerParam(zmqConflatedParam, 0);
+    setIntegerParam(zmqFramesAcceptedParam, 0);
+    setIntegerParam(zmqFramesSkippedParam, 0);
+    setDoubleParam(zmqCompressionRatioParam, 0);
+    setDoubleParam(zmqDecompressRateParam, 0);
+    setIntegerParam(zmqIdleDiscardedParam, this->idleDiscarded);
+    setIntegerParam(zmqPreTriggerHeldParam, this->preTriggerHeld);
+    /* every receiver is idle here, so anything still signalled is left over from the last acquisition */
+    epicsEventTryWait(this->receiverDoneEventId);
+
+    /* the header caches are reset by their threads, which may be receiving pre-trigger frames */
+    for (size_t i = 0; i < this->receivers.size(); i++)
+    {
+        this->receivers[i]->ring.resetStatistics();
+        this->receivers[i]->running = true;
+    }
+    this->commandReceivers(ZMQ_CONTROL_START);
+    this->unlock();
+    for (size_t i = 0; i < this->receivers.size(); i++)
+        epicsEventWait(this->receivers[i]->readyEventId);
+    this->lock();
 }
 
 void ZMQDriver::startReceive(const char *receiveFunction)
@@ -300,22 +1316,31 @@ void ZMQDriver::startReceive(const char *receiveFunction)
     epicsEventWait(this->startEventId);
     this->lock();
     setIntegerParam(ADNumImagesCounter, 0);
-    if (this->socketType == ZMQ_SUB)
-        zmq_connect(this->socket, this->serverHost.c_str());
-    else if (this->socketType == ZMQ_PULL)
-        zmq_bind(this->socket, this->serverHost.c_str());
+    this->warmPool();
+    this->startReceivers();
+}
+
+/* wait until the dispatch thread has passed on every received frame */
+void ZMQDriver::waitForDispatch()
+{
+    bool pending = true;
+
+    while (pending)
+    {
+        this->flushRequested = true;
+        epicsEventSignal(this->frameEventId);
+        epicsEventWaitWithTimeout(this->dispatchIdleEventId, 0.1);
+        pending = this->reorderPendingCount > 0 || this->flushRequested;
+        for (size_t i = 0; i < this->receivers.size(); i++)
+            pending = pending || this->receivers[i]->ring.depth() > 0;
+    }
 }
 
+/* Acquisition thread: starts the receive threads and waits for the acquisition to finish */
 void ZMQDriver::ZMQTask()
 {
 
-    asynStatus dataStatus;
-    int numImages, numImagesCounter;
-    int imageMode;
-    int arrayCallbacks;
     int acquire;
-    NDArray *pImage;
-    epicsTimeStamp startTime;
     const char *functionName = "ZMQTask";
 
     this->lock();
@@ -332,73 +1357,447 @@ void ZMQDriver::ZMQTask()
         }
 
         /* We are acquiring. */
-        /* Get the current time */
-        epicsTimeGetCurrent(&startTime);
-
         setIntegerParam(ADStatus, ADStatusAcquire);
 
         /* Call the callbacks to update any changes */
         callParamCallbacks();
 
-        /* Read the image */
+        /* Acquisition is done once any receive thread stops: it has been stopped, has failed,
+         * or the requested number of images has been received. Then stop the other threads too. */
         this->unlock();
-        dataStatus = this->readData();
+        while (this->activeReceivers == (int) this->receivers.size())
+            epicsEventWait(this->receiverDoneEventId);
+        this->interruptReceivers();
+        while (this->activeReceivers > 0)
+            epicsEventWaitWithTimeout(this->receiverDoneEventId, 0.1);
+
+        /* let the dispatch thread catch up so the counters are final when Acquire goes to 0 */
+        this->waitForDispatch();
         this->lock();
 
+        setIntegerParam(ADAcquire, 0);
+        this->stageTimes.publish(this);
+        this->publishOverload();
+        setIntegerParam(zmqIdleDiscardedParam, this->idleDiscarded);
+        setIntegerParam(zmqPreTriggerHeldParam, this->preTriggerHeld);
+        setIntegerParam(zmqConflatedParam, this->conflated);
+        setIntegerParam(zmqFramesAcceptedParam, this->framesAccepted);
+        setIntegerParam(zmqFramesSkippedParam, this->framesSkipped);
+        this->publishEndpoints(true);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: acquisition completed\n", driverName, functionName);
+
         /* Call the callbacks to update any changes */
         callParamCallbacks();
+    }
+}
 
-        if (dataStatus == asynSuccess)
-        {
-            pImage = this->pArrays[0];
+/* count a frame towards the images asked for and hand it over to the dispatch thread, true once the
+ * frame limit is reached. With wait a full ring is waited on, otherwise the frame is dropped. */
+bool ZMQDriver::queueFrame(ZMQReceiver *pReceiver, NDArray *pImage, bool wait)
+{
+    int received;
+    size_t limit;
+    const char *functionName = "queueFrame";
+
+    /* with several threads or batches the last few frames can arrive together,
+     * only keep the ones asked for */
+    received = ++this->framesReceived;
+    if (this->frameLimit > 0 && received > this->frameLimit)
+    {
+        pImage->release();
+        return true;
+    }
+
+    /* the dispatch thread frees a slot as soon as it gets to the ring */
+    limit = std::min((size_t) this->ringSize, pReceiver->ring.capacity());
+    while (wait && !this->exiting && pReceiver->ring.depth() >= limit)
+    {
+        epicsEventSignal(this->frameEventId);
+        epicsThreadSleep(ZMQ_OVERLOAD_POLL);
+    }
+
+    /* Hand the image over to the dispatch thread */
+    if (pReceiver->ring.push(pImage, this->ringSize, pImage->uniqueId))
+        epicsEventSignal(this->frameEventId);
+    else
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+                  "%s:%s: frame ring %d full, dropping frame %d\n",
+                  driverName, functionName, pReceiver->index, pImage->uniqueId);
+        pImage->release();
+        this->countDropped(pReceiver);
+    }
+
+    return this->frameLimit > 0 && received >= this->frameLimit;
+}
 
-            /* Get the current parameters */
-            getIntegerParam(ADNumImages, &numImages);
-            getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-            getIntegerParam(ADImageMode, &imageMode);
-            getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-            numImagesCounter++;
-            setIntegerParam(NDArrayCounter, pImage->uniqueId);
-            setIntegerParam(ADNumImagesCounter, numImagesCounter);
+/* Receive thread: pulls frames off its socket and queues them for the dispatch thread */
+void ZMQDriver::ZMQReceiveTask(ZMQReceiver *pReceiver)
+{
+    asynStatus dataStatus;
+    bool done;
+    NDArray *pImage;
+    std::vector<NDArray *> images;
+    zmq_msg_t message;
 
-            /* Put the frame number and time stamp into the buffer */
-            pImage->timeStamp = startTime.secPastEpoch + startTime.nsec / 1.e9;
+    /* Loop until the driver is destroyed */
+    while (this->waitForStart(pReceiver))
+    {
+        /* a socket attached only for acquisitions may still hold messages from the last one,
+         * a persistent socket has been drained while idle and is live already */
+        if (!pReceiver->attached)
+        {
+            zmq_msg_init(&message);
+            for (size_t i = 0; i < pReceiver->sources.size(); i++)
+                while (zmq_msg_recv(&message, pReceiver->sources[i].socket, ZMQ_DONTWAIT) >= 0)
+                    ;
+            zmq_msg_close(&message);
+            this->attachReceiver(pReceiver);
+        }
+        pReceiver->headerCache.clear();
+        pReceiver->headerCache.resetStatistics();
+        epicsEventSignal(pReceiver->readyEventId);
+
+        /* pass the frames kept from before the start on first, in order and without copying them */
+        done = false;
+        pReceiver->pSource = NULL;
+        if (!pReceiver->preTrigger.empty())
+        {
+            while (!pReceiver->preTrigger.empty())
+            {
+                pImage = pReceiver->preTrigger.front();
+                pReceiver->preTrigger.pop_front();
+                pReceiver->preTriggerBytes -= pImage->dataSize;
+                this->preTriggerHeld--;
+                if (done)
+                    pImage->release();
+                else
+                    done = this->queueFrame(pReceiver, pImage, true);
+            }
+            this->publishPreTrigger();
+        }
 
-            /* Get any attributes that have been defined for this driver */
-            this->getAttributes(pImage->pAttributeList);
+        while (!done)
+        {
+            /* Read the images of a message, none if the overload policy dropped them */
+            dataStatus = this->readData(pReceiver, images);
+            if (dataStatus != asynSuccess)
+                break;
 
-            if (arrayCallbacks)
+            for (size_t i = 0; i < images.size(); i++)
             {
-                /* Call the NDArray callback */
-                /* Must release the lock here, or we can get into a deadlock, because we can
-                 * block on the plugin lock, and the plugin can be calling us */
-                this->unlock();
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                          "%s:%s: calling imageData callback\n", driverName, functionName);
-                doCallbacksGenericPointer(pImage, NDArrayData, 0);
-                this->lock();
+                if (done)
+                    images[i]->release();
+                else
+                    done = this->queueFrame(pReceiver, images[i], false);
             }
         }
 
-        /* See if acquisition is done */
-        if ((dataStatus != asynSuccess) ||
-            (imageMode == ADImageSingle) ||
-            ((imageMode == ADImageMultiple) &&
-             (numImagesCounter >= numImages)))
+        if (!this->keepAttached())
+            this->detachReceiver(pReceiver);
+
+        epicsMutexLock(this->stopLock);
+        pReceiver->running = false;
+        epicsMutexUnlock(this->stopLock);
+        this->activeReceivers--;
+        epicsEventSignal(this->receiverDoneEventId);
+    }
+
+    /* the pool outlives the receive threads */
+    while (!pReceiver->preTrigger.empty())
+    {
+        pReceiver->preTrigger.front()->release();
+        pReceiver->preTrigger.pop_front();
+    }
+    epicsEventSignal(pReceiver->doneEventId);
+}
+
+/* pass a frame on to the plugins */
+void ZMQDriver::dispatchFrame(NDArray *pImage)
+{
+    this->lock();
+    this->publishArray(pImage, "ZMQDispatchTask");
+    callParamCallbacks();
+    this->unlock();
+}
+
+/* queue a frame in the reorder stage, releasing whatever is then in order */
+void ZMQDriver::reorderFrame(NDArray *pImage)
+{
+    ZMQPendingFrame pending;
+    int frame = pImage->uniqueId;
+    const char *functionName = "reorderFrame";
+
+    if (this->nextFrameValid && frame < this->nextFrame)
+    {
+        /* already released frames after this one */
+        this->lateFrames++;
+        this->consecutiveRejects++;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+                  "%s:%s: dropping late frame %d, expected %d\n",
+                  driverName, functionName, frame, this->nextFrame);
+        pImage->release();
+        /* the sender has most likely restarted its numbering, start again from whatever comes next */
+        if (this->consecutiveRejects >= this->reorderWindow)
+            this->flushReorder();
+        return;
+    }
+    if (this->reorderPending.count(frame))
+    {
+        this->lateFrames++;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+                  "%s:%s: dropping duplicate frame %d\n",
+                  driverName, functionName, frame);
+        pImage->release();
+        return;
+    }
+    this->consecutiveRejects = 0;
+
+    if (this->nextFrameValid && frame >= this->nextFrame + this->reorderWindow)
+    {
+        /* the missing frames are not going to fit in the window, give up on them */
+        this->outOfWindowFrames++;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_WARNING,
+                  "%s:%s: frame %d is outside the window, skipping to frame %d\n",
+                  driverName, functionName, frame, frame - this->reorderWindow + 1);
+        this->nextFrame = frame - this->reorderWindow + 1;
+        while (!this->reorderPending.empty() && this->reorderPending.begin()->first < this->nextFrame)
         {
-            if (this->socketType == ZMQ_SUB)
-                zmq_disconnect(this->socket, this->serverHost.c_str());
-            else if (this->socketType == ZMQ_PULL)
-                zmq_unbind(this->socket, this->serverHost.c_str());
-            setIntegerParam(ADAcquire, 0);
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                      "%s:%s: acquisition completed\n", driverName, functionName);
+            NDArray *pReleased = this->reorderPending.begin()->second.pImage;
+            this->reorderPending.erase(this->reorderPending.begin());
+            this->dispatchFrame(pReleased);
         }
+    }
 
-        /* Call the callbacks to update any changes */
-        callParamCallbacks();
-        getIntegerParam(ADAcquire, &acquire);
+    pending.pImage = pImage;
+    epicsTimeGetCurrent(&pending.arrival);
+    this->reorderPending[frame] = pending;
+
+    /* at the start we do not know which frame comes first, wait for a full window */
+    if (!this->nextFrameValid && (int) this->reorderPending.size() >= this->reorderWindow)
+    {
+        this->nextFrame = this->reorderPending.begin()->first;
+        this->nextFrameValid = true;
+    }
+    this->releaseInOrder();
+}
+
+/* dispatch the frames held by the reorder stage that are next in sequence */
+void ZMQDriver::releaseInOrder()
+{
+    while (this->nextFrameValid && !this->reorderPending.empty() &&
+           this->reorderPending.begin()->first == this->nextFrame)
+    {
+        NDArray *pImage = this->reorderPending.begin()->second.pImage;
+        this->reorderPending.erase(this->reorderPending.begin());
+        this->nextFrame++;
+        this->dispatchFrame(pImage);
+    }
+    this->reorderPendingCount = (int) this->reorderPending.size();
+}
+
+/* stop waiting for missing frames once the next frame to go has been held for longer than the timeout */
+void ZMQDriver::checkReorderTimeout()
+{
+    epicsTimeStamp now;
+
+    if (this->reorderPending.empty())
+        return;
+
+    epicsTimeGetCurrent(&now);
+    if (epicsTimeDiffInSeconds(&now, &this->reorderPending.begin()->second.arrival) < this->reorderTimeout)
+        return;
+
+    this->nextFrame = this->reorderPending.begin()->first;
+    this->nextFrameValid = true;
+    this->releaseInOrder();
+}
+
+/* release everything held by the reorder stage in order and start a new sequence */
+void ZMQDriver::flushReorder()
+{
+    while (!this->reorderPending.empty())
+    {
+        NDArray *pImage = this->reorderPending.begin()->second.pImage;
+        this->reorderPending.erase(this->reorderPending.begin());
+        this->dispatchFrame(pImage);
     }
+    this->reorderPendingCount = 0;
+    this->nextFrameValid = false;
+    this->consecutiveRejects = 0;
+}
+
+/* Dispatch thread: takes frames from the receive threads, puts them in order and passes them to the plugins */
+void ZMQDriver::ZMQDispatchTask()
+{
+    NDArray *pImage;
+    bool gotFrame;
+
+    /* Loop forever */
+    while (1)
+    {
+        /* take one frame from each receiver in turn */
+        gotFrame = false;
+        for (size_t i = 0; i < this->receivers.size(); i++)
+        {
+            pImage = this->receivers[i]->ring.pop();
+            if (!pImage)
+                continue;
+            gotFrame = true;
+            if (this->reorderWindow > 0)
+                this->reorderFrame(pImage);
+            else
+                this->dispatchFrame(pImage);
+        }
+        if (gotFrame)
+            continue;
+
+        if (this->flushRequested)
+        {
+            this->flushReorder();
+            this->flushRequested = false;
+        }
+        else
+            this->checkReorderTimeout();
+
+        if (this->reorderPending.empty())
+        {
+            epicsEventSignal(this->dispatchIdleEventId);
+            epicsEventWait(this->frameEventId);
+        }
+        else
+            epicsEventWaitWithTimeout(this->frameEventId, this->reorderTimeout);
+    }
+}
+
+/* update the overload counters and the pool pressure, called with the lock held */
+void ZMQDriver::publishOverload()
+{
+    setIntegerParam(zmqOverloadDroppedParam, this->overloadDropped);
+    setIntegerParam(zmqOverloadDroppedQueuedParam, this->overloadDroppedQueued);
+    setDoubleParam(zmqPoolPressureParam, this->pZMQArrayPool->pressure());
+}
+
+/* update the parameters for a received image and pass it to the plugins, called with the lock held */
+void ZMQDriver::publishArray(NDArray *pImage, const char *functionName)
+{
+    int numImagesCounter;
+    int arrayCallbacks;
+    int nrows, ncols;
+    size_t ringDepth = 0, ringHighWater = 0;
+    unsigned long ringOverflows = 0;
+    int headerCacheHits = 0, headerCacheMisses = 0;
+    NDColorMode_t colorMode = NDColorModeMono;
+    NDAttribute *pAttr;
+    NDArrayInfo_t arrayInfo;
+    ZMQStageClock clock;
+
+    pImage->getInfo(&arrayInfo);
+    ncols = pImage->dims[0].size;
+    nrows = pImage->ndims < 2 ? 1 : pImage->dims[1].size;
+    pAttr = pImage->pAttributeList->find("ColorMode");
+    if (pAttr)
+        pAttr->getValue(NDAttrInt32, &colorMode);
+
+    /* We always keep the last array so read() can use it. */
+    if (this->pArrays[0]) this->pArrays[0]->release();
+    this->pArrays[0] = pImage;
+
+    /* Get the current parameters */
+    getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    numImagesCounter++;
+    setIntegerParam(NDArrayCounter, pImage->uniqueId);
+    setIntegerParam(ADNumImagesCounter, numImagesCounter);
+
+    setIntegerParam(ADSizeX, ncols);
+    setIntegerParam(NDArraySizeX, ncols);
+    setIntegerParam(ADSizeY, nrows);
+    setIntegerParam(NDArraySizeY, nrows);
+    setIntegerParam(NDArraySize, (int) arrayInfo.totalBytes);
+    setIntegerParam(NDDataType, pImage->dataType);
+    setIntegerParam(NDColorMode, colorMode);
+
+    for (size_t i = 0; i < this->receivers.size(); i++)
+    {
+        ringDepth += this->receivers[i]->ring.depth();
+        if (this->receivers[i]->ring.highWater() > ringHighWater)
+            ringHighWater = this->receivers[i]->ring.highWater();
+        ringOverflows += this->receivers[i]->ring.overflows();
+        headerCacheHits += this->receivers[i]->headerCache.hits;
+        headerCacheMisses += this->receivers[i]->headerCache.misses;
+    }
+    setIntegerParam(zmqRingDepthParam, (int) ringDepth);
+    setIntegerParam(zmqRingHighWaterParam, (int) ringHighWater);
+    setIntegerParam(zmqRingOverflowsParam, (int) ringOverflows);
+    setIntegerParam(zmqReorderPendingParam, (int) this->reorderPending.size());
+    setIntegerParam(zmqLateFramesParam, this->lateFrames);
+    setIntegerParam(zmqOutOfWindowFramesParam, this->outOfWindowFrames);
+    setIntegerParam(zmqHeaderCacheHitsParam, headerCacheHits);
+    setIntegerParam(zmqHeaderCacheMissesParam, headerCacheMisses);
+    setIntegerParam(zmqAttributeBaseMissingParam, this->attributeBaseMissing);
+    setIntegerParam(zmqConflatedParam, this->conflated);
+    setIntegerParam(zmqFramesAcceptedParam, this->framesAccepted);
+    setIntegerParam(zmqFramesSkippedParam, this->framesSkipped);
+    if (this->compressedBytes > 0)
+        setDoubleParam(zmqCompressionRatioParam, (double) this->uncompressedBytes / this->compressedBytes);
+    if (this->decompressNs > 0)
+        setDoubleParam(zmqDecompressRateParam, this->uncompressedBytes * 1e9 / this->decompressNs);
+    this->publishOverload();
+
+    /* Get any attributes that have been defined for this driver */
+    this->getAttributes(pImage->pAttributeList);
+    clock.stop(this->stageTimes[ZMQStageParams]);
+
+    if (arrayCallbacks)
+    {
+        /* Call the NDArray callback */
+        /* Must release the lock here, or we can get into a deadlock, because we can
+         * block on the plugin lock, and the plugin can be calling us */
+        this->unlock();
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: calling imageData callback\n", driverName, functionName);
+        doCallbacksGenericPointer(pImage, NDArrayData, 0);
+        this->lock();
+        clock.stop(this->stageTimes[ZMQStageCallbacks]);
+    }
+
+    pAttr = pImage->pAttributeList->find(ZMQ_SEND_TIME_ATTRIBUTE);
+    if (pAttr)
+    {
+        epicsTimeStamp now;
+        double sendTime;
+        epicsTimeGetCurrent(&now);
+        pAttr->getValue(NDAttrFloat64, &sendTime);
+        this->stageTimes.latency(ZMQLatencyCallbacks).record(now.secPastEpoch + now.nsec / 1.e9 - sendTime);
+    }
+    this->stageTimes.publishIfDue(this);
+    this->publishEndpoints(false);
+}
+
+/* update the counters of each endpoint on its asyn address, once a second unless forced.
+ * Called with the lock held */
+void ZMQDriver::publishEndpoints(bool force)
+{
+    uint64_t now = zmqMonotonicNs();
+    double seconds = (now - this->endpointsPublishedNs) / 1e9;
+    int frames;
+
+    if (!force && seconds < 1.0)
+        return;
+    for (size_t i = 0; i < this->endpointStats.size(); i++)
+    {
+        ZMQEndpointStats &stats = this->endpointStats[i];
+        frames = stats.frames;
+        setIntegerParam((int) i, zmqEndpointMessagesParam, stats.messages);
+        setIntegerParam((int) i, zmqEndpointFramesParam, frames);
+        setIntegerParam((int) i, zmqEndpointDroppedParam, stats.dropped);
+        setDoubleParam((int) i, zmqEndpointRateParam, seconds > 0 ? (frames - stats.lastFrames) / seconds : 0);
+        stats.lastFrames = frames;
+        callParamCallbacks((int) i);
+    }
+    this->endpointsPublishedNs = now;
 }
 
 /* Disconnects the ZMQ connection */
@@ -410,33 +1809,44 @@ static void shutdown(void *arg)
 
 ZMQDriver::~ZMQDriver()
 {
-    if (this->socketType == ZMQ_SUB)
+    bool exited = true;
+
+    /* stop the receive threads, whether they are receiving or waiting for an acquisition,
+     * and wait for them to exit before their sockets are closed */
+    this->exiting = true;
+    this->commandReceivers(ZMQ_CONTROL_STOP);
+    for (size_t i = 0; i < this->receivers.size(); i++)
     {
-        /* stop if socket is blocked in receiving */
-        zmq_send(stopSocket, "STOP", 4, 0);
-        epicsThreadSleep(1);
-        /* disconnect from host */
-        zmq_disconnect(socket, this->serverHost.c_str());
-        zmq_disconnect(socket, this->stopHost);
-        zmq_close(socket);
-        /* close stop socket server */
-        zmq_unbind(stopSocket, this->stopHost);
-        zmq_close(stopSocket);
+        ZMQReceiver *pReceiver = this->receivers[i];
+        if (pReceiver->threadId && epicsEventWaitWithTimeout(pReceiver->doneEventId, ZMQ_EXIT_TIMEOUT) != epicsEventWaitOK)
+        {
+            fprintf(stderr, "%s: receive thread %d did not exit\n", driverName, (int) i);
+            exited = false;
+            continue;
+        }
+        epicsMutexLock(this->stopLock);
+        for (size_t j = 0; j < pReceiver->sources.size(); j++)
+            zmq_close(pReceiver->sources[j].socket);
+        zmq_close(pReceiver->controlSocket);
+        zmq_close(pReceiver->controlPeer);
+        zmq_close(pReceiver->relaySocket);
+        zmq_close(pReceiver->relayPeer);
+        pReceiver->controlPeer = NULL;
+        epicsMutexUnlock(this->stopLock);
     }
-    else if (this->socketType == ZMQ_PULL)
+
+    /* the context waits for every socket to be closed */
+    if (exited)
+        zmq_ctx_destroy(context);
+
+    /* arrays still held downstream would be released into a deleted pool, so leave it to leak then */
+    if (!exited || this->pZMQArrayPool->inUse())
     {
-        /* stop if socket is blocked in receiving */
-        zmq_send(stopSocket, "STOP", 4, 0);
-        epicsThreadSleep(1);
-        /* disconnect stop socket */
-        zmq_disconnect(stopSocket, this->stopHost);
-        zmq_close(stopSocket);
-        /* close socket */
-        zmq_unbind(socket, this->serverHost.c_str());
-        zmq_close(socket);
+        fprintf(stderr, "%s: arrays are still in use, not deleting the array pool\n", driverName);
+        return;
     }
-
-    zmq_ctx_destroy(context);
+    this->pNDArrayPool = this->pDefaultPool;
+    delete this->pZMQArrayPool;
 }
 
 
@@ -471,6 +1881,24 @@ asynStatus ZMQDriver::writeInt32(asynUser *pasynUser, epicsInt32 value)
             this->stopAcquisition();
         }
     }
+    else if (function == zmqPersistentParam || function == zmqPreTriggerFramesParam ||
+             function == zmqPreTriggerMemoryParam)
+    {
+        /* idle receive threads attach or detach their sockets and trim their pre-trigger frames at once */
+        if (function == zmqPersistentParam)
+            this->persistent = value != 0;
+        else if (function == zmqPreTriggerFramesParam)
+            this->preTriggerFrames = value;
+        else
+            this->preTriggerMemory = value;
+        this->updateIdleReceivers();
+    }
+    else if (function == this->stageTimes.resetParam)
+    {
+        this->stageTimes.reset();
+        this->stageTimes.publish(this);
+        callParamCallbacks();
+    }
     else
     {
         /* If this parameter belongs to a base class call its method */
@@ -500,27 +1928,62 @@ void ZMQDriver::report(FILE *fp, int details)
     fprintf(fp, "ZMQ Driver %s\n", this->portName);
     if (details > 0)
     {
-        int nx, ny, dataType;
+        int nx, ny, dataType, receiveMode;
         getIntegerParam(ADSizeX, &nx);
         getIntegerParam(ADSizeY, &ny);
         getIntegerParam(NDDataType, &dataType);
-        fprintf(fp, "  Server host:       %s\n", this->serverHost.c_str());
+        getIntegerParam(zmqReceiveModeParam, &receiveMode);
         fprintf(fp, "  Socket type:       %d\n", this->socketType);
-        if (this->socketType == ZMQ_SUB)
-            fprintf(fp, "  Stop host:         %s\n", this->stopHost);
+        fprintf(fp, "  Receive mode:      %d\n", receiveMode);
+        for (size_t i = 0; i < this->receivers.size(); i++)
+        {
+            ZMQReceiver *pReceiver = this->receivers[i];
+            fprintf(fp, "  Receiver %lu:\n", (unsigned long) i);
+            for (size_t j = 0; j < pReceiver->sources.size(); j++)
+                fprintf(fp, "    %s %s (address %d)\n", pReceiver->sources[j].endpoint.bind ? "Bind:   " : "Connect:",
+                        pReceiver->sources[j].endpoint.address.c_str(), pReceiver->sources[j].endpointIndex);
+            fprintf(fp, "    Control host:    %s\n", pReceiver->controlHost.c_str());
+            fprintf(fp, "    Attached:        %s\n", pReceiver->attached ? "yes" : "no");
+            fprintf(fp, "    Frame ring:      %lu/%lu queued, high water %lu, overflows %lu\n",
+                    (unsigned long) pReceiver->ring.depth(), (unsigned long) pReceiver->ring.capacity(),
+                    (unsigned long) pReceiver->ring.highWater(), pReceiver->ring.overflows());
+            fprintf(fp, "    Header cache:    %d hits, %d misses\n",
+                    (int) pReceiver->headerCache.hits, (int) pReceiver->headerCache.misses);
+        }
+        for (size_t i = 0; i < this->endpointStats.size(); i++)
+            fprintf(fp, "  Endpoint %lu:        %s, %d messages, %d frames, %d dropped\n", (unsigned long) i,
+                    this->endpoints[i].address.c_str(), (int) this->endpointStats[i].messages,
+                    (int) this->endpointStats[i].frames, (int) this->endpointStats[i].dropped);
+        fprintf(fp, "  Idle discarded:    %d\n", (int) this->idleDiscarded);
+        fprintf(fp, "  Pre-trigger held:  %d\n", (int) this->preTriggerHeld);
+        fprintf(fp, "  Reorder pending:   %d\n", (int) this->reorderPendingCount);
+        fprintf(fp, "  Overload:          %d dropped, %d queued dropped, pool pressure %.1f%%\n",
+                (int) this->overloadDropped, (int) this->overloadDroppedQueued, this->pZMQArrayPool->pressure());
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        if (details > 1)
+            this->stageTimes.report(fp);
     }
 
     /* Call the base class method */
     ADDriver::report(fp, details);
 }
 
+/* one asyn address per endpoint, for its counters */
+static int numEndpoints(const char *address, const char *transport)
+{
+    std::vector<ZMQEndpoint> endpoints;
+
+    zmqParseEndpoints(address, transport, false, endpoints);
+    return endpoints.empty() ? 1 : (int) endpoints.size();
+}
+
 /** Constructor for ZMQ driver; most parameters are simply passed to ADDriver::ADDriver.
   * After calling the base class constructor this method creates a thread to collect the detector data, 
   * and sets reasonable default values for the parameters defined in this class, asynNDArrayDriver and ADDriver.
   * \param[in] portName The name of the asyn port driver to be created.int
   * \param[in] address The address & port of the ZMQ server, and pattern to be used. address:port.
+  *            Several comma separated addresses may be given; prefix one with '@' to bind or '>' to connect.
   * \param[in] transport The protocol to be used for the connection [tcp/udp]
   * \param[in] zmqType The type of the ZeroMQ connection [PULL/SUB]
   * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is 
@@ -529,20 +1992,18 @@ void ZMQDriver::report(FILE *fp, int details)
   *            allowed to allocate. Set this to -1 to allow an unlimited amount of memory.
   * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
   * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+  * \param[in] numThreads The number of receive threads, each with its own sockets.
   */
 ZMQDriver::ZMQDriver(const char *portName, const char *address, const char *transport, const char *zmqType,
-                     int maxBuffers, size_t maxMemory, int priority, int stackSize)
-        : ADDriver(portName, 1, 0, maxBuffers, maxMemory,
-                   0, 0,               /* No interfaces beyond those set in ADDriver.cpp */
-                   ASYN_CANBLOCK, 1,   /* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=0, autoConnect=1 */
-                   priority, stackSize), context(0), socket(0)
+                     int maxBuffers, size_t maxMemory, int priority, int stackSize, int numThreads)
+        : ADDriver(portName, numEndpoints(address, transport), 0, maxBuffers, maxMemory,
+                   asynInt32ArrayMask, asynInt32ArrayMask, /* for the stage timing histograms */
+                   ASYN_CANBLOCK | ASYN_MULTIDEVICE, 1, /* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=1, autoConnect=1 */
+                   priority, stackSize), context(0),
+          stageTimes(ZMQNumStages, stageNames, ZMQNumLatencies, latencyNames)
 {
     int status = asynSuccess;
     static const char *functionName = "zmq";
-    char *cp;
-    char type[10] = "";
-
-    this->serverHost = std::string(transport) + std::string("://") + std::string(address);
 
     if (strcmp(zmqType, "SUB") == 0 || strcmp(zmqType, "PUB") == 0)
         this->socketType = ZMQ_SUB;
@@ -553,7 +2014,7 @@ ZMQDriver::ZMQDriver(const char *portName, const char *address, const char *tran
         /* If type is not specified, make a guess.
          * If "*" is found in host address, then it is assumed to be a PULL server type
          * */
-        if (strchr(this->serverHost.c_str(), '*') != NULL)
+        if (address && strchr(address, '*') != NULL)
         {
             this->socketType = ZMQ_PULL;
         }
@@ -564,12 +2025,163 @@ ZMQDriver::ZMQDriver(const char *portName, const char *address, const char *tran
     }
     else
     {
-        fprintf(stderr, "%s: Unsupported socket type %s\n", functionName, type);
+        fprintf(stderr, "%s: Unsupported socket type %s\n", functionName, zmqType);
+        return;
+    }
+
+    zmqParseEndpoints(address, transport, this->socketType == ZMQ_PULL, this->endpoints);
+    if (this->endpoints.empty())
+    {
+        fprintf(stderr, "%s: No address given\n", functionName);
         return;
     }
+    std::vector<ZMQEndpointStats>(this->endpoints.size()).swap(this->endpointStats);
+    this->endpointsPublishedNs = zmqMonotonicNs();
+
+    /* Only PULL sockets that connect can share an endpoint: a bound address can only be bound once
+     * and subscribers to the same publisher would all get the same frames */
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > (int) this->endpoints.size())
+    {
+        bool canShare = this->socketType == ZMQ_PULL;
+        for (size_t i = 0; i < this->endpoints.size(); i++)
+            canShare = canShare && !this->endpoints[i].bind;
+        if (!canShare)
+        {
+            fprintf(stderr, "%s: %d receive threads need %d endpoints, using %d threads\n",
+                    functionName, numThreads, numThreads, (int) this->endpoints.size());
+            numThreads = (int) this->endpoints.size();
+        }
+    }
+
+    /* Use a pool that can also wrap received messages for zero-copy mode */
+    this->pZMQArrayPool = new ZMQArrayPool(this, maxBuffers, maxMemory);
+    this->pDefaultPool = this->pNDArrayPool;
+    this->pNDArrayPool = this->pZMQArrayPool;
+
+    createParam(zmqReceiveModeParamString, asynParamInt32, &zmqReceiveModeParam);
+    createParam(zmqPoolWarmBuffersParamString, asynParamInt32, &zmqPoolWarmBuffersParam);
+    createParam(zmqRingSizeParamString, asynParamInt32, &zmqRingSizeParam);
+    createParam(zmqRingDepthParamString, asynParamInt32, &zmqRingDepthParam);
+    createParam(zmqRingHighWaterParamString, asynParamInt32, &zmqRingHighWaterParam);
+    createParam(zmqRingOverflowsParamString, asynParamInt32, &zmqRingOverflowsParam);
+    createParam(zmqNumReceiveThreadsParamString, asynParamInt32, &zmqNumReceiveThreadsParam);
+    createParam(zmqReorderWindowParamString, asynParamInt32, &zmqReorderWindowParam);
+    createParam(zmqReorderTimeoutParamString, asynParamFloat64, &zmqReorderTimeoutParam);
+    createParam(zmqReorderPendingParamString, asynParamInt32, &zmqReorderPendingParam);
+    createParam(zmqLateFramesParamString, asynParamInt32, &zmqLateFramesParam);
+    createParam(zmqOutOfWindowFramesParamString, asynParamInt32, &zmqOutOfWindowFramesParam);
+    createParam(zmqHeaderCacheParamString, asynParamInt32, &zmqHeaderCacheParam);
+    createParam(zmqHeaderCacheHitsParamString, asynParamInt32, &zmqHeaderCacheHitsParam);
+    createParam(zmqHeaderCacheMissesParamString, asynParamInt32, &zmqHeaderCacheMissesParam);
+    createParam(zmqOverloadPolicyParamString, asynParamInt32, &zmqOverloadPolicyParam);
+    createParam(zmqOverloadTimeoutParamString, asynParamFloat64, &zmqOverloadTimeoutParam);
+    createParam(zmqOverloadDroppedParamString, asynParamInt32, &zmqOverloadDroppedParam);
+    createParam(zmqOverloadDroppedQueuedParamString, asynParamInt32, &zmqOverloadDroppedQueuedParam);
+    createParam(zmqPoolPressureParamString, asynParamFloat64, &zmqPoolPressureParam);
+    createParam(zmqAttributeBaseMissingParamString, asynParamInt32, &zmqAttributeBaseMissingParam);
+    createParam(zmqCompressionRatioParamString, asynParamFloat64, &zmqCompressionRatioParam);
+    createParam(zmqDecompressRateParamString, asynParamFloat64, &zmqDecompressRateParam);
+    createParam(zmqDecompressParamString, asynParamInt32, &zmqDecompressParam);
+    createParam(zmqPersistentParamString, asynParamInt32, &zmqPersistentParam);
+    createParam(zmqIdleDiscardedParamString, asynParamInt32, &zmqIdleDiscardedParam);
+    createParam(zmqPreTriggerFramesParamString, asynParamInt32, &zmqPreTriggerFramesParam);
+    createParam(zmqPreTriggerMemoryParamString, asynParamInt32, &zmqPreTriggerMemoryParam);
+    createParam(zmqPreTriggerHeldParamString, asynParamInt32, &zmqPreTriggerHeldParam);
+    createParam(zmqConflateParamString, asynParamInt32, &zmqConflateParam);
+    createParam(zmqConflatedParamString, asynParamInt32, &zmqConflatedParam);
+    createParam(zmqDecimationParamString, asynParamInt32, &zmqDecimationParam);
+    createParam(zmqMaxRateParamString, asynParamFloat64, &zmqMaxRateParam);
+    createParam(zmqFramesAcceptedParamString, asynParamInt32, &zmqFramesAcceptedParam);
+    createParam(zmqFramesSkippedParamString, asynParamInt32, &zmqFramesSkippedParam);
+    createParam(zmqEndpointAddressParamString, asynParamOctet, &zmqEndpointAddressParam);
+    createParam(zmqEndpointMessagesParamString, asynParamInt32, &zmqEndpointMessagesParam);
+    createParam(zmqEndpointFramesParamString, asynParamInt32, &zmqEndpointFramesParam);
+    createParam(zmqEndpointDroppedParamString, asynParamInt32, &zmqEndpointDroppedParam);
+    createParam(zmqEndpointRateParamString, asynParamFloat64, &zmqEndpointRateParam);
+    this->stageTimes.createParams(this);
+    this->lastChunkInfo.valid = false;
+    this->frameLimit = 0;
+    this->ringSize = 16;
+    this->headerCache = 1;
+    this->conflate = 0;
+    this->decimation = 1;
+    this->minIntervalNs = 0;
+    this->reorderWindow = 0;
+    this->reorderTimeout = 0.1;
+    this->nextFrameValid = false;
+    this->nextFrame = 0;
+    this->consecutiveRejects = 0;
+    this->lateFrames = 0;
+    this->outOfWindowFrames = 0;
+    this->activeReceivers = 0;
+    this->framesReceived = 0;
+    this->overloadDropped = 0;
+    this->overloadDroppedQueued = 0;
+    this->attributeBaseMissing = 0;
+    this->conflated = 0;
+    this->decimationCount = 0;
+    this->nextAcceptNs = 0;
+    this->framesAccepted = 0;
+    this->framesSkipped = 0;
+    this->compressedBytes = 0;
+    this->uncompressedBytes = 0;
+    this->decompressNs = 0;
+    this->persistent = false;
+    this->idleDiscarded = 0;
+    this->preTriggerFrames = 0;
+    this->preTriggerMemory = 0;
+    this->preTriggerHeld = 0;
+    this->flushRequested = false;
+    this->reorderPendingCount = 0;
 
     /* Set some default values for parameters */
     status = setStringParam(ADManufacturer, "ZMQ Driver");
+    status |= setIntegerParam(zmqReceiveModeParam, ZMQReceiveCopy);
+    status |= setIntegerParam(zmqPoolWarmBuffersParam, 0);
+    status |= setIntegerParam(zmqRingSizeParam, 16);
+    status |= setIntegerParam(zmqRingDepthParam, 0);
+    status |= setIntegerParam(zmqRingHighWaterParam, 0);
+    status |= setIntegerParam(zmqRingOverflowsParam, 0);
+    status |= setIntegerParam(zmqNumReceiveThreadsParam, numThreads);
+    /* one thread delivers in order anyway */
+    status |= setIntegerParam(zmqReorderWindowParam, numThreads > 1 ? 16 * numThreads : 0);
+    status |= setDoubleParam(zmqReorderTimeoutParam, 0.1);
+    status |= setIntegerParam(zmqReorderPendingParam, 0);
+    status |= setIntegerParam(zmqLateFramesParam, 0);
+    status |= setIntegerParam(zmqOutOfWindowFramesParam, 0);
+    status |= setIntegerParam(zmqHeaderCacheParam, 1);
+    status |= setIntegerParam(zmqHeaderCacheHitsParam, 0);
+    status |= setIntegerParam(zmqHeaderCacheMissesParam, 0);
+    status |= setIntegerParam(zmqOverloadPolicyParam, ZMQOverloadDropNewest);
+    status |= setDoubleParam(zmqOverloadTimeoutParam, 1.0);
+    status |= setIntegerParam(zmqOverloadDroppedParam, 0);
+    status |= setIntegerParam(zmqOverloadDroppedQueuedParam, 0);
+    status |= setDoubleParam(zmqPoolPressureParam, 0);
+    status |= setIntegerParam(zmqAttributeBaseMissingParam, 0);
+    status |= setDoubleParam(zmqCompressionRatioParam, 0);
+    status |= setDoubleParam(zmqDecompressRateParam, 0);
+    status |= setIntegerParam(zmqDecompressParam, 0);
+    status |= setIntegerParam(zmqPersistentParam, 0);
+    status |= setIntegerParam(zmqIdleDiscardedParam, 0);
+    status |= setIntegerParam(zmqPreTriggerFramesParam, 0);
+    status |= setIntegerParam(zmqPreTriggerMemoryParam, 0);
+    status |= setIntegerParam(zmqPreTriggerHeldParam, 0);
+    status |= setIntegerParam(zmqConflateParam, 0);
+    status |= setIntegerParam(zmqConflatedParam, 0);
+    status |= setIntegerParam(zmqDecimationParam, 1);
+    status |= setDoubleParam(zmqMaxRateParam, 0);
+    status |= setIntegerParam(zmqFramesAcceptedParam, 0);
+    status |= setIntegerParam(zmqFramesSkippedParam, 0);
+    for (size_t i = 0; i < this->endpoints.size(); i++)
+    {
+        status |= setStringParam((int) i, zmqEndpointAddressParam, this->endpoints[i].address.c_str());
+        status |= setIntegerParam((int) i, zmqEndpointMessagesParam, 0);
+        status |= setIntegerParam((int) i, zmqEndpointFramesParam, 0);
+        status |= setIntegerParam((int) i, zmqEndpointDroppedParam, 0);
+        status |= setDoubleParam((int) i, zmqEndpointRateParam, 0);
+    }
     if (this->socketType == ZMQ_SUB)
     {
         status |= setStringParam(ADModel, "ZeroMQ SUB");
@@ -587,50 +2199,87 @@ ZMQDriver::ZMQDriver(const char *portName, const char *address, const char *tran
     /* initialize ZMQ */
     this->context = zmq_ctx_new();
 
-    /* create the main socket */
-    this->socket = zmq_socket(this->context, this->socketType);
-
-    if (this->socketType == ZMQ_SUB)
+    /* create a socket per endpoint of each receive thread, and the inproc pair of sockets used to control it */
+    this->stopLock = epicsMutexCreate();
+    this->attributeLock = epicsMutexCreate();
+    this->exiting = false;
+    for (int i = 0; i < numThreads; i++)
     {
-        /* filter the message from the server host */
-        zmq_setsockopt(this->socket, ZMQ_SUBSCRIBE, "{", 1);
+        ZMQReceiver *pReceiver = new ZMQReceiver;
+        char controlHost[HOST_NAME_MAX];
+        char relayHost[HOST_NAME_MAX];
+        int hwm = 0;
+
+        pReceiver->pDriver = this;
+        pReceiver->index = i;
+        pReceiver->running = false;
+        pReceiver->threadId = NULL;
+        pReceiver->attached = false;
+        pReceiver->idle = false;
+        pReceiver->preTriggerBytes = 0;
+        pReceiver->nextSource = 0;
+        pReceiver->pSource = NULL;
+        for (size_t j = i % this->endpoints.size(); j < this->endpoints.size(); j += numThreads)
+        {
+            ZMQSource source;
+            source.socket = zmq_socket(this->context, this->socketType);
+            source.endpoint = this->endpoints[j];
+            source.endpointIndex = (int) j;
+            if (this->socketType == ZMQ_SUB)
+            {
+                /* filter the message from the server host */
+                zmq_setsockopt(source.socket, ZMQ_SUBSCRIBE, "{", 1);
+                zmq_setsockopt(source.socket, ZMQ_SUBSCRIBE, "[", 1);
+                zmq_setsockopt(source.socket, ZMQ_SUBSCRIBE, ZMQ_BINARY_HTYPE, strlen(ZMQ_BINARY_HTYPE));
+            }
+            pReceiver->sources.push_back(source);
+        }
 
-        /* create the pub socket to disconnect from server */
-        this->stopSocket = zmq_socket(this->context, ZMQ_PUB);
-        sprintf(this->stopHost, "inproc://%s", portName);
-        int rc = zmq_bind(this->stopSocket, this->stopHost);
-        if (rc != 0)
+        pReceiver->controlSocket = zmq_socket(this->context, ZMQ_PAIR);
+        pReceiver->controlPeer = zmq_socket(this->context, ZMQ_PAIR);
+        epicsSnprintf(controlHost, sizeof(controlHost), "inproc://%s.control%d", portName, i);
+        pReceiver->controlHost = controlHost;
+        /* an inproc endpoint has to be bound before it is connected to */
+        if (zmq_bind(pReceiver->controlSocket, controlHost) != 0 || zmq_connect(pReceiver->controlPeer, controlHost) != 0)
         {
-            fprintf(stderr, "%s: unable to find a free port, %s\n",
-                    functionName,
+            fprintf(stderr, "%s: unable to open %s, %s\n",
+                    functionName, controlHost,
+                    zmq_strerror(zmq_errno()));
+            return;
+        }
+        /* the relay holds the parts of one message, however many there are */
+        pReceiver->relaySocket = zmq_socket(this->context, ZMQ_PAIR);
+        pReceiver->relayPeer = zmq_socket(this->context, ZMQ_PAIR);
+        zmq_setsockopt(pReceiver->relaySocket, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+        zmq_setsockopt(pReceiver->relayPeer, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+        epicsSnprintf(relayHost, sizeof(relayHost), "inproc://%s.relay%d", portName, i);
+        if (zmq_bind(pReceiver->relaySocket, relayHost) != 0 || zmq_connect(pReceiver->relayPeer, relayHost) != 0)
+        {
+            fprintf(stderr, "%s: unable to open %s, %s\n",
+                    functionName, relayHost,
                     zmq_strerror(zmq_errno()));
             return;
         }
-        /* connect to the stop pub server */
-        zmq_connect(this->socket, stopHost);
-        zmq_setsockopt(this->socket, ZMQ_SUBSCRIBE, "STOP", 4);
-    }
-    else if (this->socketType == ZMQ_PULL)
-    {
-        /* create the push socket to disconnect from server */
-        this->stopSocket = zmq_socket(this->context, ZMQ_PUSH);
-        char *p = this->stopHost;
-        const char *q = this->serverHost.c_str();
 
-        while (*q)
+        /* the control socket is polled first so that a stop is never held up by data */
+        pReceiver->pollItems.resize(1 + pReceiver->sources.size());
+        for (size_t j = 0; j < pReceiver->pollItems.size(); j++)
         {
-            if (*q == '*')
-            {
-                strncpy(p, "127.0.0.1", 9);
-                p += 9;
-                q++;
-            }
-            else
-                *p++ = *q++;
+            pReceiver->pollItems[j].socket = j == 0 ? pReceiver->controlSocket : pReceiver->sources[j - 1].socket;
+            pReceiver->pollItems[j].fd = 0;
+            pReceiver->pollItems[j].events = ZMQ_POLLIN;
+            pReceiver->pollItems[j].revents = 0;
         }
-        *p = '\0';
 
-        zmq_connect(this->stopSocket, this->stopHost);
+        pReceiver->readyEventId = epicsEventCreate(epicsEventEmpty);
+        pReceiver->doneEventId = epicsEventCreate(epicsEventEmpty);
+        if (!pReceiver->readyEventId || !pReceiver->doneEventId)
+        {
+            fprintf(stderr, "%s:%s epicsEventCreate failure for receiver events\n",
+                    driverName, functionName);
+            return;
+        }
+        this->receivers.push_back(pReceiver);
     }
 
     /* Create the epicsEvents for signaling to the acquisition task when acquisition starts */
@@ -642,7 +2291,47 @@ ZMQDriver::ZMQDriver(const char *portName, const char *address, const char *tran
         return;
     }
 
-    /* Create the thread that updates the images */
+    this->receiverDoneEventId = epicsEventCreate(epicsEventEmpty);
+    this->frameEventId = epicsEventCreate(epicsEventEmpty);
+    this->dispatchIdleEventId = epicsEventCreate(epicsEventEmpty);
+    if (!this->receiverDoneEventId || !this->frameEventId || !this->dispatchIdleEventId)
+    {
+        fprintf(stderr, "%s:%s epicsEventCreate failure for frame events\n",
+                driverName, functionName);
+        return;
+    }
+
+    /* Create the thread that passes received images to the plugins */
+    status = (epicsThreadCreate("ZMQDispatchTask",
+                                epicsThreadPriorityMedium,
+                                epicsThreadGetStackSize(epicsThreadStackMedium),
+                                (EPICSTHREADFUNC) ZMQDispatchTaskC,
+                                this) == NULL);
+    if (status)
+    {
+        printf("%s:%s epicsThreadCreate failure for dispatch task\n",
+               driverName, functionName);
+        return;
+    }
+
+    /* Create the threads that receive the images */
+    for (size_t i = 0; i < this->receivers.size(); i++)
+    {
+        this->receivers[i]->threadId = epicsThreadCreate("ZMQReceiveTask",
+                                                         epicsThreadPriorityMedium,
+                                                         epicsThreadGetStackSize(epicsThreadStackMedium),
+                                                         (EPICSTHREADFUNC) ZMQReceiveTaskC,
+                                                         this->receivers[i]);
+        status = this->receivers[i]->threadId == NULL;
+        if (status)
+        {
+            printf("%s:%s epicsThreadCreate failure for receive task\n",
+                   driverName, functionName);
+            return;
+        }
+    }
+
+    /* Create the thread that runs the acquisition */
     status = (epicsThreadCreate("ZMQTask",
                                 epicsThreadPriorityMedium,
                                 epicsThreadGetStackSize(epicsThreadStackMedium),
@@ -660,9 +2349,9 @@ ZMQDriver::ZMQDriver(const char *portName, const char *address, const char *tran
 }
 
 extern "C" int ZMQDriverConfig(const char *portName, const char *address, const char *transport, const char *zmqType,
-                               int maxBuffers, size_t maxMemory, int priority, int stackSize)
+                               int maxBuffers, size_t maxMemory, int priority, int stackSize, int numThreads)
 {
-    new ZMQDriver(portName, address, transport, zmqType, maxBuffers, maxMemory, priority, stackSize);
+    new ZMQDriver(portName, address, transport, zmqType, maxBuffers, maxMemory, priority, stackSize, numThreads);
     return (asynSuccess);
 }
 
@@ -676,6 +2365,7 @@ static const iocshArg ZMQDriverConfigArg4 = {"maxBuffers", iocshArgInt};
 static const iocshArg ZMQDriverConfigArg5 = {"maxMemory", iocshArgInt};
 static const iocshArg ZMQDriverConfigArg6 = {"priority", iocshArgInt};
 static const iocshArg ZMQDriverConfigArg7 = {"stackSize", iocshArgInt};
+static const iocshArg ZMQDriverConfigArg8 = {"numThreads", iocshArgInt};
 static const iocshArg *const ZMQDriverConfigArgs[] = {&ZMQDriverConfigArg0,
                                                       &ZMQDriverConfigArg1,
                                                       &ZMQDriverConfigArg2,
@@ -683,13 +2373,14 @@ static const iocshArg *const ZMQDriverConfigArgs[] = {&ZMQDriverConfigArg0,
                                                       &ZMQDriverConfigArg4,
                                                       &ZMQDriverConfigArg5,
                                                       &ZMQDriverConfigArg6,
-                                                      &ZMQDriverConfigArg7};
-static const iocshFuncDef configZMQDriver = {"ZMQDriverConfig", 8, ZMQDriverConfigArgs};
+                                                      &ZMQDriverConfigArg7,
+                                                      &ZMQDriverConfigArg8};
+static const iocshFuncDef configZMQDriver = {"ZMQDriverConfig", 9, ZMQDriverConfigArgs};
 
 static void configZMQDriverCallFunc(const iocshArgBuf *args)
 {
     ZMQDriverConfig(args[0].sval, args[1].sval, args[2].sval, args[3].sval,
-                    args[4].ival, args[5].ival, args[6].ival, args[7].ival);
+                    args[4].ival, args[5].ival, args[6].ival, args[7].ival, args[8].ival);
 }
 
 
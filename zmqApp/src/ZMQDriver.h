@@ -10,18 +10,157 @@
 #endif
 
 #include "ADDriver.h"
+#include <atomic>
+#include <deque>
+#include <map>
 #include <string>
+#include <vector>
+
+#include <zmq.h>
+
+#include <epicsThread.h>
+
+#include "ZMQEndpoint.h"
+#include "ZMQFrameRing.h"
+#include "ZMQHeader.h"
+#include "ZMQStageTimer.h"
+
+#define zmqReceiveModeParamString "ZMQ_RECEIVE_MODE"
+#define zmqPoolWarmBuffersParamString "ZMQ_POOL_WARM_BUFFERS"
+#define zmqRingSizeParamString "ZMQ_RING_SIZE"
+#define zmqRingDepthParamString "ZMQ_RING_DEPTH"
+#define zmqRingHighWaterParamString "ZMQ_RING_HIGH_WATER"
+#define zmqRingOverflowsParamString "ZMQ_RING_OVERFLOWS"
+#define zmqNumReceiveThreadsParamString "ZMQ_NUM_RECEIVE_THREADS"
+#define zmqReorderWindowParamString "ZMQ_REORDER_WINDOW"
+#define zmqReorderTimeoutParamString "ZMQ_REORDER_TIMEOUT"
+#define zmqReorderPendingParamString "ZMQ_REORDER_PENDING"
+#define zmqLateFramesParamString "ZMQ_LATE_FRAMES"
+#define zmqOutOfWindowFramesParamString "ZMQ_OUT_OF_WINDOW_FRAMES"
+#define zmqHeaderCacheParamString "ZMQ_HEADER_CACHE"
+#define zmqHeaderCacheHitsParamString "ZMQ_HEADER_CACHE_HITS"
+#define zmqHeaderCacheMissesParamString "ZMQ_HEADER_CACHE_MISSES"
+#define zmqOverloadPolicyParamString "ZMQ_OVERLOAD_POLICY"
+#define zmqOverloadTimeoutParamString "ZMQ_OVERLOAD_TIMEOUT"
+#define zmqOverloadDroppedParamString "ZMQ_OVERLOAD_DROPPED"
+#define zmqOverloadDroppedQueuedParamString "ZMQ_OVERLOAD_DROPPED_QUEUED"
+#define zmqPoolPressureParamString "ZMQ_POOL_PRESSURE"
+#define zmqAttributeBaseMissingParamString "ZMQ_ATTRIBUTE_BASE_MISSING"
+#define zmqCompressionRatioParamString "ZMQ_COMPRESSION_RATIO"
+#define zmqDecompressRateParamString "ZMQ_DECOMPRESS_RATE"
+#define zmqDecompressParamString "ZMQ_DECOMPRESS"
+#define zmqPersistentParamString "ZMQ_PERSISTENT"
+#define zmqIdleDiscardedParamString "ZMQ_IDLE_DISCARDED"
+#define zmqPreTriggerFramesParamString "ZMQ_PRETRIGGER_FRAMES"
+#define zmqPreTriggerMemoryParamString "ZMQ_PRETRIGGER_MEMORY"
+#define zmqPreTriggerHeldParamString "ZMQ_PRETRIGGER_HELD"
+#define zmqConflateParamString "ZMQ_CONFLATE"
+#define zmqConflatedParamString "ZMQ_CONFLATED"
+#define zmqDecimationParamString "ZMQ_DECIMATION"
+#define zmqMaxRateParamString "ZMQ_MAX_RATE"
+#define zmqFramesAcceptedParamString "ZMQ_FRAMES_ACCEPTED"
+#define zmqFramesSkippedParamString "ZMQ_FRAMES_SKIPPED"
+/* published on the asyn address of each endpoint */
+#define zmqEndpointAddressParamString "ZMQ_ENDPOINT_ADDRESS"
+#define zmqEndpointMessagesParamString "ZMQ_ENDPOINT_MESSAGES"
+#define zmqEndpointFramesParamString "ZMQ_ENDPOINT_FRAMES"
+#define zmqEndpointDroppedParamString "ZMQ_ENDPOINT_DROPPED"
+#define zmqEndpointRateParamString "ZMQ_ENDPOINT_RATE"
+
+/* what to do with a frame when the NDArrayPool can not give it an array */
+typedef enum
+{
+    ZMQOverloadDropNewest, /* drop the frame */
+    ZMQOverloadDropOldest, /* drop the oldest frames waiting for the dispatch thread until one fits */
+    ZMQOverloadBlock       /* wait for plugins to release arrays, dropping the frame after a timeout */
+} ZMQOverloadPolicy_t;
+
+/* stages of a frame timed by the driver */
+typedef enum
+{
+    ZMQStageReceiveWait, /* waiting for and receiving the header */
+    ZMQStageParse,       /* parsing the header */
+    ZMQStageAlloc,       /* taking an array from the pool */
+    ZMQStageCopy,        /* receiving the data part and copying it into the array */
+    ZMQStageParams,      /* updating the parameters before the callbacks */
+    ZMQStageCallbacks,   /* the plugin callbacks */
+    ZMQNumStages
+} ZMQStage_t;
+
+/* latencies from the time the sender sent a frame */
+typedef enum
+{
+    ZMQLatencyReceive,   /* to the header arriving */
+    ZMQLatencyCallbacks, /* to the plugin callbacks having returned */
+    ZMQNumLatencies
+} ZMQLatency_t;
+
+/* attribute holding the time the sender sent an array, in seconds past the EPICS epoch */
+#define ZMQ_SEND_TIME_ATTRIBUTE "ZMQSendTime"
+
+/* how the data part of a message ends up in the NDArray */
+typedef enum
+{
+    ZMQReceiveCopy,       /* copy the message payload into a pool buffer */
+    ZMQReceiveZeroCopy,   /* use the message payload as the NDArray buffer */
+    ZMQReceivePreallocate /* take a pool buffer sized from the header, then receive the payload into it */
+} ZMQReceiveMode_t;
 
 class ZMQControlledDriver;
+class ZMQArrayPool;
+class ZMQDriver;
 
-/* array information parsed from data header */
-struct ChunkInfo
+/* a data socket of a receive thread, attached to one endpoint so that its messages can be told apart */
+struct ZMQSource
 {
-    int ndims;
-    size_t dims[ND_ARRAY_MAX_DIMS];
-    NDDataType_t dataType;
-    int frame;
-    bool valid;
+    void *socket;                        /* only used by the receive thread */
+    ZMQEndpoint endpoint;
+    int endpointIndex;                   /* asyn address the counters of the endpoint are published on */
+};
+
+/* counters of an endpoint, summed over the receive threads sharing it */
+struct ZMQEndpointStats
+{
+    std::atomic<int> messages;           /* messages received from it */
+    std::atomic<int> frames;             /* frames received from it and passed on */
+    std::atomic<int> dropped;            /* frames from it lost to overload, a full ring or bad data */
+    int lastFrames;                      /* frames when the rate was last published, used with the lock held */
+
+    ZMQEndpointStats() : messages(0), frames(0), dropped(0), lastFrames(0) {}
+};
+
+/* a receive thread with its own sockets */
+struct ZMQReceiver
+{
+    ZMQDriver *pDriver;
+    int index;
+    std::vector<ZMQSource> sources;      /* data sockets, one per endpoint of the thread */
+    std::vector<zmq_pollitem_t> pollItems; /* the control socket followed by the data sockets */
+    size_t nextSource;                   /* source served first when several have messages */
+    ZMQSource *pSource;                  /* source of the message being received, NULL for held frames */
+    void *controlSocket;                 /* inproc PAIR polled with the data sockets, only used by the receive thread */
+    void *controlPeer;                   /* the other end of controlSocket, used with stopLock held */
+    std::string controlHost;
+    void *relaySocket;                   /* inproc PAIR the newest message is received from with Conflate */
+    void *relayPeer;                     /* the other end of relaySocket, only used by the receive thread */
+    bool attached;                       /* sockets are attached to their endpoints, only used by the receive thread */
+    bool idle;                           /* receiving pre-trigger frames, only used by the receive thread */
+    ZMQFrameRing ring;                   /* received frames waiting for the dispatch thread */
+    ZMQHeaderCache headerCache;          /* last header parsed by this thread */
+    std::vector<ZMQBatchEntry> batchEntries; /* headers found in the last batch header */
+    std::deque<NDArray *> preTrigger;    /* frames received while idle, oldest first */
+    size_t preTriggerBytes;              /* buffer memory they hold */
+    epicsEventId readyEventId;           /* socket is attached to the endpoints */
+    std::atomic<bool> running;           /* between start and the end of its receive loop */
+    epicsEventId doneEventId;            /* the receive thread has exited */
+    epicsThreadId threadId;
+};
+
+/* a frame held back by the reorder stage */
+struct ZMQPendingFrame
+{
+    NDArray *pImage;
+    epicsTimeStamp arrival;
 };
 
 /** Driver for ZMQ **/
@@ -31,7 +170,7 @@ class ZMQDriver : public ADDriver
 public:
     /* Constructor and Destructor */
     ZMQDriver(const char *portName, const char *address, const char *transport, const char *zmqType,
-              int maxBuffers, size_t maxMemory, int priority, int stackSize);
+              int maxBuffers, size_t maxMemory, int priority, int stackSize, int numThreads = 1);
 
     ~ZMQDriver();
 
@@ -42,25 +181,155 @@ public:
 
     /* These are called from C and so must be public */
     void ZMQTask();
+    void ZMQReceiveTask(ZMQReceiver *pReceiver);
+    void ZMQDispatchTask();
+
+protected:
+    int zmqReceiveModeParam;
+    int zmqPoolWarmBuffersParam;
+    int zmqRingSizeParam;
+    int zmqRingDepthParam;
+    int zmqRingHighWaterParam;
+    int zmqRingOverflowsParam;
+    int zmqNumReceiveThreadsParam;
+    int zmqReorderWindowParam;
+    int zmqReorderTimeoutParam;
+    int zmqReorderPendingParam;
+    int zmqLateFramesParam;
+    int zmqOutOfWindowFramesParam;
+    int zmqHeaderCacheParam;
+    int zmqHeaderCacheHitsParam;
+    int zmqHeaderCacheMissesParam;
+    int zmqOverloadPolicyParam;
+    int zmqOverloadTimeoutParam;
+    int zmqOverloadDroppedParam;
+    int zmqOverloadDroppedQueuedParam;
+    int zmqPoolPressureParam;
+    int zmqAttributeBaseMissingParam;
+    int zmqCompressionRatioParam;
+    int zmqDecompressRateParam;
+    int zmqDecompressParam;
+    int zmqPersistentParam;
+    int zmqIdleDiscardedParam;
+    int zmqPreTriggerFramesParam;
+    int zmqPreTriggerMemoryParam;
+    int zmqPreTriggerHeldParam;
+    int zmqConflateParam;
+    int zmqConflatedParam;
+    int zmqDecimationParam;
+    int zmqMaxRateParam;
+    int zmqFramesAcceptedParam;
+    int zmqFramesSkippedParam;
+    int zmqEndpointAddressParam;
+    int zmqEndpointMessagesParam;
+    int zmqEndpointFramesParam;
+    int zmqEndpointDroppedParam;
+    int zmqEndpointRateParam;
 
 private:
     /* These are the methods that are new to this class */
-    asynStatus readData();
+    bool waitForStart(ZMQReceiver *pReceiver);
+    ZMQSource *waitForData(ZMQReceiver *pReceiver);
+    asynStatus conflateLatest(ZMQReceiver *pReceiver, ZMQSource *pSource);
+    void supersedeMessage(ZMQReceiver *pReceiver);
+    bool acceptFrame(ZMQReceiver *pReceiver, const ChunkInfo &info, NDAttributeList &attributeList);
+    void attachReceiver(ZMQReceiver *pReceiver);
+    void detachReceiver(ZMQReceiver *pReceiver);
+    asynStatus readData(ZMQReceiver *pReceiver, std::vector<NDArray *> &images, ZMQSource *pSource = NULL);
+    bool queueFrame(ZMQReceiver *pReceiver, NDArray *pImage, bool wait);
+    bool keepAttached();
+    void trimPreTrigger(ZMQReceiver *pReceiver);
+    void publishPreTrigger();
+    void storeAttributeBase(epicsUInt32 key, NDAttributeList &attributeList);
+    void completeFrame(ZMQReceiver *pReceiver, const ChunkInfo &info, NDAttributeList &attributeList,
+                       const epicsTimeStamp &receiveTime, NDArray *pImage);
+    void publishArray(NDArray *pImage, const char *functionName);
+    asynStatus receiveMessage(void *socket, const ChunkInfo &info, int receiveMode, NDArray **ppImage);
+    asynStatus receivePreallocated(void *socket, const ChunkInfo &info, NDArray **ppImage);
+    asynStatus receiveCompressed(void *socket, const ChunkInfo &info, NDArray **ppImage);
+    asynStatus receiveEncoded(void *socket, const ChunkInfo &info, bool decompress, NDArray **ppImage);
+    asynStatus receiveBatch(ZMQReceiver *pReceiver, void *socket, const char *msg, size_t len,
+                            const epicsTimeStamp &receiveTime, std::vector<NDArray *> &images);
+    NDArray *allocArray(const ChunkInfo &info, zmq_msg_t *message, size_t dataSize = 0);
+    void publishOverload();
+    void publishEndpoints(bool force);
+    void countDropped(ZMQReceiver *pReceiver, int frames = 1);
 
     virtual void startReceive(const char *receiveFunction);
     virtual void stopAcquisition();
+    void warmPool();
+    void startReceivers();
+    void interruptReceivers();
+    void commandReceivers(char command);
+    void updateIdleReceivers();
+    void waitForDispatch();
 
-    void getNDAttrFromJSON(JSONValue *value, ChunkInfo &info, NDAttributeList &attributeList);
-    virtual ChunkInfo parseHeader(const char *msg, NDAttributeList &attributeList);
+    void reorderFrame(NDArray *pImage);
+    void releaseInOrder();
+    void checkReorderTimeout();
+    void flushReorder();
+    void dispatchFrame(NDArray *pImage);
+
+    ChunkInfo parseHeader(const char *msg, size_t len, NDAttributeList &attributeList, ZMQHeaderCache *pCache);
+    virtual void readHeaderStrings(const char *msg, size_t len);
 
     /* These items are specific to the zmq driver */
-    std::string serverHost;
-    char stopHost[HOST_NAME_MAX];
+    std::vector<ZMQEndpoint> endpoints;
+    std::vector<ZMQEndpointStats> endpointStats; /* one per endpoint, indexed by asyn address */
+    uint64_t endpointsPublishedNs;               /* when the endpoint counters were last published */
     void *context; /* ZMQ context */
-    void *socket;  /* main socket to ZMQ server */
-    void *stopSocket;/* internal pub socket to stop */
     int socketType;
     epicsEventId startEventId;
+    ZMQArrayPool *pZMQArrayPool; /* also installed as pNDArrayPool */
+    NDArrayPool *pDefaultPool;   /* pool the base class created, restored before pZMQArrayPool is deleted */
+    ChunkInfo lastChunkInfo;     /* last valid header, used to warm the pool */
+
+    /* receive stage */
+    std::vector<ZMQReceiver *> receivers;
+    epicsMutexId stopLock;                  /* serialises use of the receivers' control peers */
+    std::atomic<bool> exiting;              /* the receive threads are to exit, the driver is being destroyed */
+    std::atomic<bool> persistent;           /* sockets stay attached between acquisitions */
+    std::atomic<int> idleDiscarded;         /* messages thrown away by attached sockets between acquisitions */
+    std::atomic<int> preTriggerFrames;      /* frames each receive thread keeps between acquisitions */
+    std::atomic<int> preTriggerMemory;      /* MB of buffers each receive thread keeps, 0 for no limit */
+    std::atomic<int> preTriggerHeld;        /* frames kept by all receive threads */
+    epicsEventId receiverDoneEventId;       /* a receive thread has left its receive loop */
+    std::atomic<int> activeReceivers;
+    std::atomic<int> framesReceived;        /* frames received by all threads in this acquisition */
+    int frameLimit;                         /* frames to receive in this acquisition, 0 for no limit */
+    int ringSize;                           /* usable depth of each receiver ring in this acquisition */
+    ZMQStageTimes stageTimes;               /* filled by all threads, published with the lock held */
+    int headerCache;                        /* reuse the last header when only its numbers change */
+    int conflate;                           /* only receive the newest of the messages waiting */
+    std::atomic<int> conflated;             /* frames superseded by a newer message before being received */
+    int decimation;                         /* pass on every decimation-th frame */
+    uint64_t minIntervalNs;                 /* between frames passed on, from MaxRate, 0 for no limit */
+    std::atomic<uint64_t> decimationCount;  /* frames considered for decimation in this acquisition */
+    std::atomic<uint64_t> nextAcceptNs;     /* monotonic time from which the next frame may be passed on */
+    std::atomic<int> framesAccepted;        /* frames passed on by decimation and the rate limit */
+    std::atomic<int> framesSkipped;         /* frames skipped from their header alone */
+    std::atomic<int> overloadDropped;       /* frames dropped because the pool was exhausted */
+    std::atomic<int> overloadDroppedQueued; /* queued frames dropped to make room for newer ones */
+    std::atomic<int> attributeBaseMissing;  /* frames whose full attribute set was not seen */
+    ZMQAttributeBases attributeBases;       /* full attribute sets for headers carrying only changes */
+    epicsMutexId attributeLock;             /* protects attributeBases, shared by the receive threads */
+    std::atomic<uint64_t> compressedBytes;  /* received compressed in this acquisition */
+    std::atomic<uint64_t> uncompressedBytes; /* the same data once decompressed */
+    std::atomic<uint64_t> decompressNs;     /* time spent decompressing it, summed over the threads */
+
+    /* dispatch stage, only touched by the dispatch thread once acquisition has started */
+    epicsEventId frameEventId;              /* a frame has been queued */
+    epicsEventId dispatchIdleEventId;       /* the dispatch thread has run out of frames */
+    std::atomic<bool> flushRequested;       /* release everything held by the reorder stage */
+    std::map<int, ZMQPendingFrame> reorderPending;
+    std::atomic<int> reorderPendingCount;
+    int reorderWindow;                      /* 0 dispatches frames in arrival order */
+    double reorderTimeout;
+    bool nextFrameValid;
+    int nextFrame;                          /* frame number the reorder stage releases next */
+    int consecutiveRejects;
+    int lateFrames;
+    int outOfWindowFrames;
 };
 
 
@@ -0,0 +1,68 @@
+/* ZMQEndpoint.cpp
+ *
+ * Address lists shared by the driver and the plugin.
+ *
+ */
+
+#include <zmq.h>
+
+#include "ZMQEndpoint.h"
+
+void zmqParseEndpoints(const char *address, const char *transport, bool bindByDefault,
+                       std::vector<ZMQEndpoint> &endpoints)
+{
+    std::string list(address ? address : "");
+    size_t start = 0;
+
+    while (start <= list.size())
+    {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string entry = list.substr(start, end - start);
+        start = end + 1;
+
+        size_t first = entry.find_first_not_of(" \t");
+        size_t last = entry.find_last_not_of(" \t");
+        if (first == std::string::npos)
+            continue;
+        entry = entry.substr(first, last - first + 1);
+
+        ZMQEndpoint endpoint;
+        endpoint.bind = bindByDefault;
+        if (entry[0] == '@' || entry[0] == '>')
+        {
+            endpoint.bind = entry[0] == '@';
+            entry = entry.substr(1);
+        }
+        if (entry.find("://") != std::string::npos || !transport || !transport[0])
+            endpoint.address = entry;
+        else
+            endpoint.address = std::string(transport) + std::string("://") + entry;
+        endpoints.push_back(endpoint);
+    }
+}
+
+void zmqDetachEndpoints(void *socket, const std::vector<ZMQEndpoint> &endpoints)
+{
+    for (size_t i = 0; i < endpoints.size(); i++)
+    {
+        if (endpoints[i].bind)
+            zmq_unbind(socket, endpoints[i].address.c_str());
+        else
+            zmq_disconnect(socket, endpoints[i].address.c_str());
+    }
+}
+
+std::string zmqEndpointList(const std::vector<ZMQEndpoint> &endpoints)
+{
+    std::string list;
+
+    for (size_t i = 0; i < endpoints.size(); i++)
+    {
+        if (i > 0)
+            list += ',';
+        list += endpoints[i].address;
+    }
+    return list;
+}
@@ -0,0 +1,32 @@
+/* ZMQEndpoint.h
+ *
+ * Address lists shared by the driver and the plugin.
+ *
+ */
+
+#ifndef ADZMQ_ZMQENDPOINT_H
+#define ADZMQ_ZMQENDPOINT_H
+
+#include <string>
+#include <vector>
+
+/* an address a socket binds or connects to */
+struct ZMQEndpoint
+{
+    std::string address;
+    bool bind;
+};
+
+/** Split a comma separated address list into endpoints.
+  * An entry may start with '@' to bind or '>' to connect, otherwise bindByDefault decides.
+  * Entries that already contain "://" are used as they are, otherwise transport:// is prepended. */
+void zmqParseEndpoints(const char *address, const char *transport, bool bindByDefault,
+                       std::vector<ZMQEndpoint> &endpoints);
+
+/** Unbind or disconnect a socket from each endpoint. */
+void zmqDetachEndpoints(void *socket, const std::vector<ZMQEndpoint> &endpoints);
+
+/** Comma separated addresses of the endpoints, for the connected address parameter. */
+std::string zmqEndpointList(const std::vector<ZMQEndpoint> &endpoints);
+
+#endif //ADZMQ_ZMQENDPOINT_H
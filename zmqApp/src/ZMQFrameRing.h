@@ -0,0 +1,109 @@
+/* ZMQFrameRing.h
+ *
+ * Bounded lock-free ring of NDArrays handed from the ZMQ receive thread to the dispatch thread.
+ *
+ */
+
+#ifndef ADZMQ_ZMQFRAMERING_H
+#define ADZMQ_ZMQFRAMERING_H
+
+#include <atomic>
+#include <vector>
+
+class NDArray;
+
+/* number of slots in the ring, the usable depth is limited at runtime */
+#define ZMQ_FRAME_RING_CAPACITY 1024
+
+/** Single-producer/multi-consumer queue of NDArray pointers.
+  * push() and resetStatistics() must only be called from one thread, pop() may be called from several:
+  * the dispatch thread, and receive threads dropping the oldest frames when the pool is exhausted.
+  * The other methods may be called from anywhere. */
+class ZMQFrameRing
+{
+public:
+    explicit ZMQFrameRing(size_t capacity = ZMQ_FRAME_RING_CAPACITY)
+            : slots(capacity), orders(capacity), head(0), tail(0), highWaterMark(0), overflowCount(0)
+    {
+    }
+
+    /** Queue an array unless limit arrays are already waiting.
+      * \param[in] order Where the array comes in the stream, its frame number, read back by front().
+      * \return false if the ring is full, the caller still owns the array then. */
+    bool push(NDArray *pArray, size_t limit, int order = 0)
+    {
+        size_t t = this->tail.load(std::memory_order_relaxed);
+        size_t used = t - this->head.load(std::memory_order_acquire);
+
+        if (limit > this->slots.size())
+            limit = this->slots.size();
+        if (used >= limit)
+        {
+            this->overflowCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        this->slots[t % this->slots.size()] = pArray;
+        this->orders[t % this->slots.size()].store(order, std::memory_order_relaxed);
+        this->tail.store(t + 1, std::memory_order_release);
+        if (used + 1 > this->highWaterMark.load(std::memory_order_relaxed))
+            this->highWaterMark.store(used + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /** Take the oldest array off the ring.
+      * \return NULL if the ring is empty. */
+    NDArray *pop()
+    {
+        size_t h = this->head.load(std::memory_order_acquire);
+        NDArray *pArray;
+
+        /* the slot can not be reused by the producer before head has moved past it */
+        do
+        {
+            if (h == this->tail.load(std::memory_order_acquire))
+                return NULL;
+            pArray = this->slots[h % this->slots.size()];
+        } while (!this->head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel));
+        return pArray;
+    }
+
+    /** The order of the oldest array, without taking it off the ring. A consumer may take it at any
+      * time, so the value is only a hint of which ring pop() is best called on.
+      * \return false if the ring is empty. */
+    bool front(int &order) const
+    {
+        size_t h = this->head.load(std::memory_order_acquire);
+
+        if (h == this->tail.load(std::memory_order_acquire))
+            return false;
+        order = this->orders[h % this->slots.size()].load(std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t depth() const
+    {
+        return this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return this->slots.size(); }
+
+    size_t highWater() const { return this->highWaterMark.load(std::memory_order_relaxed); }
+
+    unsigned long overflows() const { return this->overflowCount.load(std::memory_order_relaxed); }
+
+    void resetStatistics()
+    {
+        this->highWaterMark.store(0, std::memory_order_relaxed);
+        this->overflowCount.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<NDArray *> slots;
+    std::vector<std::atomic<int> > orders; /* order of the array in each slot, read without owning it */
+    std::atomic<size_t> head;   /* next slot to pop, only written by the consumers */
+    std::atomic<size_t> tail;   /* next slot to push, only written by the producer */
+    std::atomic<size_t> highWaterMark;
+    std::atomic<unsigned long> overflowCount;
+};
+
+#endif //ADZMQ_ZMQFRAMERING_H
@@ -0,0 +1,1622 @@
+/* ZMQHeader.cpp
+ *
+ * Single pass parser for the chunk-1.0 JSON data header.
+ * The header is read in place: nothing is allocated and no intermediate document is built,
+ * the values go straight into ChunkInfo and the NDAttributeList.
+ *
+ * Encoder and decoder for the binary chunk-bin-1.0 header, the writer of chunk-1.0 headers,
+ * and the batch header that carries several of them.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <epicsEndian.h>
+#include <epicsStdio.h>
+
+#include "ZMQHeader.h"
+
+/* longest attribute name or string value that is kept, longer ones are truncated */
+#define MAX_HEADER_STRING 256
+/* objects and arrays nested deeper than this are rejected */
+#define MAX_HEADER_DEPTH 32
+
+namespace
+{
+
+/* read position in the header */
+struct Cursor
+{
+    const char *p;
+    const char *end;
+    int numbers;             /* numbers read so far */
+    ZMQHeaderLayout *layout; /* if not NULL, records where the values were found */
+};
+
+/* a string as it appears in the header, without the quotes and with escapes still in place */
+struct Token
+{
+    const char *s;
+    size_t len;
+    bool escaped;
+};
+
+void skipSpace(Cursor &c)
+{
+    while (c.p < c.end && (*c.p == ' ' || *c.p == '\t' || *c.p == '\n' || *c.p == '\r'))
+        c.p++;
+}
+
+/* skip white space and consume ch if it is next */
+bool accept(Cursor &c, char ch)
+{
+    skipSpace(c);
+    if (c.p < c.end && *c.p == ch)
+    {
+        c.p++;
+        return true;
+    }
+    return false;
+}
+
+bool peek(Cursor &c, char ch)
+{
+    skipSpace(c);
+    return c.p < c.end && *c.p == ch;
+}
+
+bool parseString(Cursor &c, Token &token)
+{
+    if (!accept(c, '"'))
+        return false;
+    token.s = c.p;
+    token.escaped = false;
+    while (c.p < c.end && *c.p != '"')
+    {
+        if (*c.p == '\\')
+        {
+            token.escaped = true;
+            c.p++;
+        }
+        c.p++;
+    }
+    if (c.p >= c.end)
+        return false;
+    token.len = c.p - token.s;
+    c.p++;
+    return true;
+}
+
+bool isNumberChar(char ch)
+{
+    return (ch >= '0' && ch <= '9') || ch == '-' || ch == '+' || ch == '.' || ch == 'e' || ch == 'E';
+}
+
+/* numbers are converted from a small null terminated copy, integers without going through strtod */
+double toNumber(const char *start, size_t len)
+{
+    char buffer[64];
+    long long integer = 0;
+    bool negative = false;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (i == 0 && start[i] == '-')
+            negative = true;
+        else if (start[i] >= '0' && start[i] <= '9' && i < 18)
+            integer = integer * 10 + (start[i] - '0');
+        else
+            break;
+    }
+    if (i == len)
+        return (double) (negative ? -integer : integer);
+
+    if (len >= sizeof(buffer))
+        len = sizeof(buffer) - 1;
+    memcpy(buffer, start, len);
+    buffer[len] = '\0';
+    return strtod(buffer, NULL);
+}
+
+bool parseNumber(Cursor &c, double &value)
+{
+    const char *start;
+
+    skipSpace(c);
+    start = c.p;
+    while (c.p < c.end && isNumberChar(*c.p))
+        c.p++;
+    if (c.p == start || c.p - start >= 64)
+        return false;
+    value = toNumber(start, c.p - start);
+    c.numbers++;
+    return true;
+}
+
+bool skipValue(Cursor &c, int depth);
+
+bool skipContainer(Cursor &c, char close, bool isObject, int depth)
+{
+    Token token;
+
+    if (depth > MAX_HEADER_DEPTH)
+        return false;
+    if (accept(c, close))
+        return true;
+    do
+    {
+        if (isObject && (!parseString(c, token) || !accept(c, ':')))
+            return false;
+        if (!skipValue(c, depth + 1))
+            return false;
+    } while (accept(c, ','));
+    return accept(c, close);
+}
+
+bool skipValue(Cursor &c, int depth)
+{
+    Token token;
+    double number;
+
+    skipSpace(c);
+    if (c.p >= c.end)
+        return false;
+    switch (*c.p)
+    {
+        case '"':
+            return parseString(c, token);
+        case '{':
+            c.p++;
+            return skipContainer(c, '}', true, depth);
+        case '[':
+            c.p++;
+            return skipContainer(c, ']', false, depth);
+        case 't':
+        case 'f':
+        case 'n':
+            while (c.p < c.end && *c.p >= 'a' && *c.p <= 'z')
+                c.p++;
+            return true;
+        default:
+            return parseNumber(c, number);
+    }
+}
+
+bool equals(const Token &token, const char *s)
+{
+    return !token.escaped && strlen(s) == token.len && strncmp(token.s, s, token.len) == 0;
+}
+
+/* append the UTF-8 encoding of a code point */
+size_t putUTF8(unsigned long cp, char *out, size_t room)
+{
+    char bytes[4];
+    size_t n;
+
+    if (cp < 0x80)
+    {
+        bytes[0] = (char) cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        bytes[0] = (char) (0xC0 | (cp >> 6));
+        bytes[1] = (char) (0x80 | (cp & 0x3F));
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        bytes[0] = (char) (0xE0 | (cp >> 12));
+        bytes[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        bytes[2] = (char) (0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    else
+    {
+        bytes[0] = (char) (0xF0 | (cp >> 18));
+        bytes[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+        bytes[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        bytes[3] = (char) (0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    if (n > room)
+        return 0;
+    memcpy(out, bytes, n);
+    return n;
+}
+
+/* copy a string token into a null terminated buffer, resolving escapes. UTF-8 is passed through as it is */
+void copyString(const Token &token, char *out, size_t maxChars)
+{
+    size_t n = 0;
+    const char *s = token.s, *end = token.s + token.len;
+
+    if (!token.escaped)
+    {
+        n = token.len < maxChars - 1 ? token.len : maxChars - 1;
+        memcpy(out, s, n);
+        out[n] = '\0';
+        return;
+    }
+
+    while (s < end && n < maxChars - 1)
+    {
+        char ch = *s++;
+        if (ch != '\\' || s >= end)
+        {
+            out[n++] = ch;
+            continue;
+        }
+        ch = *s++;
+        switch (ch)
+        {
+            case 'b': out[n++] = '\b'; break;
+            case 'f': out[n++] = '\f'; break;
+            case 'n': out[n++] = '\n'; break;
+            case 'r': out[n++] = '\r'; break;
+            case 't': out[n++] = '\t'; break;
+            case 'u':
+            {
+                char hex[5] = {0};
+                unsigned long cp;
+                if (end - s < 4)
+                {
+                    s = end;
+                    break;
+                }
+                memcpy(hex, s, 4);
+                s += 4;
+                cp = strtoul(hex, NULL, 16);
+                /* join a surrogate pair */
+                if (cp >= 0xD800 && cp < 0xDC00 && end - s >= 6 && s[0] == '\\' && s[1] == 'u')
+                {
+                    memcpy(hex, s + 2, 4);
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (strtoul(hex, NULL, 16) - 0xDC00);
+                    s += 6;
+                }
+                n += putUTF8(cp, out + n, maxChars - 1 - n);
+                break;
+            }
+            default:
+                out[n++] = ch;
+                break;
+        }
+    }
+    out[n] = '\0';
+}
+
+bool parseDataType(const Token &type, NDDataType_t &dataType)
+{
+    if (equals(type, "uint8"))
+        dataType = NDUInt8;
+    else if (equals(type, "int8"))
+        dataType = NDInt8;
+    else if (equals(type, "int16"))
+        dataType = NDInt16;
+    else if (equals(type, "uint16"))
+        dataType = NDUInt16;
+    else if (equals(type, "int32"))
+        dataType = NDInt32;
+    else if (equals(type, "uint32"))
+        dataType = NDUInt32;
+    else if (equals(type, "float32"))
+        dataType = NDFloat32;
+    else if (equals(type, "float64"))
+        dataType = NDFloat64;
+    else
+        return false;
+    return true;
+}
+
+/* numbers are stored with the type named in "dataType", float64 if it is not a known type */
+NDAttrDataType_t attributeType(const Token &type, bool isString)
+{
+    NDDataType_t dataType;
+
+    if (isString)
+        return NDAttrString;
+    if (!parseDataType(type, dataType))
+        return NDAttrFloat64;
+    return (NDAttrDataType_t) dataType;
+}
+
+/* add one attribute, string is used for NDAttrString and number for the others */
+void addAttribute(NDAttributeList &attributeList, const char *name, NDAttrDataType_t dataType,
+                  const char *string, double number)
+{
+    union
+    {
+        epicsInt8 i8;
+        epicsUInt8 ui8;
+        epicsInt16 i16;
+        epicsUInt16 ui16;
+        epicsInt32 i32;
+        epicsUInt32 ui32;
+        epicsFloat32 f32;
+        epicsFloat64 f64;
+    } value;
+
+    switch (dataType)
+    {
+        case NDAttrString:
+            attributeList.add(name, name, NDAttrString, (void *) string);
+            return;
+        case NDAttrInt8: value.i8 = (epicsInt8) number; break;
+        case NDAttrUInt8: value.ui8 = (epicsUInt8) number; break;
+        case NDAttrInt16: value.i16 = (epicsInt16) number; break;
+        case NDAttrUInt16: value.ui16 = (epicsUInt16) number; break;
+        case NDAttrInt32: value.i32 = (epicsInt32) number; break;
+        case NDAttrUInt32: value.ui32 = (epicsUInt32) number; break;
+        case NDAttrFloat32: value.f32 = (epicsFloat32) number; break;
+        default:
+            dataType = NDAttrFloat64;
+            value.f64 = number;
+            break;
+    }
+    attributeList.add(name, name, dataType, &value);
+}
+
+/* "ndattr": {"name": {"value": v, "dataType": "t"}, ...} */
+bool parseAttributes(Cursor &c, NDAttributeList &attributeList)
+{
+    Token key, type, string;
+    char name[MAX_HEADER_STRING];
+    char v[MAX_HEADER_STRING];
+    double number = 0;
+    int numberIndex = -1;
+    bool isString, hasValue;
+
+    if (!accept(c, '{'))
+        return skipValue(c, 0);
+    if (accept(c, '}'))
+        return true;
+    do
+    {
+        if (!parseString(c, key) || !accept(c, ':'))
+            return false;
+        copyString(key, name, sizeof(name));
+
+        if (!accept(c, '{'))
+        {
+            fprintf(stderr, "Invalid \"ndattr\" type\n");
+            if (!skipValue(c, 0))
+                return false;
+            continue;
+        }
+        type.s = "";
+        type.len = 0;
+        type.escaped = false;
+        isString = hasValue = false;
+        if (!accept(c, '}'))
+        {
+            do
+            {
+                Token member;
+                if (!parseString(c, member) || !accept(c, ':'))
+                    return false;
+                if (equals(member, "value"))
+                {
+                    if (peek(c, '"'))
+                    {
+                        if (!parseString(c, string))
+                            return false;
+                        isString = hasValue = true;
+                    }
+                    else if (peek(c, '{') || peek(c, '[') || peek(c, 't') || peek(c, 'f') || peek(c, 'n'))
+                    {
+                        if (!skipValue(c, 0))
+                            return false;
+                    }
+                    else
+                    {
+                        if (!parseNumber(c, number))
+                            return false;
+                        numberIndex = c.numbers - 1;
+                        hasValue = true;
+                    }
+                }
+                else if (equals(member, "dataType"))
+                {
+                    if (!parseString(c, type))
+                        return false;
+                }
+                else if (!skipValue(c, 0))
+                    return false;
+            } while (accept(c, ','));
+            if (!accept(c, '}'))
+                return false;
+        }
+
+        if (hasValue && (!isString || equals(type, "string")))
+        {
+            ZMQHeaderAttribute attribute;
+            attribute.dataType = attributeType(type, isString);
+            v[0] = '\0';
+            if (isString)
+                copyString(string, v, sizeof(v));
+            addAttribute(attributeList, name, attribute.dataType, v, number);
+            if (c.layout)
+            {
+                attribute.name = name;
+                attribute.number = isString ? -1 : numberIndex;
+                attribute.value = v;
+                c.layout->attributes.push_back(attribute);
+            }
+        }
+        else
+            fprintf(stderr, "Invalid \"ndattr\" type\n");
+    } while (accept(c, ','));
+    return accept(c, '}');
+}
+
+/* a time stamp written as [secPastEpoch, nsec] */
+bool parseTimeStamp(Cursor &c, epicsTimeStamp &ts, int *pNumbers)
+{
+    double sec, nsec;
+
+    if (!accept(c, '[') || !parseNumber(c, sec) || !accept(c, ',') || !parseNumber(c, nsec) || !accept(c, ']'))
+        return false;
+    ts.secPastEpoch = (epicsUInt32) sec;
+    ts.nsec = (epicsUInt32) nsec;
+    if (pNumbers)
+    {
+        pNumbers[0] = c.numbers - 2;
+        pNumbers[1] = c.numbers - 1;
+    }
+    return true;
+}
+
+/* chunk-bin-1.0 fields are little endian and may be unaligned */
+template<typename T>
+T getField(const char *p)
+{
+    T value;
+#if EPICS_BYTE_ORDER == EPICS_ENDIAN_BIG
+    char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++)
+        bytes[i] = p[sizeof(T) - 1 - i];
+    memcpy(&value, bytes, sizeof(T));
+#else
+    memcpy(&value, p, sizeof(T));
+#endif
+    return value;
+}
+
+template<typename T>
+void putField(char *p, T value)
+{
+#if EPICS_BYTE_ORDER == EPICS_ENDIAN_BIG
+    char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); i++)
+        p[i] = bytes[sizeof(T) - 1 - i];
+#else
+    memcpy(p, &value, sizeof(T));
+#endif
+}
+
+bool toBinaryType(int dataType, ZMQBinaryType_t &type)
+{
+    switch (dataType)
+    {
+        case NDInt8: type = ZMQBinaryInt8; break;
+        case NDUInt8: type = ZMQBinaryUInt8; break;
+        case NDInt16: type = ZMQBinaryInt16; break;
+        case NDUInt16: type = ZMQBinaryUInt16; break;
+        case NDInt32: type = ZMQBinaryInt32; break;
+        case NDUInt32: type = ZMQBinaryUInt32; break;
+        case NDFloat32: type = ZMQBinaryFloat32; break;
+        case NDFloat64: type = ZMQBinaryFloat64; break;
+        default: return false;
+    }
+    return true;
+}
+
+bool fromBinaryType(int type, NDDataType_t &dataType)
+{
+    switch (type)
+    {
+        case ZMQBinaryInt8: dataType = NDInt8; break;
+        case ZMQBinaryUInt8: dataType = NDUInt8; break;
+        case ZMQBinaryInt16: dataType = NDInt16; break;
+        case ZMQBinaryUInt16: dataType = NDUInt16; break;
+        case ZMQBinaryInt32: dataType = NDInt32; break;
+        case ZMQBinaryUInt32: dataType = NDUInt32; break;
+        case ZMQBinaryFloat32: dataType = NDFloat32; break;
+        case ZMQBinaryFloat64: dataType = NDFloat64; break;
+        default: return false;
+    }
+    return true;
+}
+
+size_t binaryTypeSize(int type)
+{
+    switch (type)
+    {
+        case ZMQBinaryInt8:
+        case ZMQBinaryUInt8: return 1;
+        case ZMQBinaryInt16:
+        case ZMQBinaryUInt16: return 2;
+        case ZMQBinaryInt32:
+        case ZMQBinaryUInt32:
+        case ZMQBinaryFloat32: return 4;
+        default: return 8;
+    }
+}
+
+/* name of a data type in a chunk-1.0 header, NULL if it can not be sent */
+const char *jsonTypeName(int dataType)
+{
+    switch (dataType)
+    {
+        case NDInt8:
+            return "int8";
+        case NDUInt8:
+            return "uint8";
+        case NDInt16:
+            return "int16";
+        case NDUInt16:
+            return "uint16";
+        case NDInt32:
+            return "int32";
+        case NDUInt32:
+            return "uint32";
+        case NDFloat32:
+            return "float32";
+        case NDFloat64:
+            return "float64";
+        default:
+            return NULL;
+    }
+}
+
+} // namespace
+
+void zmqParseJSONHeader(const char *msg, size_t len, ChunkInfo &info, NDAttributeList &attributeList,
+                        ZMQHeaderLayout *layout)
+{
+    Cursor c = {msg, msg + len, 0, layout};
+    Token key, value;
+    double number;
+    bool hasHtype = false, hasShape = false, hasFrame = false, hasType = false, typeValid = false;
+    bool codecValid = true;
+
+    info.valid = false; /* indicate an invalid value */
+    info.hasTimeStamp = false;
+    info.hasSendTime = false;
+    info.attributeSet = ZMQAttributesFull;
+    info.attributeKey = 0;
+    info.codec = ZMQCodecNone;
+    info.uncompressedSize = 0;
+    info.chunkSize = 0;
+    info.ndCodec[0] = '\0';
+    info.compressedSize = 0;
+    info.ndims = 0;
+    if (layout)
+    {
+        layout->attributes.clear();
+        layout->numbers = 0;
+        layout->uncompressedSizeNumber = -1;
+        layout->chunkSizeNumber = -1;
+        layout->compressedSizeNumber = -1;
+    }
+    bool hasTimeStamp = false, hasEpicsTS = false;
+
+    if (!accept(c, '{'))
+    {
+        fprintf(stderr, "Invalid JSON Object\n");
+        return;
+    }
+    if (!accept(c, '}'))
+    {
+        do
+        {
+            if (!parseString(c, key) || !accept(c, ':'))
+            {
+                fprintf(stderr, "Invalid JSON Object\n");
+                return;
+            }
+
+            if (equals(key, "htype"))
+            {
+                /* check htype, only "chunk-1.0" supported */
+                bool isArray = accept(c, '[');
+                if (!parseString(c, value) || !equals(value, "chunk-1.0"))
+                {
+                    fprintf(stderr, "\"htype\" != \"chunk-1.0\" \n");
+                    return;
+                }
+                if (isArray && !skipContainer(c, ']', false, 0))
+                    return;
+                hasHtype = true;
+            }
+            else if (equals(key, "shape"))
+            {
+                /* get shape info */
+                if (!accept(c, '['))
+                {
+                    fprintf(stderr, "Invalid \"shape\" field\n");
+                    return;
+                }
+                memset(info.dims, 0, sizeof(info.dims));
+                if (!accept(c, ']'))
+                {
+                    do
+                    {
+                        if (info.ndims >= ND_ARRAY_MAX_DIMS || !parseNumber(c, number))
+                        {
+                            fprintf(stderr, "Invalid \"shape\" field\n");
+                            return;
+                        }
+                        if (layout)
+                            layout->shapeNumbers[info.ndims] = c.numbers - 1;
+                        info.dims[info.ndims++] = (size_t) number;
+                    } while (accept(c, ','));
+                    if (!accept(c, ']'))
+                    {
+                        fprintf(stderr, "Invalid \"shape\" field\n");
+                        return;
+                    }
+                }
+                hasShape = true;
+            }
+            else if (equals(key, "frame"))
+            {
+                /* get frame number */
+                if (!parseNumber(c, number))
+                {
+                    fprintf(stderr, "Invalid \"frame\" field\n");
+                    return;
+                }
+                if (layout)
+                    layout->frameNumber = c.numbers - 1;
+                info.frame = (int) number;
+                hasFrame = true;
+            }
+            else if (equals(key, "timeStamp"))
+            {
+                /* NDArray timeStamp of the sender */
+                if (!parseNumber(c, info.timeStamp))
+                {
+                    fprintf(stderr, "Invalid \"timeStamp\" field\n");
+                    return;
+                }
+                if (layout)
+                    layout->timeStampNumber = c.numbers - 1;
+                hasTimeStamp = true;
+            }
+            else if (equals(key, "epicsTS"))
+            {
+                /* NDArray epicsTS of the sender */
+                if (!parseTimeStamp(c, info.epicsTS, layout ? layout->epicsTSNumbers : NULL))
+                {
+                    fprintf(stderr, "Invalid \"epicsTS\" field\n");
+                    return;
+                }
+                hasEpicsTS = true;
+            }
+            else if (equals(key, "sendTime"))
+            {
+                /* when the sender sent the header */
+                if (!parseTimeStamp(c, info.sendTime, layout ? layout->sendTimeNumbers : NULL))
+                {
+                    fprintf(stderr, "Invalid \"sendTime\" field\n");
+                    return;
+                }
+                info.hasSendTime = true;
+            }
+            else if (equals(key, "type"))
+            {
+                /* get data type */
+                if (!parseString(c, value))
+                {
+                    fprintf(stderr, "Invalid \"type\" field\n");
+                    return;
+                }
+                hasType = true;
+                typeValid = parseDataType(value, info.dataType);
+                if (!typeValid)
+                    fprintf(stderr, "Unsupported data type\n");
+            }
+            else if (equals(key, "ndattrKey") || equals(key, "ndattrBase"))
+            {
+                /* ndattr is a full set to keep, or the changes to one kept before */
+                if (!parseNumber(c, number))
+                {
+                    fprintf(stderr, "Invalid \"%s\" field\n", equals(key, "ndattrKey") ? "ndattrKey" : "ndattrBase");
+                    return;
+                }
+                if (layout)
+                    layout->attributeKeyNumber = c.numbers - 1;
+                info.attributeSet = equals(key, "ndattrKey") ? ZMQAttributesKey : ZMQAttributesDelta;
+                info.attributeKey = (epicsUInt32) number;
+            }
+            else if (equals(key, "codec"))
+            {
+                /* the data part is compressed in chunks */
+                if (!parseString(c, value))
+                {
+                    fprintf(stderr, "Invalid \"codec\" field\n");
+                    return;
+                }
+                info.codec = value.escaped ? (int) ZMQNumCodecs : zmqCodecFromName(value.s, value.len);
+                codecValid = info.codec != ZMQNumCodecs;
+                if (!codecValid)
+                    fprintf(stderr, "Unsupported codec\n");
+            }
+            else if (equals(key, "ndcodec"))
+            {
+                /* the array was compressed upstream and is sent as it is */
+                if (!parseString(c, value))
+                {
+                    fprintf(stderr, "Invalid \"ndcodec\" field\n");
+                    return;
+                }
+                copyString(value, info.ndCodec, sizeof(info.ndCodec));
+            }
+            else if (equals(key, "compressedSize"))
+            {
+                if (!parseNumber(c, number) || number < 0)
+                {
+                    fprintf(stderr, "Invalid \"compressedSize\" field\n");
+                    return;
+                }
+                if (layout)
+                    layout->compressedSizeNumber = c.numbers - 1;
+                info.compressedSize = (size_t) number;
+            }
+            else if (equals(key, "uncompressedSize") || equals(key, "chunkSize"))
+            {
+                bool isChunkSize = equals(key, "chunkSize");
+                if (!parseNumber(c, number) || number < 0)
+                {
+                    fprintf(stderr, "Invalid \"%s\" field\n", isChunkSize ? "chunkSize" : "uncompressedSize");
+                    return;
+                }
+                if (layout)
+                    (isChunkSize ? layout->chunkSizeNumber : layout->uncompressedSizeNumber) = c.numbers - 1;
+                (isChunkSize ? info.chunkSize : info.uncompressedSize) = (size_t) number;
+            }
+            else if (equals(key, "ndattr"))
+            {
+                /* parse ndattr */
+                if (!parseAttributes(c, attributeList))
+                {
+                    fprintf(stderr, "Invalid \"ndattr\" field\n");
+                    return;
+                }
+            }
+            else if (!skipValue(c, 0))
+            {
+                fprintf(stderr, "Invalid JSON Object\n");
+                return;
+            }
+        } while (accept(c, ','));
+        if (!accept(c, '}'))
+        {
+            fprintf(stderr, "Invalid JSON Object\n");
+            return;
+        }
+    }
+
+    if (!hasHtype)
+        fprintf(stderr, "Invalid \"htype\" field\n");
+    else if (!hasShape)
+        fprintf(stderr, "Invalid \"shape\" field\n");
+    else if (!hasFrame)
+        fprintf(stderr, "Invalid \"frame\" field\n");
+    else if (!hasType)
+        fprintf(stderr, "Invalid \"type\" field\n");
+    else if (info.codec != ZMQCodecNone && info.chunkSize == 0)
+        fprintf(stderr, "Invalid \"chunkSize\" field\n");
+    else if (info.ndCodec[0] && (info.compressedSize == 0 || info.codec != ZMQCodecNone))
+        fprintf(stderr, "Invalid \"ndcodec\" field\n");
+    else
+        info.valid = typeValid && codecValid;
+    /* the time stamps are only used together */
+    info.hasTimeStamp = hasTimeStamp && hasEpicsTS;
+    if (layout)
+        layout->numbers = c.numbers;
+}
+
+bool zmqIsBinaryHeader(const char *msg, size_t len)
+{
+    return len >= ZMQ_BINARY_MIN_FIXED_SIZE && memcmp(msg, ZMQ_BINARY_HTYPE, sizeof(ZMQ_BINARY_HTYPE)) == 0;
+}
+
+void zmqParseBinaryHeader(const char *msg, size_t len, ChunkInfo &info, NDAttributeList &attributeList)
+{
+    const char *p, *end = msg + len;
+    size_t tableOffset;
+    int numAttributes;
+    char name[MAX_HEADER_STRING];
+    char string[MAX_HEADER_STRING];
+
+    info.valid = false; /* indicate an invalid value */
+    info.hasTimeStamp = false;
+    info.hasSendTime = false;
+    info.attributeSet = ZMQAttributesFull;
+    info.attributeKey = 0;
+    info.codec = ZMQCodecNone;
+    info.uncompressedSize = 0;
+    info.chunkSize = 0;
+    info.ndCodec[0] = '\0';
+    info.compressedSize = 0;
+    if (!zmqIsBinaryHeader(msg, len))
+    {
+        fprintf(stderr, "Invalid binary header\n");
+        return;
+    }
+
+    tableOffset = getField<epicsUInt16>(msg + 16);
+    info.ndims = (epicsUInt8) msg[19];
+    numAttributes = getField<epicsUInt16>(msg + 20);
+    if (tableOffset < ZMQ_BINARY_MIN_FIXED_SIZE || tableOffset > len || info.ndims > ND_ARRAY_MAX_DIMS)
+    {
+        fprintf(stderr, "Invalid binary header\n");
+        return;
+    }
+    if (!fromBinaryType((epicsUInt8) msg[18], info.dataType))
+    {
+        fprintf(stderr, "Unsupported data type\n");
+        return;
+    }
+    info.frame = (int) getField<uint64_t>(msg + 24);
+    info.timeStamp = getField<epicsFloat64>(msg + 32);
+    info.epicsTS.secPastEpoch = getField<epicsUInt32>(msg + 40);
+    info.epicsTS.nsec = getField<epicsUInt32>(msg + 44);
+    info.hasTimeStamp = true;
+    for (int i = 0; i < info.ndims; i++)
+        info.dims[i] = (size_t) getField<uint64_t>(msg + 48 + 8 * i);
+    if (tableOffset >= ZMQ_BINARY_SEND_TIME_FIXED_SIZE)
+    {
+        info.sendTime.secPastEpoch = getField<epicsUInt32>(msg + 128);
+        info.sendTime.nsec = getField<epicsUInt32>(msg + 132);
+        info.hasSendTime = true;
+    }
+    if (tableOffset >= ZMQ_BINARY_CODEC_FIXED_SIZE)
+    {
+        info.uncompressedSize = (size_t) getField<uint64_t>(msg + 136);
+        info.chunkSize = getField<epicsUInt32>(msg + 144);
+        info.codec = (epicsUInt8) msg[148];
+        if (info.codec >= ZMQNumCodecs || (info.codec != ZMQCodecNone && info.chunkSize == 0))
+        {
+            fprintf(stderr, "Unsupported codec\n");
+            return;
+        }
+    }
+    if (tableOffset >= ZMQ_BINARY_FIXED_SIZE)
+    {
+        info.compressedSize = (size_t) getField<uint64_t>(msg + 152);
+        memcpy(info.ndCodec, msg + 160, ZMQ_NDCODEC_NAME_SIZE);
+        info.ndCodec[ZMQ_NDCODEC_NAME_SIZE] = '\0';
+        if (info.ndCodec[0] && (info.compressedSize == 0 || info.codec != ZMQCodecNone))
+        {
+            fprintf(stderr, "Invalid binary header\n");
+            return;
+        }
+    }
+
+    p = msg + tableOffset;
+    for (int i = 0; i < numAttributes; i++)
+    {
+        int type;
+        size_t nameLen, valueLen;
+        double number;
+
+        if (end - p < 4)
+            return;
+        type = (epicsUInt8) p[0];
+        nameLen = (epicsUInt8) p[1];
+        valueLen = getField<epicsUInt16>(p + 2);
+        p += 4;
+        if ((size_t) (end - p) < nameLen + valueLen ||
+            (type != ZMQBinaryString && (type > ZMQBinaryString || valueLen != binaryTypeSize(type))))
+        {
+            fprintf(stderr, "Invalid binary header attribute\n");
+            return;
+        }
+        memcpy(name, p, nameLen);
+        name[nameLen] = '\0';
+        p += nameLen;
+
+        switch (type)
+        {
+            case ZMQBinaryString:
+            {
+                size_t copyLen = valueLen < sizeof(string) ? valueLen : sizeof(string) - 1;
+                memcpy(string, p, copyLen);
+                string[copyLen] = '\0';
+                addAttribute(attributeList, name, NDAttrString, string, 0);
+                p += valueLen;
+                continue;
+            }
+            case ZMQBinaryInt8: number = (epicsInt8) p[0]; break;
+            case ZMQBinaryUInt8: number = (epicsUInt8) p[0]; break;
+            case ZMQBinaryInt16: number = getField<epicsInt16>(p); break;
+            case ZMQBinaryUInt16: number = getField<epicsUInt16>(p); break;
+            case ZMQBinaryInt32: number = getField<epicsInt32>(p); break;
+            case ZMQBinaryUInt32: number = getField<epicsUInt32>(p); break;
+            case ZMQBinaryInt64: number = (double) getField<int64_t>(p); break;
+            case ZMQBinaryUInt64: number = (double) getField<uint64_t>(p); break;
+            case ZMQBinaryFloat32: number = getField<epicsFloat32>(p); break;
+            default: number = getField<epicsFloat64>(p); break;
+        }
+        p += valueLen;
+
+        NDDataType_t dataType;
+        if (fromBinaryType(type, dataType))
+            addAttribute(attributeList, name, (NDAttrDataType_t) dataType, NULL, number);
+        else
+            addAttribute(attributeList, name, NDAttrFloat64, NULL, number);
+    }
+    info.valid = true;
+}
+
+size_t zmqEncodeBinaryHeader(NDArray *pArray, const epicsTimeStamp &sendTime, std::vector<char> &buffer,
+                             int codec)
+{
+    ZMQBinaryType_t type;
+    size_t size = ZMQ_BINARY_FIXED_SIZE;
+    int numAttributes = 0;
+    char *p;
+
+    if (!toBinaryType(pArray->dataType, type) || pArray->ndims > ZMQ_BINARY_MAX_DIMS)
+        return 0;
+
+    /* grows to the largest header seen and then stays */
+    if (buffer.size() < ZMQ_BINARY_FIXED_SIZE)
+        buffer.resize(ZMQ_BINARY_FIXED_SIZE);
+    p = &buffer[0];
+    memset(p, 0, ZMQ_BINARY_FIXED_SIZE);
+    memcpy(p, ZMQ_BINARY_HTYPE, sizeof(ZMQ_BINARY_HTYPE));
+    putField<epicsUInt16>(p + 16, ZMQ_BINARY_FIXED_SIZE);
+    p[18] = (char) type;
+    p[19] = (char) pArray->ndims;
+    putField<uint64_t>(p + 24, (uint64_t) pArray->uniqueId);
+    putField<epicsFloat64>(p + 32, pArray->timeStamp);
+    putField<epicsUInt32>(p + 40, pArray->epicsTS.secPastEpoch);
+    putField<epicsUInt32>(p + 44, pArray->epicsTS.nsec);
+    for (int i = 0; i < pArray->ndims; i++)
+        putField<uint64_t>(p + 48 + 8 * i, (uint64_t) pArray->dims[i].size);
+    putField<epicsUInt32>(p + 128, sendTime.secPastEpoch);
+    putField<epicsUInt32>(p + 132, sendTime.nsec);
+    if (codec != ZMQCodecNone)
+    {
+        NDArrayInfo_t arrayInfo;
+        pArray->getInfo(&arrayInfo);
+        putField<uint64_t>(p + 136, (uint64_t) arrayInfo.totalBytes);
+        putField<epicsUInt32>(p + 144, (epicsUInt32) zmqCodecChunkSize(arrayInfo.bytesPerElement));
+        p[148] = (char) codec;
+    }
+#ifdef ZMQ_NDARRAY_CODEC
+    else if (!pArray->codec.name.empty())
+    {
+        NDArrayInfo_t arrayInfo;
+        pArray->getInfo(&arrayInfo);
+        putField<uint64_t>(p + 136, (uint64_t) arrayInfo.totalBytes);
+        putField<uint64_t>(p + 152, (uint64_t) pArray->compressedSize);
+        strncpy(p + 160, pArray->codec.name.c_str(), ZMQ_NDCODEC_NAME_SIZE);
+    }
+#endif
+
+    NDAttribute *pAttr = pArray->pAttributeList->next(NULL);
+    for (; pAttr != NULL; pAttr = pArray->pAttributeList->next(pAttr))
+    {
+        NDAttrDataType_t attrDataType;
+        size_t attrDataSize, nameLen, valueLen;
+        const char *name = pAttr->getName();
+
+        pAttr->getValueInfo(&attrDataType, &attrDataSize);
+        if (attrDataType == NDAttrString)
+        {
+            type = ZMQBinaryString;
+            valueLen = attrDataSize > 0 ? attrDataSize - 1 : 0;
+            if (valueLen > 0xFFFF)
+                valueLen = 0xFFFF;
+        }
+        else if (toBinaryType(attrDataType, type))
+            valueLen = binaryTypeSize(type);
+        else
+            continue;
+        if (numAttributes == 0xFFFF)
+            break;
+        nameLen = strlen(name);
+        if (nameLen > 0xFF)
+            nameLen = 0xFF;
+
+        if (buffer.size() < size + 4 + nameLen + valueLen + 1)
+            buffer.resize(2 * (size + 4 + nameLen + valueLen + 1));
+        p = &buffer[size];
+        p[0] = (char) type;
+        p[1] = (char) nameLen;
+        putField<epicsUInt16>(p + 2, (epicsUInt16) valueLen);
+        memcpy(p + 4, name, nameLen);
+        p += 4 + nameLen;
+        if (type == ZMQBinaryString)
+        {
+            /* getValue writes the terminating null, the spare byte reserved above takes it */
+            pAttr->getValue(NDAttrString, p, valueLen + 1);
+        }
+        else
+        {
+            char value[8];
+            pAttr->getValue(attrDataType, value, valueLen);
+#if EPICS_BYTE_ORDER == EPICS_ENDIAN_BIG
+            for (size_t i = 0; i < valueLen; i++)
+                p[i] = value[valueLen - 1 - i];
+#else
+            memcpy(p, value, valueLen);
+#endif
+        }
+        size += 4 + nameLen + valueLen;
+        numAttributes++;
+    }
+    putField<epicsUInt16>(&buffer[20], (epicsUInt16) numAttributes);
+    return size;
+}
+
+bool zmqHeaderGetString(const char *msg, size_t len, const char *key, char *value, size_t maxChars)
+{
+    Cursor c = {msg, msg + len, 0, NULL};
+    Token name, string;
+
+    if (!accept(c, '{') || accept(c, '}'))
+        return false;
+    do
+    {
+        if (!parseString(c, name) || !accept(c, ':'))
+            return false;
+        if (equals(name, key) && peek(c, '"'))
+        {
+            if (!parseString(c, string))
+                return false;
+            copyString(string, value, maxChars);
+            return true;
+        }
+        if (!skipValue(c, 0))
+            return false;
+    } while (accept(c, ','));
+    return false;
+}
+
+bool zmqIsBatchHeader(const char *msg, size_t len)
+{
+    return len > 0 && msg[0] == '[';
+}
+
+bool zmqSplitBatchHeader(const char *msg, size_t len, std::vector<ZMQBatchEntry> &entries)
+{
+    Cursor c = {msg, msg + len, 0, NULL};
+    ZMQBatchEntry entry;
+
+    entries.clear();
+    if (!accept(c, '[') || accept(c, ']'))
+        return false;
+    do
+    {
+        if (!peek(c, '{'))
+            return false;
+        entry.offset = c.p - msg;
+        if (!skipValue(c, 0))
+            return false;
+        entry.len = c.p - msg - entry.offset;
+        entries.push_back(entry);
+    } while (accept(c, ','));
+    return accept(c, ']');
+}
+
+ZMQHeaderCache::ZMQHeaderCache() :
+        hits(0), misses(0), cached(false)
+{
+}
+
+/* reduce the header to its bytes outside numbers, each number is replaced by '#' and its position kept */
+void ZMQHeaderCache::scan(const char *msg, size_t len)
+{
+    const char *p = msg, *run = msg, *end = msg + len;
+
+    this->skeleton.clear();
+    this->numbers.clear();
+    while (p < end)
+    {
+        if (*p == '"')
+        {
+            /* skip over the string, a quote preceded by an odd number of backslashes is escaped */
+            const char *quote = p;
+            size_t slashes;
+            do
+            {
+                quote = (const char *) memchr(quote + 1, '"', end - quote - 1);
+                if (quote == NULL)
+                    break;
+                for (slashes = 0; quote - slashes - 1 > p && quote[-(long) slashes - 1] == '\\'; slashes++);
+            } while (slashes & 1);
+            p = quote ? quote + 1 : end;
+        }
+        else if (*p == '-' || (*p >= '0' && *p <= '9'))
+        {
+            ZMQHeaderNumber number;
+            this->skeleton.append(run, p - run);
+            this->skeleton += '#';
+            number.offset = p - msg;
+            while (p < end && isNumberChar(*p))
+                p++;
+            number.len = (p - msg) - number.offset;
+            this->numbers.push_back(number);
+            run = p;
+        }
+        else
+            p++;
+    }
+    this->skeleton.append(run, p - run);
+}
+
+/* numbers that read the same as in the previous header are not converted again */
+double ZMQHeaderCache::number(const char *msg, int index)
+{
+    const ZMQHeaderNumber &number = this->numbers[index];
+    const ZMQHeaderNumber &previous = this->previousNumbers[index];
+
+    if (number.len != previous.len ||
+        memcmp(msg + number.offset, this->previous.data() + previous.offset, number.len) != 0)
+        this->values[index] = toNumber(msg + number.offset, number.len);
+    return this->values[index];
+}
+
+bool ZMQHeaderCache::parse(const char *msg, size_t len, ChunkInfo &info, NDAttributeList &attributeList)
+{
+    this->scan(msg, len);
+
+    if (this->cached && this->skeleton == this->cachedSkeleton)
+    {
+        /* only numbers changed, take them from their known positions */
+        info = this->cachedInfo;
+        info.frame = (int) this->number(msg, this->layout.frameNumber);
+        for (int i = 0; i < info.ndims; i++)
+            info.dims[i] = (size_t) this->number(msg, this->layout.shapeNumbers[i]);
+        if (info.hasTimeStamp)
+        {
+            info.timeStamp = this->number(msg, this->layout.timeStampNumber);
+            info.epicsTS.secPastEpoch = (epicsUInt32) this->number(msg, this->layout.epicsTSNumbers[0]);
+            info.epicsTS.nsec = (epicsUInt32) this->number(msg, this->layout.epicsTSNumbers[1]);
+        }
+        if (info.hasSendTime)
+        {
+            info.sendTime.secPastEpoch = (epicsUInt32) this->number(msg, this->layout.sendTimeNumbers[0]);
+            info.sendTime.nsec = (epicsUInt32) this->number(msg, this->layout.sendTimeNumbers[1]);
+        }
+        if (info.attributeSet != ZMQAttributesFull)
+            info.attributeKey = (epicsUInt32) this->number(msg, this->layout.attributeKeyNumber);
+        if (this->layout.uncompressedSizeNumber >= 0)
+            info.uncompressedSize = (size_t) this->number(msg, this->layout.uncompressedSizeNumber);
+        if (this->layout.chunkSizeNumber >= 0)
+            info.chunkSize = (size_t) this->number(msg, this->layout.chunkSizeNumber);
+        if (this->layout.compressedSizeNumber >= 0)
+            info.compressedSize = (size_t) this->number(msg, this->layout.compressedSizeNumber);
+        for (size_t i = 0; i < this->layout.attributes.size(); i++)
+        {
+            const ZMQHeaderAttribute &attribute = this->layout.attributes[i];
+            addAttribute(attributeList, attribute.name.c_str(), attribute.dataType, attribute.value.c_str(),
+                         attribute.number < 0 ? 0 : this->number(msg, attribute.number));
+        }
+        this->previous.assign(msg, len);
+        this->previousNumbers.swap(this->numbers);
+        this->hits++;
+        return true;
+    }
+
+    zmqParseJSONHeader(msg, len, info, attributeList, &this->layout);
+    /* the scan must have seen the same numbers as the parser for the positions to be usable */
+    this->cached = info.valid && this->layout.numbers == (int) this->numbers.size();
+    if (this->cached)
+    {
+        this->cachedSkeleton.swap(this->skeleton);
+        this->cachedInfo = info;
+        /* no number has been converted yet, a zero length never matches */
+        this->previousNumbers.assign(this->numbers.size(), ZMQHeaderNumber());
+        this->values.assign(this->numbers.size(), 0);
+    }
+    this->misses++;
+    return false;
+}
+
+void ZMQHeaderCache::clear()
+{
+    this->cached = false;
+}
+
+void ZMQHeaderCache::resetStatistics()
+{
+    this->hits = 0;
+    this->misses = 0;
+}
+
+ZMQHeaderWriter::ZMQHeaderWriter() :
+        buffer(1024), size(0), dataType(NDInt8), ndims(-1), keyPeriod(0), sinceKey(0), baseKey(0), hasBase(false)
+{
+}
+
+/* make room for n more bytes */
+char *ZMQHeaderWriter::reserve(size_t n)
+{
+    if (this->buffer.size() < this->size + n)
+        this->buffer.resize(2 * (this->size + n));
+    return &this->buffer[this->size];
+}
+
+void ZMQHeaderWriter::append(const char *s, size_t n)
+{
+    memcpy(this->reserve(n), s, n);
+    this->size += n;
+}
+
+void ZMQHeaderWriter::appendUInt(unsigned long long value)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+
+    do
+    {
+        *--p = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+    this->append(p, digits + sizeof(digits) - p);
+}
+
+void ZMQHeaderWriter::appendInt(long long value)
+{
+    if (value < 0)
+    {
+        this->append("-", 1);
+        this->appendUInt(0ull - (unsigned long long) value);
+    }
+    else
+        this->appendUInt((unsigned long long) value);
+}
+
+void ZMQHeaderWriter::appendDouble(double value)
+{
+    char *p = this->reserve(32);
+    int n = epicsSnprintf(p, 32, "%.15g", value);
+
+    if (strtod(p, NULL) != value)
+        n = epicsSnprintf(p, 32, "%.17g", value);
+    this->size += n;
+}
+
+void ZMQHeaderWriter::appendFloat(float value)
+{
+    char *p = this->reserve(32);
+    int n = epicsSnprintf(p, 32, "%.6g", value);
+
+    if (strtof(p, NULL) != value)
+        n = epicsSnprintf(p, 32, "%.9g", value);
+    this->size += n;
+}
+
+/* a quoted JSON string, escaping quotes, backslashes and control characters */
+void ZMQHeaderWriter::appendString(const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    /* the worst case, every character escaped as \u00XX */
+    char *p = this->reserve(6 * n + 2), *start = p;
+
+    *p++ = '"';
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char ch = (unsigned char) s[i];
+        if (ch == '"' || ch == '\\')
+        {
+            *p++ = '\\';
+            *p++ = (char) ch;
+        }
+        else if (ch < 0x20)
+        {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[ch >> 4];
+            p[5] = hex[ch & 0xF];
+            p += 6;
+        }
+        else
+            *p++ = (char) ch;
+    }
+    *p++ = '"';
+    this->size += p - start;
+}
+
+/* read the value of an attribute, false if its type can not be sent */
+bool ZMQHeaderWriter::readAttribute(NDAttribute *pAttr, ZMQWriterAttribute &attribute)
+{
+    NDAttrDataType_t attrDataType;
+    size_t attrDataSize;
+    char value[8];
+
+    pAttr->getValueInfo(&attrDataType, &attrDataSize);
+    if (attrDataType == NDAttrString)
+    {
+        if (this->text.size() < attrDataSize + 1)
+            this->text.resize(attrDataSize + 1);
+        this->text[0] = 0;
+        pAttr->getValue(NDAttrString, &this->text[0], attrDataSize + 1);
+        attribute.value.assign(&this->text[0]);
+    }
+    else if (attrDataSize <= sizeof(value) && jsonTypeName(attrDataType))
+    {
+        pAttr->getValue(attrDataType, value, attrDataSize);
+        attribute.value.assign(value, attrDataSize);
+    }
+    else
+        return false;
+    /* assign reuses the capacity, so a steady stream of attributes allocates nothing */
+    attribute.name.assign(pAttr->getName());
+    attribute.dataType = attrDataType;
+    return true;
+}
+
+/* "name":{ "value":...,"dataType":"..."} */
+void ZMQHeaderWriter::appendAttribute(const ZMQWriterAttribute &attribute)
+{
+    union
+    {
+        epicsInt8 i8;
+        epicsUInt8 u8;
+        epicsInt16 i16;
+        epicsUInt16 u16;
+        epicsInt32 i32;
+        epicsUInt32 u32;
+        epicsFloat32 f32;
+        epicsFloat64 f64;
+    } value;
+
+    if (attribute.dataType != NDAttrString)
+        memcpy(&value, attribute.value.data(), attribute.value.size());
+    this->appendString(attribute.name.data(), attribute.name.size());
+    this->append(":{ \"value\":");
+    switch (attribute.dataType)
+    {
+        case NDAttrInt8:
+            this->appendInt(value.i8);
+            break;
+        case NDAttrUInt8:
+            this->appendUInt(value.u8);
+            break;
+        case NDAttrInt16:
+            this->appendInt(value.i16);
+            break;
+        case NDAttrUInt16:
+            this->appendUInt(value.u16);
+            break;
+        case NDAttrInt32:
+            this->appendInt(value.i32);
+            break;
+        case NDAttrUInt32:
+            this->appendUInt(value.u32);
+            break;
+        case NDAttrFloat32:
+            this->appendFloat(value.f32);
+            break;
+        case NDAttrFloat64:
+            this->appendDouble(value.f64);
+            break;
+        default:
+            this->appendString(attribute.value.data(), attribute.value.size());
+            break;
+    }
+    this->append(",\"dataType\":\"");
+    this->append(attribute.dataType == NDAttrString ? "string" : jsonTypeName(attribute.dataType));
+    this->append("\"}");
+}
+
+void ZMQHeaderWriter::setKeyPeriod(int keyPeriod)
+{
+    this->keyPeriod = keyPeriod > 0 ? keyPeriod : 0;
+}
+
+size_t ZMQHeaderWriter::encode(NDArray *pArray, const epicsTimeStamp &sendTime, int codec)
+{
+    const char *type = jsonTypeName(pArray->dataType);
+    bool sameShape = pArray->dataType == this->dataType && pArray->ndims == this->ndims;
+    bool full = true;
+    size_t numAttributes = 0, numChanged = 0;
+
+    if (type == NULL)
+        return 0;
+    for (int i = 0; sameShape && i < pArray->ndims; i++)
+        sameShape = pArray->dims[i].size == this->dims[i];
+    if (!sameShape)
+    {
+        this->size = 0;
+        this->append("{\"htype\":[\"chunk-1.0\"], \"type\":\"");
+        this->append(type);
+        this->append("\", \"shape\":[");
+        for (int i = 0; i < pArray->ndims; i++)
+        {
+            if (i > 0)
+                this->append(",", 1);
+            this->appendUInt(pArray->dims[i].size);
+            this->dims[i] = pArray->dims[i].size;
+        }
+        this->append("], \"frame\":");
+        this->prefix.assign(&this->buffer[0], this->size);
+        this->dataType = pArray->dataType;
+        this->ndims = pArray->ndims;
+    }
+
+    this->size = 0;
+    this->append(this->prefix.data(), this->prefix.size());
+    this->appendInt(pArray->uniqueId);
+    this->append(", \"timeStamp\":");
+    this->appendDouble(pArray->timeStamp);
+    this->append(", \"epicsTS\":[");
+    this->appendUInt(pArray->epicsTS.secPastEpoch);
+    this->append(",", 1);
+    this->appendUInt(pArray->epicsTS.nsec);
+    this->append("], \"sendTime\":[");
+    this->appendUInt(sendTime.secPastEpoch);
+    this->append(",", 1);
+    this->appendUInt(sendTime.nsec);
+    this->append("], \"ndattr\":{");
+
+    NDAttribute *pAttr = pArray->pAttributeList->next(NULL);
+    for (; pAttr != NULL; pAttr = pArray->pAttributeList->next(pAttr))
+    {
+        if (this->attributes.size() <= numAttributes)
+            this->attributes.resize(numAttributes + 1);
+        if (this->readAttribute(pAttr, this->attributes[numAttributes]))
+            numAttributes++;
+    }
+
+    /* only send the changes while the attributes are the same ones as in the last full set
+     * and most of them have not changed */
+    if (this->keyPeriod > 0 && this->hasBase && ++this->sinceKey < this->keyPeriod &&
+        numAttributes == this->base.size())
+    {
+        full = false;
+        this->changed.assign(numAttributes, false);
+        for (size_t i = 0; i < numAttributes && !full; i++)
+        {
+            const ZMQWriterAttribute &attribute = this->attributes[i], &base = this->base[i];
+            if (attribute.dataType != base.dataType || attribute.name != base.name)
+                full = true;
+            else if (attribute.value != base.value)
+            {
+                this->changed[i] = true;
+                full = 2 * ++numChanged > numAttributes;
+            }
+        }
+    }
+
+    for (size_t i = 0, written = 0; i < numAttributes; i++)
+    {
+        if (!full && !this->changed[i])
+            continue;
+        if (written++ > 0)
+            this->append(",", 1);
+        this->appendAttribute(this->attributes[i]);
+    }
+    this->append("}", 1);
+
+    if (this->keyPeriod > 0 && full)
+    {
+        /* a key from the clock, so that keys of other senders and earlier runs are unlikely to match */
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        epicsUInt32 key = now.secPastEpoch * 1000000u + now.nsec / 1000u;
+        this->baseKey = key == this->baseKey ? key + 1 : key;
+        this->hasBase = true;
+        this->sinceKey = 0;
+        this->base.resize(numAttributes);
+        for (size_t i = 0; i < numAttributes; i++)
+        {
+            this->base[i].name = this->attributes[i].name;
+            this->base[i].dataType = this->attributes[i].dataType;
+            this->base[i].value = this->attributes[i].value;
+        }
+        this->append(", \"ndattrKey\":");
+        this->appendUInt(this->baseKey);
+    }
+    else if (this->keyPeriod > 0)
+    {
+        this->append(", \"ndattrBase\":");
+        this->appendUInt(this->baseKey);
+    }
+    else
+        this->hasBase = false;
+    if (codec != ZMQCodecNone)
+    {
+        NDArrayInfo_t arrayInfo;
+        pArray->getInfo(&arrayInfo);
+        this->append(", \"codec\":\"");
+        this->append(zmqCodecName(codec));
+        this->append("\", \"uncompressedSize\":");
+        this->appendUInt(arrayInfo.totalBytes);
+        this->append(", \"chunkSize\":");
+        this->appendUInt(zmqCodecChunkSize(arrayInfo.bytesPerElement));
+    }
+#ifdef ZMQ_NDARRAY_CODEC
+    else if (!pArray->codec.name.empty())
+    {
+        NDArrayInfo_t arrayInfo;
+        pArray->getInfo(&arrayInfo);
+        this->append(", \"ndcodec\":");
+        this->appendString(pArray->codec.name.data(), pArray->codec.name.size());
+        this->append(", \"uncompressedSize\":");
+        this->appendUInt(arrayInfo.totalBytes);
+        this->append(", \"compressedSize\":");
+        this->appendUInt(pArray->compressedSize);
+    }
+#endif
+    this->append("}", 1);
+    return this->size;
+}
+
+size_t zmqEncodeBatchHeader(NDArray *const *pArrays, size_t count, const epicsTimeStamp &sendTime,
+                            ZMQHeaderWriter &writer, std::vector<char> &buffer)
+{
+    size_t size = 0;
+
+    if (count == 0)
+        return 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t headerSize = writer.encode(pArrays[i], sendTime);
+        if (headerSize == 0)
+            return 0;
+        /* room for the separator before the header and the closing bracket after the last one */
+        if (buffer.size() < size + headerSize + 2)
+            buffer.resize(size + headerSize + 2);
+        buffer[size++] = i == 0 ? '[' : ',';
+        memcpy(&buffer[size], writer.data(), headerSize);
+        size += headerSize;
+    }
+    buffer[size++] = ']';
+    return size;
+}
+
+ZMQAttributeBases::ZMQAttributeBases() :
+        next(0)
+{
+    for (int i = 0; i < ZMQ_ATTRIBUTE_BASES; i++)
+    {
+        this->keys[i] = 0;
+        this->lists[i] = NULL;
+    }
+}
+
+ZMQAttributeBases::~ZMQAttributeBases()
+{
+    for (int i = 0; i < ZMQ_ATTRIBUTE_BASES; i++)
+        delete this->lists[i];
+}
+
+void ZMQAttributeBases::store(epicsUInt32 key, NDAttributeList &attributeList)
+{
+    int slot = this->next;
+
+    /* a repeated key replaces its own set */
+    for (int i = 0; i < ZMQ_ATTRIBUTE_BASES; i++)
+        if (this->lists[i] && this->keys[i] == key)
+            slot = i;
+    if (slot == this->next)
+        this->next = (this->next + 1) % ZMQ_ATTRIBUTE_BASES;
+
+    if (this->lists[slot] == NULL)
+        this->lists[slot] = new NDAttributeList;
+    else
+        this->lists[slot]->clear();
+    attributeList.copy(this->lists[slot]);
+    this->keys[slot] = key;
+}
+
+NDAttributeList *ZMQAttributeBases::find(epicsUInt32 key)
+{
+    for (int i = 0; i < ZMQ_ATTRIBUTE_BASES; i++)
+        if (this->lists[i] && this->keys[i] == key)
+            return this->lists[i];
+    return NULL;
+}
@@ -0,0 +1,331 @@
+/* ZMQHeader.h
+ *
+ * Parsing of the chunk-1.0 data header without building a JSON document.
+ *
+ */
+
+#ifndef ADZMQ_ZMQHEADER_H
+#define ADZMQ_ZMQHEADER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "NDArray.h"
+#include <ADCoreVersion.h>
+
+#include "ZMQCodec.h"
+
+/* NDArrays carry the codec they were compressed with upstream since ADCore R3-4 */
+#if (ADCORE_VERSION > 3) || (ADCORE_VERSION == 3 && ADCORE_REVISION >= 4)
+#define ZMQ_NDARRAY_CODEC
+#endif
+
+/* longest NDArray codec name a header carries */
+#define ZMQ_NDCODEC_NAME_SIZE 8
+
+/* which attributes a header carries */
+typedef enum
+{
+    ZMQAttributesFull, /* all of them */
+    ZMQAttributesKey,  /* all of them, kept by the receiver under attributeKey */
+    ZMQAttributesDelta /* the ones that differ from those kept under attributeKey */
+} ZMQAttributeSet_t;
+
+/* array information parsed from data header */
+struct ChunkInfo
+{
+    int ndims;
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    NDDataType_t dataType;
+    int frame;
+    bool valid;
+    bool hasTimeStamp;      /* the header carried the NDArray time stamps of the sender */
+    double timeStamp;
+    epicsTimeStamp epicsTS;
+    bool hasSendTime;       /* the header carried the time it was sent */
+    epicsTimeStamp sendTime;
+    ZMQAttributeSet_t attributeSet;
+    epicsUInt32 attributeKey;
+    int codec;               /* ZMQCodec_t of the data part */
+    size_t uncompressedSize; /* size of the data once decompressed, when it is compressed */
+    size_t chunkSize;        /* uncompressed bytes in each compressed part */
+    char ndCodec[ZMQ_NDCODEC_NAME_SIZE + 1]; /* codec the array was compressed with upstream, empty if none */
+    size_t compressedSize;   /* size of the data part of an array compressed upstream */
+};
+
+/* chunk-bin-1.0: a fixed little endian layout, followed by a packed attribute table.
+ *
+ *   offset  size
+ *        0    16  htype "chunk-bin-1.0", padded with zeros
+ *       16     2  offset of the attribute table (ZMQ_BINARY_FIXED_SIZE)
+ *       18     1  data type, ZMQBinaryType_t
+ *       19     1  ndims
+ *       20     2  number of attributes
+ *       22     2  reserved
+ *       24     8  frame number
+ *       32     8  NDArray timeStamp, float64
+ *       40     4  NDArray epicsTS.secPastEpoch
+ *       44     4  NDArray epicsTS.nsec
+ *       48    80  dims, 10 x uint64
+ *      128     4  send time, secPastEpoch
+ *      132     4  send time, nsec
+ *      136     8  uncompressed size of the data
+ *      144     4  chunk size
+ *      148     1  codec, ZMQCodec_t
+ *      149     3  reserved
+ *      152     8  compressed size of an array compressed upstream
+ *      160     8  NDArray codec name, padded with zeros
+ *
+ * A header whose attribute table starts at 128 has no send time, one starting at 136 no codec
+ * and one starting at 152 no NDArray codec.
+ * Each attribute is 1 byte type, 1 byte name length, 2 bytes value length, the name and the value.
+ * Strings are not null terminated. */
+#define ZMQ_BINARY_HTYPE "chunk-bin-1.0"
+#define ZMQ_BINARY_HTYPE_SIZE 16
+#define ZMQ_BINARY_MAX_DIMS 10
+#define ZMQ_BINARY_FIXED_SIZE 168
+/* fixed part of a header without the send time */
+#define ZMQ_BINARY_MIN_FIXED_SIZE 128
+/* fixed part of a header without the codec */
+#define ZMQ_BINARY_SEND_TIME_FIXED_SIZE 136
+/* fixed part of a header without the NDArray codec */
+#define ZMQ_BINARY_CODEC_FIXED_SIZE 152
+
+/* type codes of chunk-bin-1.0, independent of the ADCore version */
+typedef enum
+{
+    ZMQBinaryInt8,
+    ZMQBinaryUInt8,
+    ZMQBinaryInt16,
+    ZMQBinaryUInt16,
+    ZMQBinaryInt32,
+    ZMQBinaryUInt32,
+    ZMQBinaryInt64,
+    ZMQBinaryUInt64,
+    ZMQBinaryFloat32,
+    ZMQBinaryFloat64,
+    ZMQBinaryString
+} ZMQBinaryType_t;
+
+/* an attribute of a parsed header */
+struct ZMQHeaderAttribute
+{
+    std::string name;
+    NDAttrDataType_t dataType;
+    int number;        /* index of its value among the numbers in the header, -1 for a string */
+    std::string value; /* value of a string attribute */
+};
+
+/* where the values of a parsed header were found, numbers are counted in the order they appear */
+struct ZMQHeaderLayout
+{
+    int numbers;
+    int frameNumber;
+    int shapeNumbers[ND_ARRAY_MAX_DIMS];
+    int timeStampNumber;
+    int epicsTSNumbers[2];  /* secPastEpoch, nsec */
+    int sendTimeNumbers[2]; /* secPastEpoch, nsec */
+    int attributeKeyNumber;
+    int uncompressedSizeNumber;
+    int chunkSizeNumber;
+    int compressedSizeNumber;
+    std::vector<ZMQHeaderAttribute> attributes;
+};
+
+/* position of a number in a header */
+struct ZMQHeaderNumber
+{
+    ZMQHeaderNumber() : offset(0), len(0) {}
+    size_t offset;
+    size_t len;
+};
+
+/** Parse a chunk-1.0 JSON header in a single pass.
+  * The header does not need to be null terminated and is not modified.
+  * \param[in] msg The header.
+  * \param[in] len Length of the header in bytes.
+  * \param[out] info The array information, info.valid is false if the header could not be used.
+  * \param[out] attributeList Receives the attributes found in "ndattr".
+  * \param[out] layout If not NULL, records where the frame, shape and attribute values were found. */
+void zmqParseJSONHeader(const char *msg, size_t len, ChunkInfo &info, NDAttributeList &attributeList,
+                        ZMQHeaderLayout *layout = NULL);
+
+/** Check whether a header is chunk-bin-1.0. */
+bool zmqIsBinaryHeader(const char *msg, size_t len);
+
+/** Decode a chunk-bin-1.0 header.
+  * \param[in] msg The header.
+  * \param[in] len Length of the header in bytes.
+  * \param[out] info The array information, info.valid is false if the header could not be used.
+  * \param[out] attributeList Receives the attributes in the header. */
+void zmqParseBinaryHeader(const char *msg, size_t len, ChunkInfo &info, NDAttributeList &attributeList);
+
+/** Encode the chunk-bin-1.0 header of an NDArray.
+  * \param[in] pArray The array.
+  * \param[in] sendTime The time the header is sent.
+  * \param[in,out] buffer Receives the header, reused between calls to avoid allocation.
+  * \param[in] codec The ZMQCodec_t the data is sent with.
+  * \return The header size, 0 if the data type can not be sent. */
+size_t zmqEncodeBinaryHeader(NDArray *pArray, const epicsTimeStamp &sendTime, std::vector<char> &buffer,
+                             int codec = ZMQCodecNone);
+
+/* a chunk-1.0 header within a batch header */
+struct ZMQBatchEntry
+{
+    size_t offset;
+    size_t len;
+};
+
+/** Check whether a header is a batch header: a JSON array of the chunk-1.0 headers of several
+  * arrays, whose data follows in a single part, one array after the other. */
+bool zmqIsBatchHeader(const char *msg, size_t len);
+
+/** Find the chunk-1.0 headers in a batch header, without parsing them.
+  * \param[in] msg The batch header.
+  * \param[in] len Length of the batch header in bytes.
+  * \param[out] entries Receives where each header is, reused between calls to avoid allocation.
+  * \return false if the batch header is malformed or empty. */
+bool zmqSplitBatchHeader(const char *msg, size_t len, std::vector<ZMQBatchEntry> &entries);
+
+/* an attribute read by ZMQHeaderWriter, the value as raw bytes */
+struct ZMQWriterAttribute
+{
+    std::string name;
+    NDAttrDataType_t dataType;
+    std::string value;
+};
+
+/** Composes chunk-1.0 JSON headers into a buffer that is reused from one header to the next.
+  * The part up to the frame number only depends on the data type and shape, and is kept
+  * until they change. Numbers are formatted without going through a stream, and floating
+  * point values with the fewest digits that read back as the same value.
+  * With a key period set, a header carries every attribute only every keyPeriod headers, or
+  * when the attributes have changed too much; the headers in between carry "ndattrBase"
+  * and only the attributes that differ from that full set.
+  * Used by a single thread. */
+class ZMQHeaderWriter
+{
+public:
+    ZMQHeaderWriter();
+
+    /** Compose the header of an NDArray.
+      * \param[in] pArray The array.
+      * \param[in] sendTime The time the header is sent.
+      * \param[in] codec The ZMQCodec_t the data is sent with.
+      * \return The header size, 0 if the data type can not be sent. */
+    size_t encode(NDArray *pArray, const epicsTimeStamp &sendTime, int codec = ZMQCodecNone);
+
+    /** Headers between two that carry every attribute, 0 to always carry every attribute. */
+    void setKeyPeriod(int keyPeriod);
+
+    /** The last header composed, not null terminated. */
+    const char *data() const { return &this->buffer[0]; }
+
+private:
+    char *reserve(size_t n);
+    void append(const char *s, size_t n);
+    void append(const char *s) { this->append(s, strlen(s)); }
+    void appendInt(long long value);
+    void appendUInt(unsigned long long value);
+    void appendDouble(double value);
+    void appendFloat(float value);
+    void appendString(const char *s, size_t n);
+    bool readAttribute(NDAttribute *pAttr, ZMQWriterAttribute &attribute);
+    void appendAttribute(const ZMQWriterAttribute &attribute);
+
+    std::vector<char> buffer; /* grows to the largest header seen and then stays */
+    size_t size;              /* bytes used in buffer */
+    std::vector<char> text;   /* value of a string attribute before it is escaped */
+    std::string prefix;       /* the header up to the frame number */
+    NDDataType_t dataType;    /* data type and shape the prefix was made for */
+    int ndims;
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    std::vector<ZMQWriterAttribute> attributes; /* attributes of the array being encoded */
+    std::vector<ZMQWriterAttribute> base;       /* attributes of the last header that carried them all */
+    std::vector<bool> changed;
+    int keyPeriod;
+    int sinceKey;                               /* headers since the last one that carried them all */
+    epicsUInt32 baseKey;
+    bool hasBase;
+};
+
+/** Compose the batch header of several NDArrays sent uncompressed in one message.
+  * \param[in] pArrays The arrays.
+  * \param[in] count Number of arrays.
+  * \param[in] sendTime The time the header is sent.
+  * \param[in,out] writer Composes the chunk-1.0 header of each array.
+  * \param[in,out] buffer Receives the batch header, reused between calls to avoid allocation.
+  * \return The header size, 0 if there are no arrays or the data type of one can not be sent. */
+size_t zmqEncodeBatchHeader(NDArray *const *pArrays, size_t count, const epicsTimeStamp &sendTime,
+                            ZMQHeaderWriter &writer, std::vector<char> &buffer);
+
+/* full attribute sets a receive thread keeps */
+#define ZMQ_ATTRIBUTE_BASES 8
+
+/** The last full attribute sets a receive thread has seen, for headers carrying only the
+  * attributes that differ from one of them. Used by a single thread. */
+class ZMQAttributeBases
+{
+public:
+    ZMQAttributeBases();
+    ~ZMQAttributeBases();
+
+    /** Keep a copy of the attributes of a header under its key, replacing the oldest set. */
+    void store(epicsUInt32 key, NDAttributeList &attributeList);
+
+    /** The set kept under a key, NULL if there is none. */
+    NDAttributeList *find(epicsUInt32 key);
+
+private:
+    epicsUInt32 keys[ZMQ_ATTRIBUTE_BASES];
+    NDAttributeList *lists[ZMQ_ATTRIBUTE_BASES]; /* NULL until used */
+    int next;
+};
+
+/** Look up a string member at the top level of a JSON header.
+  * \param[in] msg The header.
+  * \param[in] len Length of the header in bytes.
+  * \param[in] key Name of the member.
+  * \param[out] value Null terminated value, truncated to maxChars-1 characters.
+  * \param[in] maxChars Size of value.
+  * \return true if the member exists and is a string. */
+bool zmqHeaderGetString(const char *msg, size_t len, const char *key, char *value, size_t maxChars);
+
+/** Remembers the last header so that a header which differs from it only in its numbers
+  * (frame, shape and numeric attribute values) is not parsed again.
+  * Headers are compared by their bytes outside numbers; on a match the numbers are read
+  * from the positions found when the header was last parsed.
+  * Used by a single thread, only the counters may be read from others. */
+class ZMQHeaderCache
+{
+public:
+    ZMQHeaderCache();
+
+    /** Parse a header like zmqParseJSONHeader.
+      * \return true if the cached header was reused. */
+    bool parse(const char *msg, size_t len, ChunkInfo &info, NDAttributeList &attributeList);
+    void clear();
+    void resetStatistics();
+
+    std::atomic<int> hits;
+    std::atomic<int> misses;
+
+private:
+    void scan(const char *msg, size_t len);
+    double number(const char *msg, int index);
+
+    std::string skeleton;              /* the header being parsed without its numbers */
+    std::vector<ZMQHeaderNumber> numbers;
+    bool cached;
+    std::string previous;              /* last header read from the cache and its numbers */
+    std::vector<ZMQHeaderNumber> previousNumbers;
+    std::vector<double> values;
+    std::string cachedSkeleton;
+    ChunkInfo cachedInfo;
+    ZMQHeaderLayout layout;
+};
+
+#endif //ADZMQ_ZMQHEADER_H
@@ -0,0 +1,180 @@
+/* ZMQStageTimer.cpp
+ *
+ * Monotonic clock, latency windows and publishing of the stage timing histograms.
+ * The clock is here rather than in the header so that windows.h is not needed there.
+ *
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <string>
+#include <algorithm>
+
+#include <asynPortDriver.h>
+
+#include "ZMQStageTimer.h"
+
+uint64_t zmqMonotonicNs()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000u +
+           (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000u / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/* percentiles published for each latency, the last is the maximum */
+static const int numPercentiles = 4;
+static const double percents[numPercentiles] = {50, 90, 99, 100};
+static const char *const percentNames[numPercentiles] = {"P50", "P90", "P99", "MAX"};
+
+ZMQLatencyWindow::ZMQLatencyWindow() :
+        mutex(epicsMutexMustCreate()), samples(ZMQ_LATENCY_WINDOW), next(0)
+{
+}
+
+ZMQLatencyWindow::~ZMQLatencyWindow()
+{
+    epicsMutexDestroy(this->mutex);
+}
+
+void ZMQLatencyWindow::record(double seconds)
+{
+    epicsMutexLock(this->mutex);
+    this->samples[this->next++ % ZMQ_LATENCY_WINDOW] = seconds;
+    epicsMutexUnlock(this->mutex);
+}
+
+void ZMQLatencyWindow::reset()
+{
+    epicsMutexLock(this->mutex);
+    this->next = 0;
+    epicsMutexUnlock(this->mutex);
+}
+
+size_t ZMQLatencyWindow::percentiles(int num, const double *pPercents, double *pValues)
+{
+    size_t n;
+    std::vector<double> sorted;
+
+    /* the copy keeps the time the mutex is held short, the ring is only ever a few kB */
+    epicsMutexLock(this->mutex);
+    n = std::min(this->next, (size_t) ZMQ_LATENCY_WINDOW);
+    sorted.assign(this->samples.begin(), this->samples.begin() + n);
+    epicsMutexUnlock(this->mutex);
+
+    for (int i = 0; i < num; i++)
+    {
+        if (n == 0)
+        {
+            pValues[i] = 0;
+            continue;
+        }
+        /* nearest rank */
+        size_t rank = (size_t) (pPercents[i] / 100. * n + 0.5);
+        rank = rank < 1 ? 0 : std::min(rank, n) - 1;
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        pValues[i] = sorted[rank];
+    }
+    return n;
+}
+
+ZMQStageTimes::ZMQStageTimes(int numStages, const char *const *names, int numLatencies,
+                             const char *const *latencyNames) :
+        resetParam(-1), numStages(numStages), names(names),
+        numLatencies(numLatencies), latencyNames(latencyNames), lastPublished(0)
+{
+    if (this->numStages > ZMQ_MAX_STAGES)
+        this->numStages = ZMQ_MAX_STAGES;
+    if (this->numLatencies > ZMQ_MAX_LATENCIES)
+        this->numLatencies = ZMQ_MAX_LATENCIES;
+}
+
+void ZMQStageTimes::createParams(asynPortDriver *pPort)
+{
+    pPort->createParam("ZMQ_STAGE_RESET", asynParamInt32, &this->resetParam);
+    for (int i = 0; i < this->numStages; i++)
+    {
+        std::string name(this->names[i]);
+        pPort->createParam(("ZMQ_STAGE_HIST_" + name).c_str(), asynParamInt32Array, &this->histParams[i]);
+        pPort->createParam(("ZMQ_STAGE_MEAN_" + name).c_str(), asynParamFloat64, &this->meanParams[i]);
+        pPort->createParam(("ZMQ_STAGE_MAX_" + name).c_str(), asynParamFloat64, &this->maxParams[i]);
+    }
+    for (int i = 0; i < this->numLatencies; i++)
+    {
+        std::string name(this->latencyNames[i]);
+        for (int j = 0; j < numPercentiles; j++)
+            pPort->createParam(("ZMQ_LATENCY_" + name + "_" + percentNames[j]).c_str(), asynParamFloat64,
+                               &this->latencyParams[i][j]);
+    }
+}
+
+void ZMQStageTimes::publish(asynPortDriver *pPort)
+{
+    epicsInt32 bins[ZMQ_HISTOGRAM_BINS];
+
+    for (int i = 0; i < this->numStages; i++)
+    {
+        this->stages[i].getBins(bins);
+        pPort->doCallbacksInt32Array(bins, ZMQ_HISTOGRAM_BINS, this->histParams[i], 0);
+        pPort->setDoubleParam(this->meanParams[i], this->stages[i].mean());
+        pPort->setDoubleParam(this->maxParams[i], this->stages[i].max());
+    }
+    for (int i = 0; i < this->numLatencies; i++)
+    {
+        double values[numPercentiles];
+        this->latencies[i].percentiles(numPercentiles, percents, values);
+        for (int j = 0; j < numPercentiles; j++)
+            pPort->setDoubleParam(this->latencyParams[i][j], values[j]);
+    }
+    this->lastPublished = zmqMonotonicNs();
+}
+
+void ZMQStageTimes::publishIfDue(asynPortDriver *pPort)
+{
+    if (zmqMonotonicNs() - this->lastPublished >= 1000000000u)
+        this->publish(pPort);
+}
+
+void ZMQStageTimes::reset()
+{
+    for (int i = 0; i < this->numStages; i++)
+        this->stages[i].reset();
+    for (int i = 0; i < this->numLatencies; i++)
+        this->latencies[i].reset();
+}
+
+void ZMQStageTimes::report(FILE *fp)
+{
+    epicsInt32 bins[ZMQ_HISTOGRAM_BINS];
+
+    fprintf(fp, "  Stage timing:\n");
+    for (int i = 0; i < this->numStages; i++)
+    {
+        fprintf(fp, "    %-12s %10lu frames, mean %10.3f us, max %10.3f us\n", this->names[i],
+                (unsigned long) this->stages[i].count(), this->stages[i].mean() * 1e6, this->stages[i].max() * 1e6);
+        this->stages[i].getBins(bins);
+        for (int j = 0; j < ZMQ_HISTOGRAM_BINS; j++)
+            if (bins[j])
+                fprintf(fp, "      >= %12.3f us: %d\n", (j ? (double) (1ull << j) : 0.) * 1e-3, bins[j]);
+    }
+    for (int i = 0; i < this->numLatencies; i++)
+    {
+        double values[numPercentiles];
+        size_t n = this->latencies[i].percentiles(numPercentiles, percents, values);
+        fprintf(fp, "  Latency %-10s %5lu frames, p50 %10.3f us, p90 %10.3f us, p99 %10.3f us, max %10.3f us\n",
+                this->latencyNames[i], (unsigned long) n, values[0] * 1e6, values[1] * 1e6, values[2] * 1e6,
+                values[3] * 1e6);
+    }
+}
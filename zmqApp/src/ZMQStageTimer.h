@@ -0,0 +1,199 @@
+/* ZMQStageTimer.h
+ *
+ * Monotonic clock and lock-free log-scale histograms to time the stages a frame goes through,
+ * and rolling windows of the latency from the sender.
+ *
+ */
+
+#ifndef ADZMQ_ZMQSTAGETIMER_H
+#define ADZMQ_ZMQSTAGETIMER_H
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsMutex.h>
+
+class asynPortDriver;
+
+/* bin i counts durations of [2^i, 2^(i+1)) ns, the last bin also counts everything longer */
+#define ZMQ_HISTOGRAM_BINS 32
+/* most stages a ZMQStageTimes can hold */
+#define ZMQ_MAX_STAGES 8
+/* number of most recent frames the latency percentiles are taken over */
+#define ZMQ_LATENCY_WINDOW 1000
+/* most latencies a ZMQStageTimes can hold */
+#define ZMQ_MAX_LATENCIES 4
+
+/** Nanoseconds from a clock that never goes backwards, for measuring intervals only. */
+uint64_t zmqMonotonicNs();
+
+/** Histogram of durations with power of two bins.
+  * record() may be called from any number of threads at once, readers see a consistent enough
+  * snapshot for monitoring but not an atomic one. */
+class ZMQHistogram
+{
+public:
+    ZMQHistogram()
+    {
+        this->reset();
+    }
+
+    void record(uint64_t ns)
+    {
+        int bin = 0;
+        uint64_t max = this->maximum.load(std::memory_order_relaxed);
+
+#ifdef __GNUC__
+        if (ns > 1)
+            bin = 63 - __builtin_clzll(ns);
+#else
+        for (uint64_t v = ns; v > 1; v >>= 1)
+            bin++;
+#endif
+        if (bin >= ZMQ_HISTOGRAM_BINS)
+            bin = ZMQ_HISTOGRAM_BINS - 1;
+        this->bins[bin].fetch_add(1, std::memory_order_relaxed);
+        this->total.fetch_add(1, std::memory_order_relaxed);
+        this->sum.fetch_add(ns, std::memory_order_relaxed);
+        while (ns > max && !this->maximum.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+    }
+
+    void reset()
+    {
+        for (int i = 0; i < ZMQ_HISTOGRAM_BINS; i++)
+            this->bins[i].store(0, std::memory_order_relaxed);
+        this->total.store(0, std::memory_order_relaxed);
+        this->sum.store(0, std::memory_order_relaxed);
+        this->maximum.store(0, std::memory_order_relaxed);
+    }
+
+    /** Copy the bin counts, saturated to fit an epicsInt32. */
+    void getBins(epicsInt32 *pBins) const
+    {
+        for (int i = 0; i < ZMQ_HISTOGRAM_BINS; i++)
+        {
+            epicsUInt32 n = this->bins[i].load(std::memory_order_relaxed);
+            pBins[i] = n > 0x7FFFFFFF ? 0x7FFFFFFF : (epicsInt32) n;
+        }
+    }
+
+    uint64_t count() const
+    {
+        return this->total.load(std::memory_order_relaxed);
+    }
+
+    /** Mean duration in seconds, 0 if nothing was recorded. */
+    double mean() const
+    {
+        uint64_t n = this->count();
+        return n ? this->sum.load(std::memory_order_relaxed) / (double) n * 1e-9 : 0;
+    }
+
+    /** Longest duration in seconds. */
+    double max() const
+    {
+        return this->maximum.load(std::memory_order_relaxed) * 1e-9;
+    }
+
+private:
+    std::atomic<epicsUInt32> bins[ZMQ_HISTOGRAM_BINS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maximum;
+};
+
+/** Time one stage: created at the start of the stage, stop() records the time since then
+  * and starts timing the next stage. */
+class ZMQStageClock
+{
+public:
+    ZMQStageClock() : start(zmqMonotonicNs())
+    {
+    }
+
+    void stop(ZMQHistogram &histogram)
+    {
+        uint64_t now = zmqMonotonicNs();
+        histogram.record(now - this->start);
+        this->start = now;
+    }
+
+    void restart()
+    {
+        this->start = zmqMonotonicNs();
+    }
+
+private:
+    uint64_t start;
+};
+
+/** The latencies of the most recent frames, for percentiles.
+  * Latencies are measured between the clocks of two hosts, so they may even be negative. */
+class ZMQLatencyWindow
+{
+public:
+    ZMQLatencyWindow();
+    ~ZMQLatencyWindow();
+
+    /** Add the latency of a frame in seconds, may be called from any thread. */
+    void record(double seconds);
+    void reset();
+    /** Get the given percentiles (0-100) of the latencies in the window.
+      * \return The number of latencies in the window, the percentiles are 0 if there are none. */
+    size_t percentiles(int num, const double *pPercents, double *pValues);
+
+private:
+    epicsMutexId mutex;
+    std::vector<double> samples; /* ring of the last ZMQ_LATENCY_WINDOW latencies */
+    size_t next;                 /* total number recorded, the next is written at next % ZMQ_LATENCY_WINDOW */
+};
+
+/** The histograms of the stages of one driver or plugin and the asyn parameters they are published in.
+  * For a stage named NAME these are ZMQ_STAGE_HIST_NAME (Int32 array of the bin counts),
+  * ZMQ_STAGE_MEAN_NAME and ZMQ_STAGE_MAX_NAME (Float64 in seconds).
+  * For a latency named NAME these are ZMQ_LATENCY_NAME_P50, _P90, _P99 and _MAX (Float64 in seconds).
+  * ZMQ_STAGE_RESET clears the histograms and latencies when written. */
+class ZMQStageTimes
+{
+public:
+    ZMQStageTimes(int numStages, const char *const *names, int numLatencies = 0, const char *const *latencyNames = NULL);
+
+    /** Create the parameters, called from the constructor of the port. */
+    void createParams(asynPortDriver *pPort);
+    /** Set the parameters and do the array callbacks, called with the port locked. */
+    void publish(asynPortDriver *pPort);
+    /** publish() if it was last done more than a second ago. */
+    void publishIfDue(asynPortDriver *pPort);
+    void reset();
+    void report(FILE *fp);
+
+    ZMQHistogram &operator[](int stage)
+    {
+        return this->stages[stage];
+    }
+
+    ZMQLatencyWindow &latency(int index)
+    {
+        return this->latencies[index];
+    }
+
+    int resetParam;
+
+private:
+    int numStages;
+    const char *const *names;
+    ZMQHistogram stages[ZMQ_MAX_STAGES];
+    int histParams[ZMQ_MAX_STAGES];
+    int meanParams[ZMQ_MAX_STAGES];
+    int maxParams[ZMQ_MAX_STAGES];
+    int numLatencies;
+    const char *const *latencyNames;
+    ZMQLatencyWindow latencies[ZMQ_MAX_LATENCIES];
+    int latencyParams[ZMQ_MAX_LATENCIES][4]; /* P50, P90, P99, MAX */
+    uint64_t lastPublished;
+};
+
+#endif //ADZMQ_ZMQSTAGETIMER_H